@@ -0,0 +1,94 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "chainparamsbase.h"
+#include "consensus/consensus.h"
+#include "miner.h"
+#include "policy/policy.h"
+#include "random.h"
+#include "txmempool.h"
+#include "validation.h"
+
+#include <vector>
+
+// Fill the mempool with nTx transactions forming random chains and trees of
+// up to 25 transactions, spending up to three unconfirmed outputs each.
+static void FillMempool(CTxMemPool& pool, int nTx)
+{
+    FastRandomContext rand(true);
+    // Unconfirmed outputs, with an upper bound on the ancestor count of their transaction
+    std::vector<std::pair<COutPoint, int> > vOutputs;
+    LockPoints lp;
+    LOCK(pool.cs);
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        int nAncestors = 1;
+        int nInputs = 1 + rand.randrange(3);
+        for (int j = 0; j < nInputs; j++) {
+            size_t n = vOutputs.empty() ? 0 : rand.randrange(vOutputs.size());
+            if (vOutputs.empty() || rand.randrange(4) == 0 || nAncestors + vOutputs[n].second > 25) {
+                tx.vin.emplace_back(COutPoint(rand.rand256(), 0));
+            } else {
+                tx.vin.emplace_back(vOutputs[n].first);
+                nAncestors += vOutputs[n].second;
+                vOutputs[n] = vOutputs.back();
+                vOutputs.pop_back();
+            }
+            tx.vin.back().scriptSig = CScript() << std::vector<unsigned char>(72 + rand.randrange(40));
+        }
+        tx.vout.resize(1 + rand.randrange(2));
+        for (CTxOut& txout : tx.vout) {
+            txout.nValue = COIN;
+            txout.scriptPubKey = CScript() << OP_TRUE;
+        }
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            vOutputs.emplace_back(COutPoint(tx.GetHash(), j), nAncestors);
+        }
+        CAmount nFee = 1000 + rand.randrange(200000);
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(MakeTransactionRef(tx), nFee, 0, 1, false, 4, lp));
+    }
+}
+
+static CAmount SelectTransactions(const CChainParams& params, bool fHeapSelection)
+{
+    BlockAssembler::Options options;
+    options.nBlockMaxWeight = DEFAULT_BLOCK_MAX_WEIGHT;
+    options.fHeapSelection = fHeapSelection;
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(params, options).SelectTransactions(1, 0, true);
+    return -pblocktemplate->vTxFees[0];
+}
+
+// Template construction from a mempool of several full blocks, with
+// each package selection algorithm. The heap selection must collect at
+// least the fees of addPackageTxs.
+static void BlockAssemble(benchmark::State& state, bool fHeapSelection)
+{
+    const std::unique_ptr<CChainParams> params = CreateChainParams(CBaseChainParams::MAIN);
+    mempool.clear();
+    FillMempool(mempool, 20000);
+
+    CAmount nFeesAncestor = SelectTransactions(*params, false);
+    CAmount nFeesHeap = SelectTransactions(*params, true);
+    assert(nFeesHeap >= nFeesAncestor);
+
+    while (state.KeepRunning()) {
+        SelectTransactions(*params, fHeapSelection);
+    }
+    mempool.clear();
+}
+
+static void BlockAssembleAncestor(benchmark::State& state)
+{
+    BlockAssemble(state, false);
+}
+
+static void BlockAssembleHeap(benchmark::State& state)
+{
+    BlockAssemble(state, true);
+}
+
+BENCHMARK(BlockAssembleAncestor);
+BENCHMARK(BlockAssembleHeap);
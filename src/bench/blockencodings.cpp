@@ -0,0 +1,64 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "blockencodings.h"
+#include "consensus/merkle.h"
+#include "txmempool.h"
+
+#include <vector>
+
+static void AddTx(const CTransactionRef& tx, CTxMemPool& pool)
+{
+    LockPoints lp;
+    pool.addUnchecked(tx->GetHash(), CTxMemPoolEntry(tx, 1000, 0, 1, false, 4, lp));
+}
+
+// Reconstruct a 2000 transaction compact block against a synthetic mempool of
+// 100k unrelated transactions. Every reconstruction has to compute the short ID
+// of each mempool entry, so this measures how InitData scales with mempool size.
+static void CompactBlockReconstruction(benchmark::State& state)
+{
+    const size_t nMempoolTxs = 100000;
+    const size_t nBlockTxs = 2000;
+
+    CTxMemPool pool;
+    CBlock block;
+    block.nBits = 0x207fffff;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 1;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+
+    for (size_t i = 0; i < nMempoolTxs; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vin[0].prevout.hash = ArithToUint256(arith_uint256(i + 1));
+        tx.vin[0].prevout.n = 0;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        CTransactionRef txref = MakeTransactionRef(tx);
+        AddTx(txref, pool);
+        if (i % (nMempoolTxs / nBlockTxs) == 0)
+            block.vtx.push_back(txref);
+    }
+    bool mutated;
+    block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block, true);
+    std::vector<std::pair<uint256, CTransactionRef>> extra_txn;
+
+    while (state.KeepRunning()) {
+        PartiallyDownloadedBlock partialBlock(&pool);
+        ReadStatus status = partialBlock.InitData(cmpctblock, extra_txn);
+        assert(status == READ_STATUS_OK);
+    }
+}
+
+BENCHMARK(CompactBlockReconstruction);
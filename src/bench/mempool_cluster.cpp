@@ -0,0 +1,97 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "policy/policy.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <vector>
+
+static const int CLUSTER_TXS = 100;
+
+static void AddTx(const CTransaction& tx, const CAmount& nFee, CTxMemPool& pool)
+{
+    LockPoints lp;
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(MakeTransactionRef(tx), nFee, 0, 1, false, 4, lp));
+}
+
+// One chain of transactions, each spending the only output of the previous one
+static std::vector<CTransaction> CreateChain(int nTx)
+{
+    std::vector<CTransaction> vTxs;
+    COutPoint prevout(GetRandHash(), 0);
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.emplace_back(prevout);
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.emplace_back(COIN, CScript() << OP_1 << OP_EQUAL);
+        vTxs.emplace_back(tx);
+        prevout = COutPoint(tx.GetHash(), 0);
+    }
+    return vTxs;
+}
+
+// A transaction with nTx - 1 children, one per output
+static std::vector<CTransaction> CreateFanout(int nTx)
+{
+    std::vector<CTransaction> vTxs;
+    CMutableTransaction parent;
+    parent.vin.emplace_back(COutPoint(GetRandHash(), 0));
+    parent.vin[0].scriptSig = CScript() << OP_1;
+    parent.vout.resize(nTx - 1, CTxOut(COIN, CScript() << OP_1 << OP_EQUAL));
+    vTxs.emplace_back(parent);
+    for (int i = 0; i < nTx - 1; i++) {
+        CMutableTransaction tx;
+        tx.vin.emplace_back(COutPoint(parent.GetHash(), i));
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.emplace_back(COIN, CScript() << OP_1 << OP_EQUAL);
+        vTxs.emplace_back(tx);
+    }
+    return vTxs;
+}
+
+// Add a cluster with varying fees to an empty mempool, then size limit
+// the mempool to half its usage, with or without cluster tracking.
+static void MempoolCluster(benchmark::State& state, const std::vector<CTransaction>& vTxs, bool fClusters)
+{
+    FastRandomContext rand(true);
+    std::vector<CAmount> vFees;
+    for (size_t i = 0; i < vTxs.size(); i++) {
+        vFees.push_back(1000 + rand.randrange(100000));
+    }
+    while (state.KeepRunning()) {
+        CTxMemPool pool;
+        pool.SetClusterTracking(fClusters);
+        for (size_t i = 0; i < vTxs.size(); i++) {
+            AddTx(vTxs[i], vFees[i], pool);
+        }
+        pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+    }
+}
+
+static void MempoolChainAncestors(benchmark::State& state)
+{
+    MempoolCluster(state, CreateChain(CLUSTER_TXS), false);
+}
+
+static void MempoolChainClusters(benchmark::State& state)
+{
+    MempoolCluster(state, CreateChain(CLUSTER_TXS), true);
+}
+
+static void MempoolFanoutAncestors(benchmark::State& state)
+{
+    MempoolCluster(state, CreateFanout(CLUSTER_TXS), false);
+}
+
+static void MempoolFanoutClusters(benchmark::State& state)
+{
+    MempoolCluster(state, CreateFanout(CLUSTER_TXS), true);
+}
+
+BENCHMARK(MempoolChainAncestors);
+BENCHMARK(MempoolChainClusters);
+BENCHMARK(MempoolFanoutAncestors);
+BENCHMARK(MempoolFanoutClusters);
@@ -4,6 +4,7 @@
 
 #include "bench.h"
 #include "policy/policy.h"
+#include "random.h"
 #include "txmempool.h"
 
 #include <list>
@@ -111,4 +112,49 @@ static void MempoolEviction(benchmark::State& state)
     }
 }
 
+// Fill a mempool with thousands of unique transactions, some of them
+// spending earlier ones, and evict half of it. This stresses the per-entry
+// bookkeeping: the entry index, the parent and child links and mapNextTx.
+static void MempoolEvictionLarge(benchmark::State& state)
+{
+    const int nTxs = 5000;
+    FastRandomContext rand(true);
+    std::vector<CTransaction> vTxs;
+    std::vector<CAmount> vFees;
+    std::vector<COutPoint> vOutputs;
+    for (int i = 0; i < nTxs; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1 + rand.randrange(2));
+        for (CTxIn& txin : tx.vin) {
+            if (!vOutputs.empty() && rand.randrange(3) == 0) {
+                size_t n = rand.randrange(vOutputs.size());
+                txin.prevout = vOutputs[n];
+                vOutputs.erase(vOutputs.begin() + n);
+            } else {
+                txin.prevout = COutPoint(rand.rand256(), 0);
+            }
+            txin.scriptSig = CScript() << OP_1;
+        }
+        tx.vout.resize(1 + rand.randrange(2));
+        for (CTxOut& txout : tx.vout) {
+            txout.scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+            txout.nValue = COIN;
+        }
+        vTxs.emplace_back(tx);
+        vFees.push_back(1000 + rand.randrange(50000));
+        for (uint32_t n = 0; n < tx.vout.size(); n++) {
+            vOutputs.emplace_back(vTxs.back().GetHash(), n);
+        }
+    }
+
+    while (state.KeepRunning()) {
+        CTxMemPool pool;
+        for (int i = 0; i < nTxs; i++) {
+            AddTx(vTxs[i], vFees[i], pool);
+        }
+        pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+    }
+}
+
 BENCHMARK(MempoolEviction);
+BENCHMARK(MempoolEvictionLarge);
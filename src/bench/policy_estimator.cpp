@@ -0,0 +1,87 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "policy/fees.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <vector>
+
+static const int BLOCK_TXS = 100;
+
+// Transactions with distinct hashes; their fees are chosen per block
+static std::vector<CTransactionRef> CreateTxs()
+{
+    std::vector<CTransactionRef> vTxs;
+    for (int i = 0; i < BLOCK_TXS; i++) {
+        CMutableTransaction tx;
+        tx.vin.emplace_back(COutPoint(GetRandHash(), 0));
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.emplace_back(COIN, CScript() << OP_1 << OP_EQUAL);
+        vTxs.push_back(MakeTransactionRef(tx));
+    }
+    return vTxs;
+}
+
+// Track a block's worth of transactions entering the mempool at nHeight and
+// confirm them all in the next block
+static void ProcessBlock(CBlockPolicyEstimator& estimator, const std::vector<CTransactionRef>& vTxs, unsigned int& nHeight, FastRandomContext& rand)
+{
+    LockPoints lp;
+    std::vector<CTxMemPoolEntry> vEntries;
+    vEntries.reserve(vTxs.size());
+    for (const CTransactionRef& tx : vTxs) {
+        vEntries.emplace_back(tx, 1000 + rand.randrange(100000), 0, nHeight, false, 4, lp);
+        estimator.processTransaction(vEntries.back(), true);
+    }
+    std::vector<const CTxMemPoolEntry*> vBlock;
+    for (const CTxMemPoolEntry& entry : vEntries) {
+        vBlock.push_back(&entry);
+    }
+    estimator.processBlock(++nHeight, vBlock);
+}
+
+// Block processing cost with no transactions to record, which is all decay
+static void PolicyEstimatorEmptyBlock(benchmark::State& state)
+{
+    CBlockPolicyEstimator estimator;
+    std::vector<const CTxMemPoolEntry*> vBlock;
+    unsigned int nHeight = 0;
+    while (state.KeepRunning()) {
+        estimator.processBlock(++nHeight, vBlock);
+    }
+}
+
+static void PolicyEstimatorBlock(benchmark::State& state)
+{
+    FastRandomContext rand(true);
+    CBlockPolicyEstimator estimator;
+    const std::vector<CTransactionRef> vTxs = CreateTxs();
+    unsigned int nHeight = 0;
+    while (state.KeepRunning()) {
+        ProcessBlock(estimator, vTxs, nHeight, rand);
+    }
+}
+
+static void EstimateSmartFee(benchmark::State& state)
+{
+    FastRandomContext rand(true);
+    CBlockPolicyEstimator estimator;
+    const std::vector<CTransactionRef> vTxs = CreateTxs();
+    unsigned int nHeight = 0;
+    for (int i = 0; i < 500; i++) {
+        ProcessBlock(estimator, vTxs, nHeight, rand);
+    }
+    int nTarget = 1;
+    while (state.KeepRunning()) {
+        FeeCalculation feeCalc;
+        estimator.estimateSmartFee(nTarget, &feeCalc, false);
+        nTarget = nTarget % 100 + 1;
+    }
+}
+
+BENCHMARK(PolicyEstimatorEmptyBlock);
+BENCHMARK(PolicyEstimatorBlock);
+BENCHMARK(EstimateSmartFee);
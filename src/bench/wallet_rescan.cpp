@@ -0,0 +1,126 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "blockfilter.h"
+#include "chain.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "key.h"
+#include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "undo.h"
+#include "util.h"
+#include "wallet/rescan.h"
+
+#include <memory>
+#include <vector>
+
+static const int RESCAN_BLOCKS = 200;
+static const int RESCAN_BLOCK_TXS = 250;
+static const int RESCAN_WALLET_KEYS = 1000;
+
+/** Serialized blocks of two-output transactions, one output in nWalletRate paying the wallet, and their block filters */
+struct SyntheticChain
+{
+    std::vector<std::unique_ptr<CBlockIndex> > vIndexOwned;
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<std::vector<unsigned char> > vBlocks;
+    std::vector<BlockFilter> vFilters;
+    std::shared_ptr<CWalletScanFilter> filter;
+
+    explicit SyntheticChain(int nWalletRate)
+    {
+        FastRandomContext rand(true);
+        filter = std::make_shared<CWalletScanFilter>();
+        std::vector<CScript> vWalletScripts;
+        for (int i = 0; i < RESCAN_WALLET_KEYS; i++) {
+            std::vector<unsigned char> vchPubKey = rand.randbytes(33);
+            vchPubKey[0] = 0x02;
+            const CPubKey pubkey(vchPubKey);
+            filter->AddKey(pubkey);
+            vWalletScripts.push_back(GetScriptForDestination(pubkey.GetID()));
+        }
+
+        for (int nHeight = 0; nHeight < RESCAN_BLOCKS; nHeight++) {
+            vIndexOwned.emplace_back(new CBlockIndex);
+            vIndexOwned.back()->nHeight = nHeight;
+            vIndex.push_back(vIndexOwned.back().get());
+
+            CBlock block;
+            for (int i = 0; i < RESCAN_BLOCK_TXS; i++) {
+                CMutableTransaction tx;
+                tx.vin.emplace_back(COutPoint(rand.rand256(), 0));
+                tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72) << std::vector<unsigned char>(33);
+                for (int j = 0; j < 2; j++) {
+                    CScript script = rand.randrange(nWalletRate) == 0 ? vWalletScripts[rand.randrange(RESCAN_WALLET_KEYS)] : GetScriptForDestination(CKeyID(uint160(rand.randbytes(20))));
+                    tx.vout.emplace_back(COIN, script);
+                }
+                block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+            }
+            CDataStream stream(SER_DISK, CLIENT_VERSION);
+            stream << block;
+            vBlocks.emplace_back(stream.begin(), stream.end());
+            vFilters.emplace_back(BLOCK_FILTER_BASIC, block, CBlockUndo());
+        }
+    }
+
+    bool ReadBlock(CBlock& block, const CBlockIndex* pindex) const
+    {
+        CDataStream stream(vBlocks[pindex->nHeight], SER_DISK, CLIENT_VERSION);
+        stream >> block;
+        return true;
+    }
+
+    bool LookupFilter(BlockFilter& blockFilter, const CBlockIndex* pindex) const
+    {
+        blockFilter = vFilters[pindex->nHeight];
+        return true;
+    }
+};
+
+static void Rescan(benchmark::State& state, int nThreads, int nWalletRate = 1000, bool fBlockFilters = false)
+{
+    const SyntheticChain chain(nWalletRate);
+    CRescanPipeline::LookupFilterFn lookupFilter;
+    if (fBlockFilters)
+        lookupFilter = std::bind(&SyntheticChain::LookupFilter, &chain, std::placeholders::_1, std::placeholders::_2);
+    while (state.KeepRunning()) {
+        CRescanPipeline pipeline(chain.vIndex, chain.filter, nThreads, std::bind(&SyntheticChain::ReadBlock, &chain, std::placeholders::_1, std::placeholders::_2), lookupFilter);
+        CRescanBlock item;
+        size_t nMatches = 0;
+        while (pipeline.Next(item)) {
+            nMatches += item.vMatches.size();
+        }
+        assert(nMatches > 0);
+    }
+}
+
+static void WalletRescan(benchmark::State& state)
+{
+    Rescan(state, 0);
+}
+
+static void WalletRescanParallel(benchmark::State& state)
+{
+    Rescan(state, std::max(2, GetNumCores()));
+}
+
+// A wallet paid in a few blocks only, as that of a miner, with and without
+// block filters
+static void WalletRescanSparse(benchmark::State& state)
+{
+    Rescan(state, 0, 20000);
+}
+
+static void WalletRescanBlockFilter(benchmark::State& state)
+{
+    Rescan(state, 0, 20000, true);
+}
+
+BENCHMARK(WalletRescan);
+BENCHMARK(WalletRescanParallel);
+BENCHMARK(WalletRescanSparse);
+BENCHMARK(WalletRescanBlockFilter);
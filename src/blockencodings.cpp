@@ -13,8 +13,15 @@
 #include "validation.h"
 #include "util.h"
 
+#include <thread>
 #include <unordered_map>
 
+static int GetShortIDThreads()
+{
+    static const int nThreads = std::max(1, std::min(GetNumCores(), MAX_SHORTTXIDS_THREADS));
+    return nThreads;
+}
+
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
         nonce(GetRand(std::numeric_limits<uint64_t>::max())),
         shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block) {
@@ -105,27 +112,51 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     {
     LOCK(pool->cs);
     const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
-    for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
-                have_txn[idit->second]  = true;
+
+    // Computing a SipHash per mempool entry dominates reconstruction time on
+    // large mempools, so the hashing is split into chunks handled by worker
+    // threads. Matches are then applied in mempool order below, which keeps
+    // the result identical to a serial scan.
+    std::vector<std::vector<std::pair<size_t, uint16_t> > > chunk_matches;
+    size_t nChunks = std::min<size_t>(GetShortIDThreads(), vTxHashes.size() / SHORTTXIDS_PARALLEL_CHUNK);
+    chunk_matches.resize(std::max<size_t>(nChunks, 1));
+    auto match_chunk = [&](size_t chunk) {
+        size_t begin = vTxHashes.size() * chunk / chunk_matches.size();
+        size_t end = vTxHashes.size() * (chunk + 1) / chunk_matches.size();
+        for (size_t i = begin; i < end; i++) {
+            std::unordered_map<uint64_t, uint16_t>::const_iterator idit = shorttxids.find(cmpctblock.GetShortID(vTxHashes[i].first));
+            if (idit != shorttxids.end())
+                chunk_matches[chunk].emplace_back(i, idit->second);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t chunk = 1; chunk < chunk_matches.size(); chunk++)
+        workers.emplace_back(match_chunk, chunk);
+    match_chunk(0);
+    for (std::thread& worker : workers)
+        worker.join();
+
+    for (const std::vector<std::pair<size_t, uint16_t> >& matches : chunk_matches) {
+        for (const std::pair<size_t, uint16_t>& match : matches) {
+            if (!have_txn[match.second]) {
+                txn_available[match.second] = vTxHashes[match.first].second->GetSharedTx();
+                have_txn[match.second]  = true;
                 mempool_count++;
             } else {
                 // If we find two mempool txn that match the short id, just request it.
                 // This should be rare enough that the extra bandwidth doesn't matter,
                 // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
-                    txn_available[idit->second].reset();
+                if (txn_available[match.second]) {
+                    txn_available[match.second].reset();
                     mempool_count--;
                 }
             }
+            // Though ideally we'd continue scanning for the two-txn-match-shortid case,
+            // the performance win of an early exit here is too good to pass up and worth
+            // the extra risk.
+            if (mempool_count == shorttxids.size())
+                break;
         }
-        // Though ideally we'd continue scanning for the two-txn-match-shortid case,
-        // the performance win of an early exit here is too good to pass up and worth
-        // the extra risk.
         if (mempool_count == shorttxids.size())
             break;
     }
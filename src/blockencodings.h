@@ -11,6 +11,11 @@
 
 class CTxMemPool;
 
+/** Minimum number of mempool entries each thread hashes when matching short IDs in parallel */
+static const size_t SHORTTXIDS_PARALLEL_CHUNK = 8192;
+/** Maximum number of threads used to match mempool transactions against short IDs */
+static const int MAX_SHORTTXIDS_THREADS = 8;
+
 // Dumb helper to handle CTransaction compression at serialize-time
 struct TransactionCompressor {
 private:
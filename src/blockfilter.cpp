@@ -0,0 +1,287 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "coins.h"
+#include "hash.h"
+#include "script/script.h"
+#include "streams.h"
+#include "undo.h"
+#include "version.h"
+
+#include <algorithm>
+#include <ios>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+/** Writes bit fields, most significant bit first, to the end of a byte vector */
+class BitWriter
+{
+public:
+    explicit BitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nOffset(0) {}
+    ~BitWriter() { Flush(); }
+
+    /** Write the low nBits bits of nData */
+    void Write(uint64_t nData, int nBits)
+    {
+        while (nBits > 0) {
+            const int nWrite = std::min(8 - nOffset, nBits);
+            nBuffer |= (nData << (64 - nBits)) >> (64 - 8 + nOffset);
+            nOffset += nWrite;
+            nBits -= nWrite;
+            if (nOffset == 8)
+                Flush();
+        }
+    }
+
+    /** Write out a partial byte, padded with zero bits */
+    void Flush()
+    {
+        if (nOffset == 0)
+            return;
+        vch.push_back(nBuffer);
+        nBuffer = 0;
+        nOffset = 0;
+    }
+
+private:
+    std::vector<unsigned char>& vch;
+    uint8_t nBuffer;
+    int nOffset;
+};
+
+/** Reads bit fields written by BitWriter */
+class BitReader
+{
+public:
+    BitReader(const std::vector<unsigned char>& vchIn, size_t nPosIn) : vch(vchIn), nPos(nPosIn), nBuffer(0), nOffset(8) {}
+
+    uint64_t Read(int nBits)
+    {
+        uint64_t nData = 0;
+        while (nBits > 0) {
+            if (nOffset == 8) {
+                if (nPos >= vch.size())
+                    throw std::ios_base::failure("BitReader::Read(): end of data");
+                nBuffer = vch[nPos++];
+                nOffset = 0;
+            }
+            const int nRead = std::min(8 - nOffset, nBits);
+            nData <<= nRead;
+            nData |= static_cast<uint8_t>(nBuffer << nOffset) >> (8 - nRead);
+            nOffset += nRead;
+            nBits -= nRead;
+        }
+        return nData;
+    }
+
+private:
+    const std::vector<unsigned char>& vch;
+    size_t nPos;
+    uint8_t nBuffer;
+    int nOffset;
+};
+
+void GolombRiceEncode(BitWriter& writer, uint8_t nP, uint64_t nValue)
+{
+    // Quotient in unary, terminated by a zero bit, then the remainder in nP bits
+    uint64_t nQuotient = nValue >> nP;
+    while (nQuotient > 0) {
+        const int nBits = nQuotient <= 64 ? static_cast<int>(nQuotient) : 64;
+        writer.Write(~0ULL, nBits);
+        nQuotient -= nBits;
+    }
+    writer.Write(0, 1);
+    writer.Write(nValue, nP);
+}
+
+uint64_t GolombRiceDecode(BitReader& reader, uint8_t nP)
+{
+    uint64_t nQuotient = 0;
+    while (reader.Read(1) == 1) {
+        nQuotient++;
+    }
+    const uint64_t nRemainder = reader.Read(nP);
+    return (nQuotient << nP) + nRemainder;
+}
+
+/** Map a uniformly distributed 64-bit value to [0, n) without a division */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (static_cast<unsigned __int128>(x) * static_cast<unsigned __int128>(n)) >> 64;
+#else
+    const uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    const uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+    const uint64_t ac = x_hi * n_hi, ad = x_hi * n_lo, bc = x_lo * n_hi, bd = x_lo * n_lo;
+    const uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+
+} // namespace
+
+GCSFilter::GCSFilter(const Params& paramsIn)
+    : params(paramsIn), nElements(0), nRange(0)
+{
+    CVectorWriter writer(SER_NETWORK, PROTOCOL_VERSION, vchEncoded, 0);
+    WriteCompactSize(writer, nElements);
+}
+
+GCSFilter::GCSFilter(const Params& paramsIn, std::vector<unsigned char> vchEncodedIn)
+    : params(paramsIn), vchEncoded(std::move(vchEncodedIn))
+{
+    CDataStream stream(vchEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    const uint64_t nCount = ReadCompactSize(stream);
+    if (nCount > std::numeric_limits<uint32_t>::max())
+        throw std::ios_base::failure("GCSFilter: too many elements");
+    nElements = nCount;
+    nRange = static_cast<uint64_t>(nElements) * params.nM;
+
+    // Decode every value once, so a truncated encoding is caught here
+    BitReader reader(vchEncoded, vchEncoded.size() - stream.size());
+    for (uint32_t i = 0; i < nElements; i++) {
+        GolombRiceDecode(reader, params.nP);
+    }
+}
+
+GCSFilter::GCSFilter(const Params& paramsIn, const ElementSet& elements)
+    : params(paramsIn)
+{
+    if (elements.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("GCSFilter: too many elements");
+    nElements = elements.size();
+    nRange = static_cast<uint64_t>(nElements) * params.nM;
+
+    CVectorWriter sizeWriter(SER_NETWORK, PROTOCOL_VERSION, vchEncoded, 0);
+    WriteCompactSize(sizeWriter, nElements);
+    BitWriter writer(vchEncoded);
+    uint64_t nLast = 0;
+    for (uint64_t nValue : BuildHashedSet(elements)) {
+        GolombRiceEncode(writer, params.nP, nValue - nLast);
+        nLast = nValue;
+    }
+    writer.Flush();
+}
+
+uint64_t GCSFilter::HashToRange(const Element& element) const
+{
+    const uint64_t nHash = CSipHasher(params.nSipHashK0, params.nSipHashK1).Write(element.data(), element.size()).Finalize();
+    return MapIntoRange(nHash, nRange);
+}
+
+std::vector<uint64_t> GCSFilter::BuildHashedSet(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vHashed;
+    vHashed.reserve(elements.size());
+    for (const Element& element : elements) {
+        vHashed.push_back(HashToRange(element));
+    }
+    std::sort(vHashed.begin(), vHashed.end());
+    return vHashed;
+}
+
+bool GCSFilter::MatchInternal(const uint64_t* pQuery, size_t nQuery) const
+{
+    BitReader reader(vchEncoded, GetSizeOfCompactSize(nElements));
+    uint64_t nValue = 0;
+    size_t nQueryPos = 0;
+    for (uint32_t i = 0; i < nElements; i++) {
+        nValue += GolombRiceDecode(reader, params.nP);
+        while (true) {
+            if (nQueryPos == nQuery)
+                return false;
+            if (pQuery[nQueryPos] == nValue)
+                return true;
+            if (pQuery[nQueryPos] > nValue)
+                break;
+            nQueryPos++;
+        }
+    }
+    return false;
+}
+
+bool GCSFilter::Match(const Element& element) const
+{
+    if (nElements == 0)
+        return false;
+    const uint64_t nQuery = HashToRange(element);
+    return MatchInternal(&nQuery, 1);
+}
+
+bool GCSFilter::MatchAny(const ElementSet& elements) const
+{
+    if (nElements == 0 || elements.empty())
+        return false;
+    const std::vector<uint64_t> vQuery = BuildHashedSet(elements);
+    return MatchInternal(vQuery.data(), vQuery.size());
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, std::vector<unsigned char> vchFilter)
+    : filterType(filterTypeIn), hashBlock(hashBlockIn)
+{
+    GCSFilter::Params params;
+    if (!BuildParams(filterType, hashBlock, params))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(params, std::move(vchFilter));
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockUndo)
+    : filterType(filterTypeIn), hashBlock(block.GetHash())
+{
+    GCSFilter::Params params;
+    if (!BuildParams(filterType, hashBlock, params))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(params, BasicFilterElements(block, blockUndo));
+}
+
+bool BlockFilter::BuildParams(BlockFilterType filterType, const uint256& hashBlock, GCSFilter::Params& params)
+{
+    switch (filterType) {
+    case BLOCK_FILTER_BASIC:
+        params.nSipHashK0 = hashBlock.GetUint64(0);
+        params.nSipHashK1 = hashBlock.GetUint64(1);
+        params.nP = BASIC_FILTER_P;
+        params.nM = BASIC_FILTER_M;
+        return true;
+    }
+    return false;
+}
+
+GCSFilter::ElementSet BlockFilter::BasicFilterElements(const CBlock& block, const CBlockUndo& blockUndo)
+{
+    GCSFilter::ElementSet elements;
+    for (const CTransactionRef& tx : block.vtx) {
+        for (const CTxOut& txout : tx->vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.emplace(script.begin(), script.end());
+        }
+    }
+    for (const CTxUndo& txundo : blockUndo.vtxundo) {
+        for (const Coin& prevout : txundo.vprevout) {
+            const CScript& script = prevout.out.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.emplace(script.begin(), script.end());
+        }
+    }
+    return elements;
+}
+
+uint256 BlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vchEncoded = filter.GetEncoded();
+    return Hash(vchEncoded.begin(), vchEncoded.end());
+}
+
+uint256 BlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    const uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+class CBlockUndo;
+
+/**
+ * Golomb-coded set: a compact probabilistic set of byte strings, as
+ * described in BIP 158. Elements are hashed with SipHash into the range
+ * [0, N * M) and the sorted hashes are stored as Golomb-Rice coded deltas
+ * with parameter P. Testing an element that is not in the set gives a false
+ * positive with probability about 1/M.
+ */
+class GCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    struct Params
+    {
+        uint64_t nSipHashK0;
+        uint64_t nSipHashK1;
+        uint8_t nP;  //!< Golomb-Rice coding parameter
+        uint32_t nM; //!< Inverse false positive rate
+
+        Params(uint64_t nSipHashK0In = 0, uint64_t nSipHashK1In = 0, uint8_t nPIn = 0, uint32_t nMIn = 1)
+            : nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn) {}
+    };
+
+    /** Construct an empty filter */
+    explicit GCSFilter(const Params& paramsIn = Params());
+    /** Reconstruct a filter from its encoding; throws std::ios_base::failure if it is malformed */
+    GCSFilter(const Params& paramsIn, std::vector<unsigned char> vchEncodedIn);
+    /** Build a filter from a set of elements */
+    GCSFilter(const Params& paramsIn, const ElementSet& elements);
+
+    uint32_t GetN() const { return nElements; }
+    const Params& GetParams() const { return params; }
+    const std::vector<unsigned char>& GetEncoded() const { return vchEncoded; }
+
+    /** Whether the element may be in the set (false positives are possible) */
+    bool Match(const Element& element) const;
+    /** Whether any of the elements may be in the set. Faster than calling Match() for each of them. */
+    bool MatchAny(const ElementSet& elements) const;
+
+private:
+    Params params;
+    uint32_t nElements;
+    uint64_t nRange; //!< nElements * nM
+    std::vector<unsigned char> vchEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+    /** Whether any of the sorted hashed values is in the set */
+    bool MatchInternal(const uint64_t* pQuery, size_t nQuery) const;
+};
+
+static const uint8_t BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+enum BlockFilterType : uint8_t
+{
+    BLOCK_FILTER_BASIC = 0,
+};
+
+/**
+ * Filter over the contents of a block. The basic filter holds every output
+ * script of the block, except empty and OP_RETURN ones, and the script of
+ * every output spent by it, taken from the block's undo data.
+ */
+class BlockFilter
+{
+public:
+    BlockFilter() : filterType(BLOCK_FILTER_BASIC) {}
+    BlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, std::vector<unsigned char> vchFilter);
+    BlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockUndo);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const GCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    /** Double SHA256 of the encoded filter */
+    uint256 GetHash() const;
+    /** Filter header, committing to this filter and the header of the previous block's filter */
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+
+    /** Parameters of a filter type for a given block, false for an unknown type */
+    static bool BuildParams(BlockFilterType filterType, const uint256& hashBlock, GCSFilter::Params& params);
+
+    /** Elements of the basic filter for a block */
+    static GCSFilter::ElementSet BasicFilterElements(const CBlock& block, const CBlockUndo& blockUndo);
+
+private:
+    BlockFilterType filterType;
+    uint256 hashBlock;
+    GCSFilter filter;
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
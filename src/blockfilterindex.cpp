@@ -0,0 +1,215 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilterindex.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "streams.h"
+#include "tinyformat.h"
+#include "undo.h"
+#include "util.h"
+#include "validation.h"
+
+static const char DB_FILTER = 'f';
+static const char DB_BEST_BLOCK = 'B';
+static const char DB_FILE_POS = 'P';
+
+std::unique_ptr<CBlockFilterIndex> g_blockfilter_index;
+
+CBlockFilterIndex::CBlockFilterIndex(size_t nCacheSize, bool fMemory, bool fWipe)
+    : pathFiles(GetDataDir() / "blocks" / "filter"),
+      db(GetDataDir() / "blocks" / "filter" / "index", nCacheSize, fMemory, fWipe),
+      fSynced(false), fInterrupted(false)
+{
+    TryCreateDirectories(pathFiles);
+    if (!db.Read(DB_FILE_POS, posNext)) {
+        posNext.nFile = 0;
+        posNext.nPos = 0;
+    }
+}
+
+CBlockFilterIndex::~CBlockFilterIndex()
+{
+    Interrupt();
+    Stop();
+}
+
+void CBlockFilterIndex::Start()
+{
+    RegisterValidationInterface(this);
+    threadSync = std::thread(&TraceThread<std::function<void()> >, "blockfilter", std::function<void()>(std::bind(&CBlockFilterIndex::ThreadSync, this)));
+}
+
+void CBlockFilterIndex::Interrupt()
+{
+    fInterrupted = true;
+}
+
+void CBlockFilterIndex::Stop()
+{
+    UnregisterValidationInterface(this);
+    if (threadSync.joinable()) {
+        threadSync.join();
+    }
+}
+
+FILE* CBlockFilterIndex::OpenFile(const CDiskBlockPos& pos, bool fReadOnly) const
+{
+    fs::path path = pathFiles / strprintf("fltr%05u.dat", pos.nFile);
+    FILE* file = fsbridge::fopen(path, fReadOnly ? "rb" : "rb+");
+    if (!file && !fReadOnly)
+        file = fsbridge::fopen(path, "wb+");
+    if (!file) {
+        LogPrintf("Unable to open block filter file %s\n", path.string());
+        return nullptr;
+    }
+    if (pos.nPos && fseek(file, pos.nPos, SEEK_SET)) {
+        LogPrintf("Unable to seek to position %u of %s\n", pos.nPos, path.string());
+        fclose(file);
+        return nullptr;
+    }
+    return file;
+}
+
+bool CBlockFilterIndex::ReadRecord(const CBlockIndex* pindex, FilterRecord& record) const
+{
+    return db.Read(std::make_pair(DB_FILTER, pindex->GetBlockHash()), record);
+}
+
+bool CBlockFilterIndex::LookupFilter(const CBlockIndex* pindex, BlockFilter& filter) const
+{
+    FilterRecord record;
+    if (!ReadRecord(pindex, record))
+        return false;
+
+    CAutoFile filein(OpenFile(record.pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+    try {
+        std::vector<unsigned char> vchFilter;
+        filein >> vchFilter;
+        filter = BlockFilter(BLOCK_FILTER_BASIC, pindex->GetBlockHash(), std::move(vchFilter));
+    } catch (const std::exception& e) {
+        return error("%s: failed to read filter of block %s: %s", __func__, pindex->GetBlockHash().ToString(), e.what());
+    }
+    // The index is written without syncing, so a crash can leave it
+    // pointing at data that never made it to disk.
+    if (filter.GetHash() != record.hashFilter)
+        return error("%s: filter of block %s does not match its hash", __func__, pindex->GetBlockHash().ToString());
+    return true;
+}
+
+bool CBlockFilterIndex::LookupFilterHeader(const CBlockIndex* pindex, uint256& hashHeader) const
+{
+    FilterRecord record;
+    if (!ReadRecord(pindex, record))
+        return false;
+    hashHeader = record.hashHeader;
+    return true;
+}
+
+bool CBlockFilterIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CBlockUndo blockUndo;
+    uint256 hashPrevHeader;
+    if (pindex->pprev) {
+        if (!(pindex->nStatus & BLOCK_HAVE_UNDO) || !UndoReadFromDisk(blockUndo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash()))
+            return error("%s: failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+        FilterRecord recordPrev;
+        if (!ReadRecord(pindex->pprev, recordPrev))
+            return error("%s: previous block of %s is not indexed", __func__, pindex->GetBlockHash().ToString());
+        hashPrevHeader = recordPrev.hashHeader;
+    }
+    const BlockFilter filter(BLOCK_FILTER_BASIC, block, blockUndo);
+
+    LOCK(cs_write);
+    FilterRecord record;
+    record.hashFilter = filter.GetHash();
+    record.hashHeader = filter.ComputeHeader(hashPrevHeader);
+    const unsigned int nSize = GetSerializeSize(filter.GetEncodedFilter(), SER_DISK, CLIENT_VERSION);
+    if (posNext.nPos > 0 && posNext.nPos + nSize > MAX_BLOCKFILTER_FILE_SIZE) {
+        posNext.nFile++;
+        posNext.nPos = 0;
+    }
+    record.pos = posNext;
+    {
+        CAutoFile fileout(OpenFile(record.pos, false), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return false;
+        fileout << filter.GetEncodedFilter();
+        if (fflush(fileout.Get()) != 0)
+            return error("%s: failed to write filter of block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+    posNext.nPos += nSize;
+
+    CDBBatch batch(db);
+    batch.Write(std::make_pair(DB_FILTER, pindex->GetBlockHash()), record);
+    batch.Write(DB_BEST_BLOCK, pindex->GetBlockHash());
+    batch.Write(DB_FILE_POS, posNext);
+    return db.WriteBatch(batch);
+}
+
+void CBlockFilterIndex::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex, const std::vector<CTransactionRef>& vtxConflicted)
+{
+    // Until the sync thread has caught up, it indexes this block too
+    if (!fSynced)
+        return;
+    if (!WriteBlock(*pblock, pindex)) {
+        LogPrintf("%s: failed to index block %s, block filter index disabled\n", __func__, pindex->GetBlockHash().ToString());
+        fSynced = false;
+    }
+}
+
+void CBlockFilterIndex::ThreadSync()
+{
+    const CBlockIndex* pindex = nullptr;
+    {
+        LOCK(cs_main);
+        uint256 hashBest;
+        if (db.Read(DB_BEST_BLOCK, hashBest)) {
+            BlockMap::const_iterator it = mapBlockIndex.find(hashBest);
+            if (it != mapBlockIndex.end())
+                pindex = it->second;
+        }
+    }
+
+    const int64_t nStart = GetTimeMillis();
+    int64_t nLastLog = GetTime();
+    int nBlocks = 0;
+    while (!fInterrupted) {
+        const CBlockIndex* pindexNext;
+        {
+            // Blocks are connected, and BlockConnected is called, under
+            // cs_main, so none can be missed between reaching the tip here
+            // and switching over to BlockConnected.
+            LOCK(cs_main);
+            if (!pindex) {
+                pindexNext = chainActive.Genesis();
+            } else if (chainActive.Contains(pindex)) {
+                pindexNext = chainActive.Next(pindex);
+            } else {
+                pindexNext = chainActive.Next(chainActive.FindFork(pindex));
+            }
+            if (!pindexNext) {
+                fSynced = true;
+                LogPrintf("Block filter index synced to height %d, %d blocks indexed in %dms\n", pindex ? pindex->nHeight : -1, nBlocks, GetTimeMillis() - nStart);
+                return;
+            }
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindexNext, Params().GetConsensus()) || !WriteBlock(block, pindexNext)) {
+            LogPrintf("%s: failed to index block %s, block filter index disabled\n", __func__, pindexNext->GetBlockHash().ToString());
+            return;
+        }
+        pindex = pindexNext;
+        nBlocks++;
+        if (GetTime() >= nLastLog + 30) {
+            LogPrintf("Syncing block filter index with block chain, at height %d\n", pindex->nHeight);
+            nLastLog = GetTime();
+        }
+    }
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTERINDEX_H
+#define BITCOIN_BLOCKFILTERINDEX_H
+
+#include "blockfilter.h"
+#include "chain.h"
+#include "dbwrapper.h"
+#include "fs.h"
+#include "sync.h"
+#include "validationinterface.h"
+
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+#include <thread>
+
+/** Default for -blockfilterindex */
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+/** Maximum database cache of the block filter index, in MiB */
+static const int64_t MAX_BLOCKFILTERINDEX_CACHE = 16;
+/** Size at which a new filter file is started */
+static const unsigned int MAX_BLOCKFILTER_FILE_SIZE = 0x1000000; // 16 MiB
+
+/**
+ * Index of the basic block filter of every block, so that a wallet rescan
+ * can skip blocks that cannot contain any of its scripts without reading
+ * them.
+ *
+ * Encoded filters are appended to flat files in blocks/filter/, and a
+ * database next to them maps each block hash to the filter's position, its
+ * hash and its filter header. At startup a background thread indexes the
+ * blocks of the active chain that are not indexed yet; after that, blocks
+ * are indexed as they are connected. Filters are keyed by block hash, so
+ * reorganizations need no undoing.
+ */
+class CBlockFilterIndex : public CValidationInterface
+{
+public:
+    CBlockFilterIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CBlockFilterIndex();
+
+    /** Start following the chain and indexing the blocks missed so far */
+    void Start();
+    void Interrupt();
+    void Stop();
+
+    /** Whether every block of the active chain has been indexed */
+    bool IsSynced() const { return fSynced; }
+
+    bool LookupFilter(const CBlockIndex* pindex, BlockFilter& filter) const;
+    bool LookupFilterHeader(const CBlockIndex* pindex, uint256& hashHeader) const;
+
+protected:
+    void BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex, const std::vector<CTransactionRef>& vtxConflicted) override;
+
+private:
+    struct FilterRecord
+    {
+        uint256 hashFilter;
+        uint256 hashHeader;
+        CDiskBlockPos pos;
+
+        ADD_SERIALIZE_METHODS;
+
+        template <typename Stream, typename Operation>
+        inline void SerializationOp(Stream& s, Operation ser_action)
+        {
+            READWRITE(hashFilter);
+            READWRITE(hashHeader);
+            READWRITE(pos);
+        }
+    };
+
+    const fs::path pathFiles;
+    CDBWrapper db;
+
+    //! Serializes writes, which come from the sync thread and then from BlockConnected
+    CCriticalSection cs_write;
+    //! Where the next filter is written
+    CDiskBlockPos posNext;
+
+    std::atomic<bool> fSynced;
+    std::atomic<bool> fInterrupted;
+    std::thread threadSync;
+
+    FILE* OpenFile(const CDiskBlockPos& pos, bool fReadOnly) const;
+    bool ReadRecord(const CBlockIndex* pindex, FilterRecord& record) const;
+    /** Compute, store and index the filter of a block */
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex);
+    void ThreadSync();
+};
+
+/** Block filter index, if -blockfilterindex is set */
+extern std::unique_ptr<CBlockFilterIndex> g_blockfilter_index;
+
+#endif // BITCOIN_BLOCKFILTERINDEX_H
@@ -5,6 +5,9 @@
 #ifndef BITCOIN_INDIRECTMAP_H
 #define BITCOIN_INDIRECTMAP_H
 
+#include <map>
+#include <unordered_map>
+
 template <class T>
 struct DereferencingComparator { bool operator()(const T a, const T b) const { return *a < *b; } };
 
@@ -53,4 +56,52 @@ public:
     const_iterator cend() const     { return m.cend(); }
 };
 
+template <class T, class Hash>
+struct DereferencingHasher {
+    Hash hash;
+    size_t operator()(const T a) const { return hash(*a); }
+};
+
+template <class T>
+struct DereferencingEqual { bool operator()(const T a, const T b) const { return *a == *b; } };
+
+/* Hash table counterpart of indirectmap: keys are pointers, but are hashed
+ * and compared by their dereferenced values, with Hash for K.
+ *
+ * There is no ordering, so there is no lower_bound.
+ */
+template <class K, class T, class Hash>
+class unordered_indirectmap {
+private:
+    typedef std::unordered_map<const K*, T, DereferencingHasher<const K*, Hash>, DereferencingEqual<const K*> > base;
+    base m;
+public:
+    typedef typename base::iterator iterator;
+    typedef typename base::const_iterator const_iterator;
+    typedef typename base::size_type size_type;
+    typedef typename base::value_type value_type;
+
+    // passthrough (pointer interface)
+    std::pair<iterator, bool> insert(const value_type& value) { return m.insert(value); }
+
+    // pass address (value interface)
+    iterator find(const K& key)                     { return m.find(&key); }
+    const_iterator find(const K& key) const         { return m.find(&key); }
+    size_type erase(const K& key)                   { return m.erase(&key); }
+    size_type count(const K& key) const             { return m.count(&key); }
+
+    // passthrough
+    bool empty() const              { return m.empty(); }
+    size_type size() const          { return m.size(); }
+    size_type max_size() const      { return m.max_size(); }
+    size_type bucket_count() const  { return m.bucket_count(); }
+    void clear()                    { m.clear(); }
+    iterator begin()                { return m.begin(); }
+    iterator end()                  { return m.end(); }
+    const_iterator begin() const    { return m.begin(); }
+    const_iterator end() const      { return m.end(); }
+    const_iterator cbegin() const   { return m.cbegin(); }
+    const_iterator cend() const     { return m.cend(); }
+};
+
 #endif // BITCOIN_INDIRECTMAP_H
@@ -11,6 +11,7 @@
 
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilterindex.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -20,6 +21,7 @@
 #include "httpserver.h"
 #include "httprpc.h"
 #include "key.h"
+#include "mempooljournal.h"
 #include "validation.h"
 #include "miner.h"
 #include "netbase.h"
@@ -34,6 +36,7 @@
 #include "script/standard.h"
 #include "script/sigcache.h"
 #include "scheduler.h"
+#include "stratum.h"
 #include "timedata.h"
 #include "txdb.h"
 #include "txmempool.h"
@@ -167,6 +170,9 @@ void Interrupt(boost::thread_group& threadGroup)
     InterruptRPC();
     InterruptREST();
     InterruptTorControl();
+    InterruptStratumServer();
+    if (g_blockfilter_index)
+        g_blockfilter_index->Interrupt();
     if (g_connman)
         g_connman->Interrupt();
     threadGroup.interrupt_all();
@@ -198,6 +204,12 @@ void Shutdown()
 #endif
     MapPort(false);
 
+    StopStratumServer();
+    if (g_template_builder) {
+        g_template_builder->Stop();
+        g_template_builder.reset();
+    }
+
     // Because these depend on each-other, we make sure that neither can be
     // using the other before destroying them.
     UnregisterValidationInterface(peerLogic.get());
@@ -207,7 +219,14 @@ void Shutdown()
 
     StopTorControl();
     if (fDumpMempoolLater && gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
-        DumpMempool();
+        if (!g_mempool_journal || !g_mempool_journal->Stop()) {
+            DumpMempool();
+        }
+    }
+    g_mempool_journal.reset();
+    if (g_blockfilter_index) {
+        g_blockfilter_index->Stop();
+        g_blockfilter_index.reset();
     }
 
     if (fFeeEstimatesInitialized)
@@ -367,7 +386,11 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphantxperpeer=<n>", strprintf(_("Keep at most <n> unconnectable transactions from a single peer in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER));
+    strUsage += HelpMessageOpt("-maxorphantxsize=<n>", strprintf(_("Keep unconnectable transactions in memory below <n> megabytes (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-mempoolclusters", strprintf(_("Group mempool transactions into linearized clusters for mining and eviction (default: %u)"), DEFAULT_MEMPOOL_CLUSTERS));
+    strUsage += HelpMessageOpt("-mempooljournal", strprintf(_("With -persistmempool, record mempool changes in a journal as they happen instead of saving the mempool on shutdown (default: %u)"), DEFAULT_MEMPOOL_JOURNAL));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     if (showDebug) {
         strUsage += HelpMessageOpt("-minimumchainwork=<hex>", strprintf("Minimum work assumed to exist on a valid chain in hex (default: %s, testnet: %s)", defaultChainParams->GetConsensus().nMinimumChainWork.GetHex(), testnetChainParams->GetConsensus().nMinimumChainWork.GetHex()));
@@ -387,6 +410,7 @@ std::string HelpMessage(HelpMessageMode mode)
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
+    strUsage += HelpMessageOpt("-blockfilterindex", strprintf(_("Maintain an index of compact block filters, used to speed up wallet rescans (default: %u)"), DEFAULT_BLOCKFILTERINDEX));
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
@@ -439,6 +463,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-zmqpubhashtx=<address>", _("Enable publish hash transaction in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawblock=<address>", _("Enable publish raw block in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtx=<address>", _("Enable publish raw transaction in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubnetstats=<address>", strprintf(_("Enable publish of per-message statistics every %d seconds in <address>"), ZMQ_NETSTATS_INTERVAL));
 #endif
 
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
@@ -461,6 +486,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
         strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
+        strUsage += HelpMessageOpt("-limitclustercount=<n>", strprintf("Do not accept transactions that would be part of an in-mempool cluster of more than <n> transactions, with -mempoolclusters (default: %u)", DEFAULT_CLUSTER_LIMIT));
         strUsage += HelpMessageOpt("-vbparams=deployment:start:end", "Use given start/end times for specified version bits deployment (regtest-only)");
     }
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -506,9 +532,22 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-blockmaxweight=<n>", strprintf(_("Set maximum BIP141 block weight (default: %d)"), DEFAULT_BLOCK_MAX_WEIGHT));
     strUsage += HelpMessageOpt("-blockmaxsize=<n>", _("Set maximum BIP141 block weight to this * 4. Deprecated, use blockmaxweight"));
     strUsage += HelpMessageOpt("-blockmintxfee=<amt>", strprintf(_("Set lowest fee rate (in %s/kB) for transactions to be included in block creation. (default: %s)"), CURRENCY_UNIT, FormatMoney(DEFAULT_BLOCK_MIN_TX_FEE)));
+    strUsage += HelpMessageOpt("-blockcheckfull", strprintf(_("Fully validate new blocks, including the scripts of transactions from the mempool (default: %u)"), DEFAULT_BLOCK_CHECK_FULL));
+    strUsage += HelpMessageOpt("-blockheapselection", strprintf(_("Select transactions for new blocks with the heap based package selection (default: %u)"), DEFAULT_BLOCK_HEAP_SELECTION));
+    strUsage += HelpMessageOpt("-blocktemplatebuilder", strprintf(_("Keep a block template for getblocktemplate up to date in the background (default: %u)"), DEFAULT_BLOCK_TEMPLATE_BUILDER));
+    strUsage += HelpMessageOpt("-genthreads=<n>", strprintf(_("Set the number of threads searching for a proof of work in generate RPCs (up to %d, 0 = one per core, <0 = leave that many cores free, default: %d)"), MAX_GENERATE_THREADS, DEFAULT_GENERATE_THREADS));
+    strUsage += HelpMessageOpt("-blocktemplaterefresh=<n>", strprintf(_("Rebuild block templates for a changed mempool at most every <n> milliseconds (default: %u)"), DEFAULT_BLOCK_TEMPLATE_REFRESH));
     if (showDebug)
         strUsage += HelpMessageOpt("-blockversion=<n>", "Override block version to test forking scenarios");
 
+    strUsage += HelpMessageGroup(_("Stratum server options:"));
+    strUsage += HelpMessageOpt("-stratum", strprintf(_("Serve mining jobs to miners using the stratum protocol (default: %u)"), DEFAULT_STRATUM));
+    strUsage += HelpMessageOpt("-stratumaddress=<addr>", _("Address to pay the rewards of blocks mined through the stratum server to"));
+    strUsage += HelpMessageOpt("-stratumbind=<addr>[:port]", _("Bind to given address to listen for stratum connections. Use [host]:port notation for IPv6. This option can be specified multiple times (default: 127.0.0.1 and ::1 i.e., localhost)"));
+    strUsage += HelpMessageOpt("-stratumport=<port>", strprintf(_("Listen for stratum connections on <port> (default: %u)"), DEFAULT_STRATUM_PORT));
+    strUsage += HelpMessageOpt("-stratumdifficulty=<n>", strprintf(_("Difficulty of the shares miners submit (default: %g)"), DEFAULT_STRATUM_DIFFICULTY));
+    strUsage += HelpMessageOpt("-stratumjobinterval=<n>", strprintf(_("Send miners a new job for a changed mempool at most every <n> seconds (default: %u)"), DEFAULT_STRATUM_JOB_INTERVAL));
+
     strUsage += HelpMessageGroup(_("RPC server options:"));
     strUsage += HelpMessageOpt("-server", _("Accept command line and JSON-RPC commands"));
     strUsage += HelpMessageOpt("-rest", strprintf(_("Accept public REST requests (default: %u)"), DEFAULT_REST_ENABLE));
@@ -701,6 +740,10 @@ void ThreadImport(std::vector<fs::path> vImportFiles)
     if (gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
         LoadMempool();
         fDumpMempoolLater = !fRequestShutdown;
+        if (fDumpMempoolLater && g_mempool_journal && g_mempool_journal->Start()) {
+            // The journal supersedes a dump written by an earlier run.
+            fs::remove(GetDataDir() / "mempool.dat");
+        }
     }
 }
 
@@ -915,6 +958,8 @@ bool AppInitParameterInteraction()
     if (gArgs.GetArg("-prune", 0)) {
         if (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX))
             return InitError(_("Prune mode is incompatible with -txindex."));
+        if (gArgs.GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+            return InitError(_("Prune mode is incompatible with -blockfilterindex."));
     }
 
     // -bind and -whitebind can't be set when not listening
@@ -989,6 +1034,7 @@ bool AppInitParameterInteraction()
     if (ratio != 0) {
         mempool.setSanityCheck(1.0 / ratio);
     }
+    mempool.SetClusterTracking(gArgs.GetBoolArg("-mempoolclusters", DEFAULT_MEMPOOL_CLUSTERS));
     fCheckBlockIndex = gArgs.GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
     fCheckpointsEnabled = gArgs.GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
 
@@ -1085,6 +1131,9 @@ bool AppInitParameterInteraction()
             return InitError(AmountErrMsg("blockmintxfee", gArgs.GetArg("-blockmintxfee", "")));
     }
 
+    if (gArgs.GetArg("-blocktemplaterefresh", DEFAULT_BLOCK_TEMPLATE_REFRESH) < 0)
+        return InitError(strprintf(_("Invalid value for -blocktemplaterefresh: '%s'"), gArgs.GetArg("-blocktemplaterefresh", "")));
+
     // Feerate used to define dust.  Shouldn't be changed lightly as old
     // implementations may inadvertently create non-standard transactions
     if (gArgs.IsArgSet("-dustrelayfee"))
@@ -1390,6 +1439,21 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     if (pzmqNotificationInterface) {
         RegisterValidationInterface(pzmqNotificationInterface);
+        // Runs on the scheduler thread, like the validation callbacks, so
+        // notifiers are never used concurrently.
+        scheduler.scheduleEvery([] {
+            if (!pzmqNotificationInterface || !g_connman)
+                return;
+            std::vector<CNodeStats> vstats;
+            g_connman->GetNodeStats(vstats);
+            mapMsgCmdStats mapTotals;
+            for (const CNodeStats& stats : vstats) {
+                for (const mapMsgCmdStats::value_type& i : stats.mapStatsPerMsgCmd) {
+                    mapTotals[i.first] += i.second;
+                }
+            }
+            pzmqNotificationInterface->NotifyNetStats(mapTotals);
+        }, ZMQ_NETSTATS_INTERVAL * 1000);
     }
 #endif
     uint64_t nMaxOutboundLimit = 0; //unlimited unless -maxuploadtarget is set
@@ -1411,6 +1475,11 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     int64_t nBlockTreeDBCache = nTotalCache / 8;
     nBlockTreeDBCache = std::min(nBlockTreeDBCache, (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
     nTotalCache -= nBlockTreeDBCache;
+    int64_t nBlockFilterIndexCache = 0;
+    if (gArgs.GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX)) {
+        nBlockFilterIndexCache = std::min(nTotalCache / 8, MAX_BLOCKFILTERINDEX_CACHE << 20);
+        nTotalCache -= nBlockFilterIndexCache;
+    }
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
@@ -1418,6 +1487,9 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    if (nBlockFilterIndexCache > 0) {
+        LogPrintf("* Using %.1fMiB for block filter index database\n", nBlockFilterIndexCache * (1.0 / 1024 / 1024));
+    }
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set (plus up to %.1fMiB of unused mempool space)\n", nCoinCacheUsage * (1.0 / 1024 / 1024), nMempoolSizeMax * (1.0 / 1024 / 1024));
 
@@ -1601,6 +1673,13 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
         ::feeEstimator.Read(est_filein);
     fFeeEstimatesInitialized = true;
 
+    // Start indexing block filters before the wallets load, so that a rescan
+    // can use the filters as soon as the index has caught up
+    if (gArgs.GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX)) {
+        g_blockfilter_index.reset(new CBlockFilterIndex(nBlockFilterIndexCache, false, fReindex));
+        g_blockfilter_index->Start();
+    }
+
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
     if (!CWallet::InitLoadWallet())
@@ -1655,6 +1734,15 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
         vImportFiles.push_back(strFile);
     }
 
+    if (gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL) && gArgs.GetBoolArg("-mempooljournal", DEFAULT_MEMPOOL_JOURNAL)) {
+        // Started by ThreadImport once the mempool has been loaded
+        g_mempool_journal.reset(new CMempoolJournal(GetDataDir() / MEMPOOL_JOURNAL_FILENAME));
+        scheduler.scheduleEvery([] {
+            if (g_mempool_journal)
+                g_mempool_journal->Flush();
+        }, MEMPOOL_JOURNAL_FLUSH_INTERVAL * 1000);
+    }
+
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
     // Wait for genesis block to be processed
@@ -1729,6 +1817,14 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
         return false;
     }
 
+    if (gArgs.GetBoolArg("-blocktemplatebuilder", DEFAULT_BLOCK_TEMPLATE_BUILDER)) {
+        g_template_builder.reset(new BlockTemplateBuilder(chainparams, gArgs.GetArg("-blocktemplaterefresh", DEFAULT_BLOCK_TEMPLATE_REFRESH)));
+        g_template_builder->Start();
+    }
+
+    if (!InitStratumServer() || !StartStratumServer())
+        return false;
+
     // ********************************************************* Step 12: finished
 
     SetRPCWarmupFinished();
@@ -0,0 +1,279 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mempooljournal.h"
+
+#include "clientversion.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <boost/bind.hpp>
+
+std::unique_ptr<CMempoolJournal> g_mempool_journal;
+
+CMempoolJournal::CMempoolJournal(const fs::path& pathIn)
+    : path(pathIn), file(nullptr), nRecords(0), nBufferedRecords(0), fActive(false)
+{
+}
+
+CMempoolJournal::~CMempoolJournal()
+{
+    Stop();
+}
+
+bool CMempoolJournal::Start()
+{
+    {
+        LOCK(cs_journal);
+        assert(!fActive);
+        fActive = true;
+    }
+    // Connect before taking the snapshot, so that every change after it is
+    // recorded. Anything buffered before it is dropped by Compact().
+    mempool.NotifyEntryAdded.connect(boost::bind(&CMempoolJournal::NotifyEntryAdded, this, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&CMempoolJournal::NotifyEntryRemoved, this, _1, _2));
+    if (!Compact()) {
+        Stop();
+        return false;
+    }
+    return true;
+}
+
+bool CMempoolJournal::Stop()
+{
+    {
+        LOCK(cs_journal);
+        if (!fActive)
+            return false;
+        fActive = false;
+    }
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&CMempoolJournal::NotifyEntryAdded, this, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&CMempoolJournal::NotifyEntryRemoved, this, _1, _2));
+
+    LOCK(cs_file);
+    // Leave a compact journal behind for the next start.
+    bool fCompacted = Compact();
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+    return fCompacted;
+}
+
+bool CMempoolJournal::Compact()
+{
+    LOCK(cs_file);
+    int64_t nStart = GetTimeMicros();
+
+    std::vector<TxMempoolInfo> vinfo;
+    std::map<uint256, CAmount> mapDeltas;
+    {
+        LOCK2(mempool.cs, cs_journal);
+        vinfo = mempool.infoAll();
+        mapDeltas = mempool.mapDeltas;
+        vchBuffer.clear();
+        nBufferedRecords = 0;
+    }
+
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+
+    fs::path pathNew = path.string() + ".new";
+    try {
+        CAutoFile fileout(fsbridge::fopen(pathNew, "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull()) {
+            LogPrintf("Failed to open mempool journal %s for writing\n", pathNew.string());
+            return false;
+        }
+        fileout << MEMPOOL_JOURNAL_VERSION;
+        for (const TxMempoolInfo& info : vinfo) {
+            fileout << (uint8_t)ADD << *info.tx << info.nTime;
+        }
+        for (const auto& delta : mapDeltas) {
+            fileout << (uint8_t)PRIORITISE << delta.first << delta.second;
+        }
+        FileCommit(fileout.Get());
+        fileout.fclose();
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to write mempool journal: %s\n", e.what());
+        return false;
+    }
+    if (!RenameOver(pathNew, path)) {
+        LogPrintf("Failed to rename mempool journal %s\n", pathNew.string());
+        return false;
+    }
+    file = fsbridge::fopen(path, "ab");
+    if (!file) {
+        LogPrintf("Failed to open mempool journal %s for appending\n", path.string());
+        return false;
+    }
+    nRecords = vinfo.size() + mapDeltas.size();
+
+    LogPrint(BCLog::MEMPOOL, "Compacted mempool journal to %u transactions: %.2fms\n", vinfo.size(), (GetTimeMicros() - nStart) * 0.001);
+    return true;
+}
+
+void CMempoolJournal::Flush()
+{
+    LOCK(cs_file);
+    uint64_t nPending;
+    {
+        LOCK(cs_journal);
+        if (!fActive)
+            return;
+        nPending = nBufferedRecords;
+    }
+    // A failed write leaves the file closed; the snapshot taken by
+    // compaction recovers from it as well as from the journal growing
+    // large relative to the mempool.
+    if (!file || nRecords + nPending > 2 * mempool.size() + MEMPOOL_JOURNAL_COMPACT_SLACK) {
+        Compact();
+        return;
+    }
+    if (!nPending)
+        return;
+
+    std::vector<unsigned char> vchData;
+    {
+        LOCK(cs_journal);
+        vchData.swap(vchBuffer);
+        nPending = nBufferedRecords;
+        nBufferedRecords = 0;
+    }
+    if (fwrite(vchData.data(), 1, vchData.size(), file) != vchData.size() || fflush(file) != 0) {
+        LogPrintf("Failed to write mempool journal %s\n", path.string());
+        fclose(file);
+        file = nullptr;
+        return;
+    }
+    FileCommit(file);
+    nRecords += nPending;
+}
+
+void CMempoolJournal::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeDelta)
+{
+    LOCK(cs_journal);
+    if (!fActive)
+        return;
+    CVectorWriter(SER_DISK, CLIENT_VERSION, vchBuffer, vchBuffer.size(), (uint8_t)PRIORITISE, hash, nFeeDelta);
+    nBufferedRecords++;
+}
+
+void CMempoolJournal::NotifyEntryAdded(CTransactionRef tx)
+{
+    // The signal fires before the entry is inserted, when its time is not
+    // available yet; it is within a second of now for anything but
+    // transactions returned to the mempool by a reorg.
+    LOCK(cs_journal);
+    if (!fActive)
+        return;
+    CVectorWriter(SER_DISK, CLIENT_VERSION, vchBuffer, vchBuffer.size(), (uint8_t)ADD, *tx, GetTime());
+    nBufferedRecords++;
+}
+
+void CMempoolJournal::NotifyEntryRemoved(CTransactionRef tx, MemPoolRemovalReason reason)
+{
+    LOCK(cs_journal);
+    if (!fActive)
+        return;
+    CVectorWriter(SER_DISK, CLIENT_VERSION, vchBuffer, vchBuffer.size(), (uint8_t)REMOVE, tx->GetHash());
+    nBufferedRecords++;
+}
+
+bool CMempoolJournal::Read(const fs::path& path, std::vector<TxMempoolInfo>& vinfo, std::map<uint256, CAmount>& mapDeltas)
+{
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return false;
+    }
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_JOURNAL_VERSION) {
+            LogPrintf("Unknown mempool journal version %u\n", version);
+            return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to read mempool journal header: %s\n", e.what());
+        return false;
+    }
+
+    // Transactions in the order they were added; removed ones are reset.
+    std::vector<TxMempoolInfo> vAdded;
+    std::map<uint256, size_t> mapLive;
+    uint64_t nRecords = 0;
+    while (true) {
+        uint8_t type;
+        try {
+            file >> type;
+        } catch (const std::exception&) {
+            break;
+        }
+        try {
+            if (type == ADD) {
+                TxMempoolInfo info;
+                file >> info.tx >> info.nTime;
+                info.nFeeDelta = 0;
+                if (mapLive.emplace(info.tx->GetHash(), vAdded.size()).second) {
+                    vAdded.push_back(info);
+                }
+            } else if (type == REMOVE) {
+                uint256 hash;
+                file >> hash;
+                auto it = mapLive.find(hash);
+                if (it != mapLive.end()) {
+                    vAdded[it->second].tx.reset();
+                    mapLive.erase(it);
+                }
+            } else if (type == PRIORITISE) {
+                uint256 hash;
+                CAmount nFeeDelta;
+                file >> hash >> nFeeDelta;
+                mapDeltas[hash] += nFeeDelta;
+            } else {
+                LogPrintf("Unknown mempool journal record type %u after %u records, ignoring the rest\n", type, nRecords);
+                break;
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("Truncated mempool journal record after %u records: %s\n", nRecords, e.what());
+            break;
+        }
+        nRecords++;
+    }
+
+    // A transaction re-added by a reorg may follow its in-mempool children
+    // in the journal, so emit each one after its live parents.
+    std::vector<bool> vDone(vAdded.size(), false);
+    std::vector<std::pair<size_t, size_t> > vStack; // entry and its next input to visit
+    vinfo.reserve(vinfo.size() + mapLive.size());
+    for (size_t i = 0; i < vAdded.size(); i++) {
+        if (!vAdded[i].tx || vDone[i])
+            continue;
+        vDone[i] = true;
+        vStack.emplace_back(i, 0);
+        while (!vStack.empty()) {
+            const size_t nEntry = vStack.back().first;
+            const CTransaction& tx = *vAdded[nEntry].tx;
+            if (vStack.back().second < tx.vin.size()) {
+                auto it = mapLive.find(tx.vin[vStack.back().second++].prevout.hash);
+                if (it != mapLive.end() && !vDone[it->second]) {
+                    vDone[it->second] = true;
+                    vStack.emplace_back(it->second, 0);
+                }
+                continue;
+            }
+            vinfo.push_back(vAdded[nEntry]);
+            vStack.pop_back();
+        }
+    }
+
+    LogPrint(BCLog::MEMPOOL, "Read %u mempool journal records, %u transactions live\n", nRecords, mapLive.size());
+    return true;
+}
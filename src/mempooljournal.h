@@ -0,0 +1,97 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMPOOLJOURNAL_H
+#define BITCOIN_MEMPOOLJOURNAL_H
+
+#include "amount.h"
+#include "fs.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <vector>
+
+struct TxMempoolInfo;
+enum class MemPoolRemovalReason;
+
+/** Name of the journal file in the data directory */
+static const char* const MEMPOOL_JOURNAL_FILENAME = "mempool.journal";
+/** Version written at the start of the journal file */
+static const uint64_t MEMPOOL_JOURNAL_VERSION = 1;
+/** Default for -mempooljournal */
+static const bool DEFAULT_MEMPOOL_JOURNAL = true;
+/** How often, in seconds, buffered journal records are written to disk */
+static const int64_t MEMPOOL_JOURNAL_FLUSH_INTERVAL = 1;
+/** Number of records the journal may hold beyond twice the mempool's size before it is compacted */
+static const uint64_t MEMPOOL_JOURNAL_COMPACT_SLACK = 1000;
+
+/**
+ * Append-only record of mempool changes, so the mempool survives both clean
+ * and unclean restarts without being written out in full on shutdown.
+ *
+ * The journal file starts with a snapshot of the mempool (one ADD record per
+ * transaction followed by the prioritisation deltas), taken when journaling
+ * starts and whenever the journal has grown too large relative to the mempool.
+ * Every later addition, removal and prioritisation is appended as a record.
+ * Records are buffered in memory and written out by Flush(), which is run
+ * periodically from the scheduler, so at most one flush interval of changes
+ * is lost in a crash.
+ */
+class CMempoolJournal
+{
+public:
+    enum RecordType : uint8_t {
+        ADD = 1,        //!< Transaction and its entry time
+        REMOVE = 2,     //!< Txid
+        PRIORITISE = 3, //!< Txid and fee delta added to any existing delta
+    };
+
+    explicit CMempoolJournal(const fs::path& pathIn);
+    ~CMempoolJournal();
+
+    /** Write a snapshot of the mempool and start appending its changes */
+    bool Start();
+    /** Stop appending changes and write a final snapshot. Returns false if it was not started or the snapshot failed. */
+    bool Stop();
+    /** Write buffered records to disk, compacting the journal first if it has grown too large */
+    void Flush();
+    /** Record a prioritisetransaction call, which the mempool does not signal */
+    void PrioritiseTransaction(const uint256& hash, const CAmount& nFeeDelta);
+
+    /**
+     * Replay a journal into the transactions it leaves in the mempool, in an
+     * order where parents come before their children, and the accumulated
+     * prioritisation deltas. A truncated final record, as left by a crash
+     * during a write, ends the replay without failing it.
+     */
+    static bool Read(const fs::path& path, std::vector<TxMempoolInfo>& vinfo, std::map<uint256, CAmount>& mapDeltas);
+
+private:
+    const fs::path path;
+
+    //! Serializes Start, Stop, Flush and compaction. Taken before mempool.cs and cs_journal.
+    CCriticalSection cs_file;
+    FILE* file;
+    //! Records in the file, including its snapshot
+    uint64_t nRecords;
+
+    //! Protects the record buffer, which is appended to from mempool callbacks under mempool.cs
+    CCriticalSection cs_journal;
+    std::vector<unsigned char> vchBuffer;
+    uint64_t nBufferedRecords;
+    bool fActive;
+
+    bool Compact();
+    void NotifyEntryAdded(CTransactionRef tx);
+    void NotifyEntryRemoved(CTransactionRef tx, MemPoolRemovalReason reason);
+};
+
+/** Mempool journal, if -persistmempool and -mempooljournal are set */
+extern std::unique_ptr<CMempoolJournal> g_mempool_journal;
+
+#endif // BITCOIN_MEMPOOLJOURNAL_H
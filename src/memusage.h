@@ -164,6 +164,12 @@ static inline size_t DynamicUsage(const std::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const unordered_indirectmap<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(unordered_node<std::pair<const X*, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
@@ -26,12 +26,19 @@
 #include "txmempool.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "utilstrencodings.h"
 #include "validationinterface.h"
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
 #include <queue>
+#include <unordered_map>
 #include <utility>
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // BitcoinMiner
@@ -64,11 +71,15 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
 BlockAssembler::Options::Options() {
     blockMinFeeRate = CFeeRate(DEFAULT_BLOCK_MIN_TX_FEE);
     nBlockMaxWeight = DEFAULT_BLOCK_MAX_WEIGHT;
+    fHeapSelection = DEFAULT_BLOCK_HEAP_SELECTION;
+    fCheckFull = DEFAULT_BLOCK_CHECK_FULL;
 }
 
 BlockAssembler::BlockAssembler(const CChainParams& params, const Options& options) : chainparams(params)
 {
     blockMinFeeRate = options.blockMinFeeRate;
+    fHeapSelection = options.fHeapSelection;
+    fCheckFull = options.fCheckFull;
     // Limit weight to between 4K and MAX_BLOCK_WEIGHT-4K for sanity:
     nBlockMaxWeight = std::max<size_t>(4000, std::min<size_t>(MAX_BLOCK_WEIGHT - 4000, options.nBlockMaxWeight));
 }
@@ -88,6 +99,8 @@ static BlockAssembler::Options DefaultOptions(const CChainParams& params)
     } else {
         options.blockMinFeeRate = CFeeRate(DEFAULT_BLOCK_MIN_TX_FEE);
     }
+    options.fHeapSelection = gArgs.GetBoolArg("-blockheapselection", DEFAULT_BLOCK_HEAP_SELECTION);
+    options.fCheckFull = gArgs.GetBoolArg("-blockcheckfull", DEFAULT_BLOCK_CHECK_FULL);
     return options;
 }
 
@@ -151,7 +164,12 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int nPackagesSelected = 0;
     int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    if (mempool.IsClusterTracking())
+        addChunkTxs(nPackagesSelected);
+    else if (fHeapSelection)
+        addPackageTxsHeap(nPackagesSelected, nDescendantsUpdated);
+    else
+        addPackageTxs(nPackagesSelected, nDescendantsUpdated);
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -179,9 +197,15 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     pblock->nNonce         = 0;
     pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
 
+    // Our own mempool transactions were fully validated on acceptance, so
+    // by default only the block-level rules are checked again.
     CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
-        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+    if (fCheckFull) {
+        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+            throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+        }
+    } else if (!TestBlockTemplateValidity(state, chainparams, *pblock, pindexPrev)) {
+        throw std::runtime_error(strprintf("%s: TestBlockTemplateValidity failed: %s", __func__, FormatStateMessage(state)));
     }
     int64_t nTime2 = GetTimeMicros();
 
@@ -190,6 +214,34 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     return std::move(pblocktemplate);
 }
 
+std::unique_ptr<CBlockTemplate> BlockAssembler::SelectTransactions(int nHeightIn, int64_t nLockTimeCutoffIn, bool fIncludeWitnessIn)
+{
+    resetBlock();
+
+    pblocktemplate.reset(new CBlockTemplate());
+    pblock = &pblocktemplate->block;
+    pblock->vtx.emplace_back();
+    pblocktemplate->vTxFees.push_back(-1);
+    pblocktemplate->vTxSigOpsCost.push_back(-1);
+
+    nHeight = nHeightIn;
+    nLockTimeCutoff = nLockTimeCutoffIn;
+    fIncludeWitness = fIncludeWitnessIn;
+
+    LOCK(mempool.cs);
+    int nPackagesSelected = 0;
+    int nDescendantsUpdated = 0;
+    if (mempool.IsClusterTracking())
+        addChunkTxs(nPackagesSelected);
+    else if (fHeapSelection)
+        addPackageTxsHeap(nPackagesSelected, nDescendantsUpdated);
+    else
+        addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    return std::move(pblocktemplate);
+}
+
 void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
 {
     for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
@@ -228,6 +280,17 @@ bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& packa
     return true;
 }
 
+bool BlockAssembler::TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package)
+{
+    for (const CTxMemPool::txiter it : package) {
+        if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
+            return false;
+        if (!fIncludeWitness && it->GetTx().HasWitness())
+            return false;
+    }
+    return true;
+}
+
 void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 {
     pblock->vtx.emplace_back(iter->GetSharedTx());
@@ -440,6 +503,394 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     }
 }
 
+namespace {
+
+/** Selection state of a mempool entry visited by addPackageTxsHeap */
+struct HeapPackageEntry {
+    explicit HeapPackageEntry(CTxMemPool::txiter it) : iter(it), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+        nSigOpCostWithAncestors(0), nGeneration(0), nVisited(0), fModified(false), fInBlock(false), fFailed(false) {}
+
+    CTxMemPool::txiter iter;
+    // Ancestor state without the ancestors already in the block; only set if fModified
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    int64_t nSigOpCostWithAncestors;
+    //! Bumped on every change of the ancestor state, so older heap entries can be recognized
+    uint32_t nGeneration;
+    //! Last graph walk that reached this entry
+    uint32_t nVisited;
+    bool fModified;
+    bool fInBlock;
+    bool fFailed;
+};
+
+/** A snapshot of a modified package's score, as stored in the heap */
+struct HeapPackageScore {
+    CAmount nModFeesWithAncestors;
+    uint64_t nSizeWithAncestors;
+    uint32_t nPos;
+    uint32_t nGeneration;
+};
+
+// The same order as CompareModifiedEntry: true if package a has a better
+// ancestor feerate than package b.
+bool IsBetterPackage(CAmount nFeesA, uint64_t nSizeA, CTxMemPool::txiter a, CAmount nFeesB, uint64_t nSizeB, CTxMemPool::txiter b)
+{
+    double f1 = (double)nFeesA * nSizeB;
+    double f2 = (double)nFeesB * nSizeA;
+    if (f1 == f2) {
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+    return f1 > f2;
+}
+
+/**
+ * Entries touched by addPackageTxsHeap, stored in a flat array, and a heap
+ * of the scores of modified packages. Scores are not removed when a package
+ * changes; a new one is pushed and the outdated one is dropped once it
+ * reaches the top.
+ */
+class HeapPackageSet
+{
+public:
+    std::vector<HeapPackageEntry> vEntries;
+
+    /** Position of it in vEntries, adding it if needed. Invalidates references into vEntries. */
+    uint32_t GetPos(CTxMemPool::txiter it)
+    {
+        auto ret = mapPos.emplace(&*it, vEntries.size());
+        if (ret.second)
+            vEntries.emplace_back(it);
+        return ret.first->second;
+    }
+
+    const HeapPackageEntry* Find(CTxMemPool::txiter it) const
+    {
+        auto mi = mapPos.find(&*it);
+        return mi == mapPos.end() ? nullptr : &vEntries[mi->second];
+    }
+
+    void Push(uint32_t nPos)
+    {
+        const HeapPackageEntry& entry = vEntries[nPos];
+        vHeap.push_back(HeapPackageScore{entry.nModFeesWithAncestors, entry.nSizeWithAncestors, nPos, entry.nGeneration});
+        std::push_heap(vHeap.begin(), vHeap.end(), CompareScore(vEntries));
+    }
+
+    /** Find the best modified package that is still current */
+    bool Top(uint32_t& nPos)
+    {
+        while (!vHeap.empty()) {
+            const HeapPackageScore& score = vHeap.front();
+            const HeapPackageEntry& entry = vEntries[score.nPos];
+            if (score.nGeneration == entry.nGeneration && !entry.fInBlock && !entry.fFailed) {
+                nPos = score.nPos;
+                return true;
+            }
+            Pop();
+        }
+        return false;
+    }
+
+    void Pop()
+    {
+        std::pop_heap(vHeap.begin(), vHeap.end(), CompareScore(vEntries));
+        vHeap.pop_back();
+    }
+
+private:
+    struct CompareScore {
+        const std::vector<HeapPackageEntry>& vEntries;
+        explicit CompareScore(const std::vector<HeapPackageEntry>& vEntriesIn) : vEntries(vEntriesIn) {}
+        bool operator()(const HeapPackageScore& a, const HeapPackageScore& b) const
+        {
+            return IsBetterPackage(b.nModFeesWithAncestors, b.nSizeWithAncestors, vEntries[b.nPos].iter,
+                                   a.nModFeesWithAncestors, a.nSizeWithAncestors, vEntries[a.nPos].iter);
+        }
+    };
+
+    std::unordered_map<const CTxMemPoolEntry*, uint32_t> mapPos;
+    std::vector<HeapPackageScore> vHeap;
+};
+
+} // namespace
+
+// Walks mapTx by ancestor score like addPackageTxs. Transactions whose
+// ancestor state changed are kept in a flat array instead of mapModifiedTx,
+// with their scores in a binary heap. Ancestors and descendants are found by
+// walking the mempool's parent and child links with a visit counter, so no
+// temporary sets are built per package. Unlike addPackageTxs, a package that
+// did not fit is considered again, with its correct ancestor state, once one
+// of its ancestors was added.
+void BlockAssembler::addPackageTxsHeap(int &nPackagesSelected, int &nDescendantsUpdated)
+{
+    // Packages are only ever added on top of an empty block
+    assert(inBlock.empty());
+
+    HeapPackageSet packages;
+    std::vector<HeapPackageEntry>& vEntries = packages.vEntries;
+    uint32_t nWalk = 0;
+    std::vector<uint32_t> vStack;
+    std::vector<uint32_t> vPackage;
+    std::vector<uint32_t> vUpdated;
+    std::vector<CTxMemPool::txiter> sortedEntries;
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    const CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator miEnd = mempool.mapTx.get<ancestor_score>().end();
+
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    while (true)
+    {
+        // Skip mapTx entries whose ancestor state is stale, or that were
+        // already added or failed
+        if (mi != miEnd) {
+            const HeapPackageEntry* entry = packages.Find(mempool.mapTx.project<0>(mi));
+            if (entry && (entry->fModified || entry->fInBlock || entry->fFailed)) {
+                ++mi;
+                continue;
+            }
+        }
+
+        uint32_t nPos = 0;
+        bool fHaveModified = packages.Top(nPos);
+        if (mi == miEnd && !fHaveModified)
+            break;
+
+        CTxMemPool::txiter iter;
+        bool fUsingModified = false;
+        if (mi == miEnd) {
+            fUsingModified = true;
+        } else {
+            iter = mempool.mapTx.project<0>(mi);
+            if (fHaveModified && IsBetterPackage(vEntries[nPos].nModFeesWithAncestors, vEntries[nPos].nSizeWithAncestors, vEntries[nPos].iter,
+                                                 iter->GetModFeesWithAncestors(), iter->GetSizeWithAncestors(), iter)) {
+                fUsingModified = true;
+            } else {
+                ++mi;
+            }
+        }
+
+        uint64_t packageSize;
+        CAmount packageFees;
+        int64_t packageSigOpsCost;
+        if (fUsingModified) {
+            const HeapPackageEntry& best = vEntries[nPos];
+            iter = best.iter;
+            packageSize = best.nSizeWithAncestors;
+            packageFees = best.nModFeesWithAncestors;
+            packageSigOpsCost = best.nSigOpCostWithAncestors;
+        } else {
+            packageSize = iter->GetSizeWithAncestors();
+            packageFees = iter->GetModFeesWithAncestors();
+            packageSigOpsCost = iter->GetSigOpCostWithAncestors();
+        }
+
+        if (packageFees < blockMinFeeRate.GetFee(packageSize)) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        if (!TestPackage(packageSize, packageSigOpsCost)) {
+            if (fUsingModified) {
+                packages.Pop();
+                vEntries[nPos].fFailed = true;
+            }
+
+            ++nConsecutiveFailed;
+
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight >
+                    nBlockMaxWeight - 4000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
+
+        // Collect the package: iter and its ancestors that are not in the block yet
+        if (!fUsingModified)
+            nPos = packages.GetPos(iter);
+        ++nWalk;
+        vPackage.clear();
+        vStack.assign(1, nPos);
+        vEntries[nPos].nVisited = nWalk;
+        while (!vStack.empty()) {
+            uint32_t nCurrent = vStack.back();
+            vStack.pop_back();
+            vPackage.push_back(nCurrent);
+            for (const CTxMemPool::txiter parent : mempool.GetMemPoolParents(vEntries[nCurrent].iter)) {
+                uint32_t nParent = packages.GetPos(parent);
+                HeapPackageEntry& entry = vEntries[nParent];
+                if (entry.fInBlock || entry.nVisited == nWalk)
+                    continue;
+                entry.nVisited = nWalk;
+                vStack.push_back(nParent);
+            }
+        }
+
+        sortedEntries.clear();
+        for (uint32_t n : vPackage) {
+            sortedEntries.push_back(vEntries[n].iter);
+        }
+
+        // Test if all tx's are Final
+        if (!TestPackageTransactions(sortedEntries)) {
+            if (fUsingModified) {
+                packages.Pop();
+                vEntries[nPos].fFailed = true;
+            }
+            continue;
+        }
+
+        // This transaction will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
+        // Package can be added. Sort the entries in a valid order.
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+        for (size_t i=0; i<sortedEntries.size(); ++i) {
+            AddToBlock(sortedEntries[i]);
+        }
+        for (uint32_t n : vPackage) {
+            vEntries[n].fInBlock = true;
+        }
+
+        ++nPackagesSelected;
+
+        // Remove each added transaction from the ancestor state of its
+        // descendants
+        vUpdated.clear();
+        for (uint32_t nAdded : vPackage) {
+            const CTxMemPool::txiter itAdded = vEntries[nAdded].iter;
+            ++nWalk;
+            vStack.assign(1, nAdded);
+            while (!vStack.empty()) {
+                uint32_t nCurrent = vStack.back();
+                vStack.pop_back();
+                for (const CTxMemPool::txiter child : mempool.GetMemPoolChildren(vEntries[nCurrent].iter)) {
+                    uint32_t nChild = packages.GetPos(child);
+                    HeapPackageEntry& entry = vEntries[nChild];
+                    if (entry.nVisited == nWalk)
+                        continue;
+                    entry.nVisited = nWalk;
+                    vStack.push_back(nChild);
+                    if (entry.fInBlock)
+                        continue;
+                    ++nDescendantsUpdated;
+                    if (!entry.fModified) {
+                        entry.nSizeWithAncestors = child->GetSizeWithAncestors();
+                        entry.nModFeesWithAncestors = child->GetModFeesWithAncestors();
+                        entry.nSigOpCostWithAncestors = child->GetSigOpCostWithAncestors();
+                        entry.fModified = true;
+                    }
+                    entry.nSizeWithAncestors -= itAdded->GetTxSize();
+                    entry.nModFeesWithAncestors -= itAdded->GetModifiedFee();
+                    entry.nSigOpCostWithAncestors -= itAdded->GetSigOpCost();
+                    ++entry.nGeneration;
+                    // A smaller package may fit where the old one did not
+                    entry.fFailed = false;
+                    vUpdated.push_back(nChild);
+                }
+            }
+        }
+
+        std::sort(vUpdated.begin(), vUpdated.end());
+        vUpdated.erase(std::unique(vUpdated.begin(), vUpdated.end()), vUpdated.end());
+        for (uint32_t n : vUpdated) {
+            packages.Push(n);
+        }
+    }
+}
+
+/** A chunk of a mempool cluster, as stored in the addChunkTxs heap */
+struct ClusterChunkRef {
+    CTxMemPool::clusterMap::const_iterator cluster;
+    size_t nChunk;
+
+    ClusterChunkRef(CTxMemPool::clusterMap::const_iterator clusterIn, size_t nChunkIn) : cluster(clusterIn), nChunk(nChunkIn) {}
+
+    const CTxMemPool::TxClusterChunk& GetChunk() const { return cluster->second.vChunks[nChunk]; }
+};
+
+/** Orders a max-heap of cluster chunks by feerate */
+struct CompareChunkFeeRate {
+    bool operator()(const ClusterChunkRef& a, const ClusterChunkRef& b) const
+    {
+        const CTxMemPool::TxClusterChunk& ca = a.GetChunk();
+        const CTxMemPool::TxClusterChunk& cb = b.GetChunk();
+        double f1 = (double)ca.nFee * cb.nSize;
+        double f2 = (double)cb.nFee * ca.nSize;
+        if (f1 == f2) {
+            return a.cluster->first > b.cluster->first;
+        }
+        return f1 < f2;
+    }
+};
+
+// The chunks of each cluster already come in non-increasing feerate order,
+// so the block is filled by merging the clusters: a heap holds the next chunk
+// of every cluster, and the best one is added as a whole. No ancestor sets
+// have to be recomputed for transactions left behind. A chunk that does not
+// fit drops the rest of its cluster, as later chunks may spend it.
+void BlockAssembler::addChunkTxs(int &nPackagesSelected)
+{
+    std::vector<ClusterChunkRef> vHeap;
+    vHeap.reserve(mempool.mapClusters.size());
+    for (CTxMemPool::clusterMap::const_iterator it = mempool.mapClusters.begin(); it != mempool.mapClusters.end(); ++it) {
+        vHeap.emplace_back(it, 0);
+    }
+    std::make_heap(vHeap.begin(), vHeap.end(), CompareChunkFeeRate());
+
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    std::vector<CTxMemPool::txiter> vChunkTxs;
+    while (!vHeap.empty()) {
+        std::pop_heap(vHeap.begin(), vHeap.end(), CompareChunkFeeRate());
+        const ClusterChunkRef ref = vHeap.back();
+        vHeap.pop_back();
+
+        const CTxMemPool::TxCluster& cluster = ref.cluster->second;
+        const CTxMemPool::TxClusterChunk& chunk = ref.GetChunk();
+        if (chunk.nFee < blockMinFeeRate.GetFee(chunk.nSize)) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        const uint32_t nStart = ref.nChunk == 0 ? 0 : cluster.vChunks[ref.nChunk - 1].nEnd;
+        vChunkTxs.assign(cluster.vTxs.begin() + nStart, cluster.vTxs.begin() + chunk.nEnd);
+        int64_t nSigOpCost = 0;
+        for (const CTxMemPool::txiter it : vChunkTxs) {
+            nSigOpCost += it->GetSigOpCost();
+        }
+
+        if (!TestPackage(chunk.nSize, nSigOpCost) || !TestPackageTransactions(vChunkTxs)) {
+            ++nConsecutiveFailed;
+
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight >
+                    nBlockMaxWeight - 4000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
+
+        // This chunk will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
+        // The cluster linearization is topological
+        for (const CTxMemPool::txiter it : vChunkTxs) {
+            AddToBlock(it);
+        }
+        ++nPackagesSelected;
+
+        if (ref.nChunk + 1 < cluster.vChunks.size()) {
+            vHeap.emplace_back(ref.cluster, ref.nChunk + 1);
+            std::push_heap(vHeap.begin(), vHeap.end(), CompareChunkFeeRate());
+        }
+    }
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -458,3 +909,264 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
+
+int GetGenerateThreads()
+{
+    int nThreads = gArgs.GetArg("-genthreads", DEFAULT_GENERATE_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    return std::max(1, std::min(nThreads, MAX_GENERATE_THREADS));
+}
+
+bool ScanProofOfWork(CBlockHeader& header, uint64_t nMaxTries, const Consensus::Params& consensusParams, int nThreads)
+{
+    const uint64_t nStart = header.nNonce;
+    const uint64_t nEnd = std::min(nStart + nMaxTries, (uint64_t)std::numeric_limits<uint32_t>::max() + 1);
+    nThreads = std::max<uint64_t>(1, std::min<uint64_t>(nThreads, nEnd - nStart));
+
+    // Lowest solving nonce found so far. Workers stop once they are past it,
+    // so the result does not depend on thread scheduling.
+    std::atomic<uint64_t> nFound(nEnd);
+    auto search = [&](int nOffset) {
+        std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+        CBlockHeader work(header);
+        uint256 hash;
+        for (uint64_t n = nStart + nOffset; n < nFound.load(std::memory_order_relaxed); n += nThreads) {
+            work.nNonce = n;
+            scrypt_1024_1_1_256_sp(BEGIN(work.nVersion), BEGIN(hash), scratchpad.data());
+            if (CheckProofOfWork(hash, work.nBits, consensusParams)) {
+                uint64_t nPrev = nFound.load();
+                while (n < nPrev && !nFound.compare_exchange_weak(nPrev, n)) {}
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> vThreads;
+    for (int i = 1; i < nThreads; i++) {
+        vThreads.emplace_back(search, i);
+    }
+    search(0);
+    for (std::thread& thread : vThreads) {
+        thread.join();
+    }
+
+    header.nNonce = nFound;
+    return nFound < nEnd;
+}
+
+std::unique_ptr<BlockTemplateBuilder> g_template_builder;
+
+BlockTemplateBuilder::BlockTemplateBuilder(const CChainParams& params, int64_t nRefreshIntervalIn)
+    : chainparams(params), nRefreshInterval(nRefreshIntervalIn), nHeight(0), nLockTimeCutoff(0),
+      fIncludeWitness(false), nBlockWeight(0), nBlockSigOpsCost(0), nTransactionsUpdated(0), fCommitmentStale(false),
+      fTipChanged(false), fMempoolChanged(false), fStop(false)
+{
+    BlockAssembler::Options options = DefaultOptions(params);
+    nBlockMaxWeight = std::max<size_t>(4000, std::min<size_t>(MAX_BLOCK_WEIGHT - 4000, options.nBlockMaxWeight));
+    blockMinFeeRate = options.blockMinFeeRate;
+}
+
+BlockTemplateBuilder::~BlockTemplateBuilder()
+{
+    Stop();
+}
+
+void BlockTemplateBuilder::Start()
+{
+    assert(!threadBuild.joinable());
+    mempool.NotifyEntryRemoved.connect(boost::bind(&BlockTemplateBuilder::NotifyEntryRemoved, this, _1, _2));
+    RegisterValidationInterface(this);
+    threadBuild = std::thread(&TraceThread<std::function<void()> >, "tmplbuild", std::function<void()>(std::bind(&BlockTemplateBuilder::ThreadBuild, this)));
+}
+
+void BlockTemplateBuilder::Stop()
+{
+    if (!threadBuild.joinable())
+        return;
+    UnregisterValidationInterface(this);
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&BlockTemplateBuilder::NotifyEntryRemoved, this, _1, _2));
+    {
+        boost::unique_lock<boost::mutex> lock(cs_wake);
+        fStop = true;
+    }
+    condWake.notify_all();
+    threadBuild.join();
+}
+
+void BlockTemplateBuilder::Wake(bool fTip)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_wake);
+        if (fTip)
+            fTipChanged = true;
+        else
+            fMempoolChanged = true;
+    }
+    condWake.notify_all();
+}
+
+void BlockTemplateBuilder::ThreadBuild()
+{
+    int64_t nLastBuild = 0;
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(cs_wake);
+            while (!fStop && !fTipChanged && !(fMempoolChanged && GetTimeMillis() >= nLastBuild + nRefreshInterval)) {
+                if (fMempoolChanged) {
+                    condWake.timed_wait(lock, boost::posix_time::milliseconds(nLastBuild + nRefreshInterval - GetTimeMillis()));
+                } else {
+                    condWake.wait(lock);
+                }
+            }
+            if (fStop)
+                return;
+            fTipChanged = false;
+            fMempoolChanged = false;
+        }
+        nLastBuild = GetTimeMillis();
+        Rebuild();
+    }
+}
+
+void BlockTemplateBuilder::Rebuild()
+{
+    {
+        LOCK(cs_main);
+        if (chainActive.Tip() == nullptr || IsInitialBlockDownload())
+            return;
+    }
+
+    unsigned int nTransactionsUpdatedBuild = mempool.GetTransactionsUpdated();
+    std::unique_ptr<CBlockTemplate> pblocktemplateNew;
+    try {
+        CScript scriptDummy = CScript() << OP_TRUE;
+        pblocktemplateNew = BlockAssembler(chainparams).CreateNewBlock(scriptDummy, true);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    if (!pblocktemplateNew)
+        return;
+    const CBlock& block = pblocktemplateNew->block;
+
+    std::set<uint256> setTx;
+    uint64_t nWeight = 4000;
+    int64_t nSigOpsCost = 400;
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        setTx.insert(block.vtx[i]->GetHash());
+        nWeight += GetTransactionWeight(*block.vtx[i]);
+        nSigOpsCost += pblocktemplateNew->vTxSigOpsCost[i];
+    }
+
+    LOCK2(cs_main, mempool.cs);
+    BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+    if (mi == mapBlockIndex.end() || mi->second != chainActive.Tip())
+        return;
+    const CBlockIndex* pindexPrev = mi->second;
+
+    LOCK(cs);
+    pblocktemplate = std::move(pblocktemplateNew);
+    setTemplateTx.swap(setTx);
+    hashPrevBlock = block.hashPrevBlock;
+    nHeight = pindexPrev->nHeight + 1;
+    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                       ? pindexPrev->GetMedianTimePast()
+                       : pblocktemplate->block.GetBlockTime();
+    fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus());
+    nBlockWeight = nWeight;
+    nBlockSigOpsCost = nSigOpsCost;
+    nTransactionsUpdated = nTransactionsUpdatedBuild;
+    fCommitmentStale = false;
+}
+
+void BlockTemplateBuilder::TransactionAddedToMempool(const CTransactionRef& ptx)
+{
+    LOCK(mempool.cs);
+    CTxMemPool::txiter it = mempool.mapTx.find(ptx->GetHash());
+    if (it == mempool.mapTx.end())
+        return;
+
+    bool fAppended = false;
+    {
+        LOCK(cs);
+        if (pblocktemplate && !setTemplateTx.count(ptx->GetHash()) &&
+                CFeeRate(it->GetModifiedFee(), it->GetTxSize()) >= blockMinFeeRate &&
+                nBlockWeight + it->GetTxWeight() < nBlockMaxWeight &&
+                nBlockSigOpsCost + it->GetSigOpCost() < MAX_BLOCK_SIGOPS_COST &&
+                IsFinalTx(*ptx, nHeight, nLockTimeCutoff) &&
+                (fIncludeWitness || !ptx->HasWitness())) {
+            fAppended = true;
+            for (const CTxMemPool::txiter& parent : mempool.GetMemPoolParents(it)) {
+                if (!setTemplateTx.count(parent->GetTx().GetHash())) {
+                    fAppended = false;
+                    break;
+                }
+            }
+        }
+        if (fAppended) {
+            CBlock& block = pblocktemplate->block;
+            block.vtx.push_back(it->GetSharedTx());
+            pblocktemplate->vTxFees.push_back(it->GetFee());
+            pblocktemplate->vTxSigOpsCost.push_back(it->GetSigOpCost());
+            setTemplateTx.insert(ptx->GetHash());
+            nBlockWeight += it->GetTxWeight();
+            nBlockSigOpsCost += it->GetSigOpCost();
+
+            CMutableTransaction coinbaseTx(*block.vtx[0]);
+            coinbaseTx.vout[0].nValue += it->GetFee();
+            block.vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+            pblocktemplate->vTxFees[0] -= it->GetFee();
+            nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            fCommitmentStale = true;
+        }
+    }
+    // Let the next rebuild put it where it belongs by feerate.
+    Wake(false);
+}
+
+void BlockTemplateBuilder::NotifyEntryRemoved(CTransactionRef tx, MemPoolRemovalReason reason)
+{
+    {
+        LOCK(cs);
+        if (!setTemplateTx.count(tx->GetHash()))
+            return;
+        // Transactions leaving the mempool for a block are handled by the
+        // tip change; anything else may leave the template invalid.
+        if (reason != MemPoolRemovalReason::BLOCK) {
+            pblocktemplate.reset();
+            setTemplateTx.clear();
+        }
+    }
+    Wake(reason == MemPoolRemovalReason::BLOCK);
+}
+
+void BlockTemplateBuilder::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+{
+    // Nobody mines on a tip that is still syncing; getblocktemplate builds
+    // its own template if it is called anyway.
+    if (fInitialDownload)
+        return;
+    Wake(true);
+}
+
+std::unique_ptr<CBlockTemplate> BlockTemplateBuilder::GetTemplate(const CBlockIndex* pindexTip, unsigned int& nTransactionsUpdatedOut)
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs);
+    if (!pblocktemplate || hashPrevBlock != pindexTip->GetBlockHash())
+        return nullptr;
+
+    if (fCommitmentStale) {
+        // Appended transactions change the witness merkle root
+        if (!pblocktemplate->vchCoinbaseCommitment.empty()) {
+            CMutableTransaction coinbaseTx(*pblocktemplate->block.vtx[0]);
+            coinbaseTx.vout.pop_back();
+            pblocktemplate->block.vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+            pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(pblocktemplate->block, pindexTip, chainparams.GetConsensus());
+        }
+        fCommitmentStale = false;
+    }
+
+    nTransactionsUpdatedOut = nTransactionsUpdated;
+    return std::unique_ptr<CBlockTemplate>(new CBlockTemplate(*pblocktemplate));
+}
@@ -7,10 +7,14 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "sync.h"
 #include "txmempool.h"
+#include "validationinterface.h"
 
 #include <stdint.h>
 #include <memory>
+#include <set>
+#include <thread>
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 
@@ -21,6 +25,18 @@ class CScript;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -blockheapselection */
+static const bool DEFAULT_BLOCK_HEAP_SELECTION = false;
+/** Default for -blockcheckfull */
+static const bool DEFAULT_BLOCK_CHECK_FULL = false;
+/** Default for -blocktemplatebuilder */
+static const bool DEFAULT_BLOCK_TEMPLATE_BUILDER = false;
+/** Default for -blocktemplaterefresh, the minimum time (in milliseconds) between rebuilds of a block template for a changed mempool */
+static const int64_t DEFAULT_BLOCK_TEMPLATE_REFRESH = 5000;
+/** Default for -genthreads, the number of threads searching nonces for the generate RPCs (0 = one per core) */
+static const int DEFAULT_GENERATE_THREADS = 0;
+/** Maximum number of threads searching nonces */
+static const int MAX_GENERATE_THREADS = 64;
 
 struct CBlockTemplate
 {
@@ -141,6 +157,8 @@ private:
     bool fIncludeWitness;
     unsigned int nBlockMaxWeight;
     CFeeRate blockMinFeeRate;
+    bool fHeapSelection;
+    bool fCheckFull;
 
     // Information on the current status of the block
     uint64_t nBlockWeight;
@@ -160,6 +178,10 @@ public:
         size_t nBlockMaxWeight;
         size_t nBlockMaxSize;
         CFeeRate blockMinFeeRate;
+        //! Select packages with addPackageTxsHeap instead of addPackageTxs
+        bool fHeapSelection;
+        //! Check new blocks with TestBlockValidity instead of TestBlockTemplateValidity
+        bool fCheckFull;
     };
 
     BlockAssembler(const CChainParams& params);
@@ -168,6 +190,11 @@ public:
     /** Construct a new block template with coinbase to scriptPubKeyIn */
     std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, bool fMineWitnessTx=true);
 
+    /** Select mempool transactions the way CreateNewBlock would for a block
+      * at nHeightIn, without creating a coinbase or checking validity. The
+      * coinbase slot of the returned template is left empty. */
+    std::unique_ptr<CBlockTemplate> SelectTransactions(int nHeightIn, int64_t nLockTimeCutoffIn, bool fIncludeWitnessIn);
+
 private:
     // utility functions
     /** Clear the block's state and prepare for assembling a new block */
@@ -180,6 +207,14 @@ private:
       * Increments nPackagesSelected / nDescendantsUpdated with corresponding
       * statistics from the package selection (for logging statistics). */
     void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated);
+    /** Select packages by ancestor feerate like addPackageTxs, tracking the
+      * modified packages in a flat array with a lazily updated heap, and
+      * walking the mempool links instead of building ancestor and descendant
+      * sets */
+    void addPackageTxsHeap(int &nPackagesSelected, int &nDescendantsUpdated);
+    /** Add the chunks of the mempool's clusters by feerate, when the mempool
+      * tracks clusters */
+    void addChunkTxs(int &nPackagesSelected);
 
     // helper functions for addPackageTxs()
     /** Remove confirmed (inBlock) entries from given set */
@@ -191,6 +226,7 @@ private:
       * These checks should always succeed, and they're here
       * only as an extra check in case of suboptimal node configuration */
     bool TestPackageTransactions(const CTxMemPool::setEntries& package);
+    bool TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package);
     /** Return true if given transaction from mapTx has already been evaluated,
       * or if the transaction's cached data in mapTx is incorrect. */
     bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
@@ -202,8 +238,89 @@ private:
     int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
 };
 
+/**
+ * Keeps a block template for the current tip ready for getblocktemplate.
+ *
+ * A background thread rebuilds the template with BlockAssembler right after
+ * the tip changes, and at most once per refresh interval when the mempool
+ * changed. In between, transactions entering the mempool are appended to
+ * the current template as long as it has room and their unconfirmed parents
+ * are already in it, so fees stay fresh without rebuilding. Appended
+ * transactions were just accepted against the tip and the template's own
+ * transactions, so they skip TestBlockValidity; the next rebuild reorders
+ * them by feerate. Transactions leaving the mempool invalidate the template
+ * until it is rebuilt.
+ */
+class BlockTemplateBuilder : public CValidationInterface
+{
+public:
+    BlockTemplateBuilder(const CChainParams& params, int64_t nRefreshIntervalIn);
+    ~BlockTemplateBuilder();
+
+    void Start();
+    void Stop();
+
+    /**
+     * Return a copy of the current template if it builds on pindexTip, with
+     * nTransactionsUpdated set to the mempool's update counter it reflects.
+     * Returns nullptr if no valid template is available. Requires cs_main.
+     */
+    std::unique_ptr<CBlockTemplate> GetTemplate(const CBlockIndex* pindexTip, unsigned int& nTransactionsUpdated);
+
+protected:
+    // CValidationInterface
+    void TransactionAddedToMempool(const CTransactionRef& ptx) override;
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) override;
+
+private:
+    const CChainParams& chainparams;
+    const int64_t nRefreshInterval;
+
+    CCriticalSection cs;
+    std::unique_ptr<CBlockTemplate> pblocktemplate GUARDED_BY(cs);
+    //! Transactions in pblocktemplate, for appending children and detecting removals
+    std::set<uint256> setTemplateTx GUARDED_BY(cs);
+    uint256 hashPrevBlock GUARDED_BY(cs);
+    int nHeight GUARDED_BY(cs);
+    int64_t nLockTimeCutoff GUARDED_BY(cs);
+    bool fIncludeWitness GUARDED_BY(cs);
+    uint64_t nBlockWeight GUARDED_BY(cs);
+    int64_t nBlockSigOpsCost GUARDED_BY(cs);
+    unsigned int nBlockMaxWeight;
+    CFeeRate blockMinFeeRate;
+    unsigned int nTransactionsUpdated GUARDED_BY(cs);
+    //! Whether the coinbase witness commitment must be regenerated after appending transactions
+    bool fCommitmentStale GUARDED_BY(cs);
+
+    boost::mutex cs_wake;
+    boost::condition_variable condWake;
+    bool fTipChanged;
+    bool fMempoolChanged;
+    bool fStop;
+    std::thread threadBuild;
+
+    void ThreadBuild();
+    void Rebuild();
+    void Wake(bool fTip);
+    void NotifyEntryRemoved(CTransactionRef tx, MemPoolRemovalReason reason);
+};
+
+/** Background block template builder, if enabled with -blocktemplatebuilder */
+extern std::unique_ptr<BlockTemplateBuilder> g_template_builder;
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
+/** Number of threads to search nonces with, from -genthreads */
+int GetGenerateThreads();
+/**
+ * Search the nonces from header.nNonce for a proof of work, trying at most
+ * nMaxTries of them. The nonce space is interleaved over nThreads threads,
+ * each hashing with its own scratchpad. Returns whether a proof of work was
+ * found. header.nNonce is then set to the lowest solving nonce, the same one
+ * a sequential search finds, and otherwise to the first nonce not tried.
+ */
+bool ScanProofOfWork(CBlockHeader& header, uint64_t nMaxTries, const Consensus::Params& consensusParams, int nThreads);
+
 #endif // BITCOIN_MINER_H
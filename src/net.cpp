@@ -673,6 +673,10 @@ void CNode::copyStats(CNodeStats &stats)
         X(mapRecvBytesPerMsgCmd);
         X(nRecvBytes);
     }
+    {
+        LOCK(cs_msgStats);
+        X(mapStatsPerMsgCmd);
+    }
     X(fWhitelisted);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -2771,9 +2775,12 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     fPauseSend = false;
     nProcessQueueSize = 0;
 
-    for (const std::string &msg : getAllNetMessageTypes())
+    for (const std::string &msg : getAllNetMessageTypes()) {
         mapRecvBytesPerMsgCmd[msg] = 0;
+        mapStatsPerMsgCmd[msg] = CMsgCmdStats();
+    }
     mapRecvBytesPerMsgCmd[NET_MESSAGE_COMMAND_OTHER] = 0;
+    mapStatsPerMsgCmd[NET_MESSAGE_COMMAND_OTHER] = CMsgCmdStats();
 
     if (fLogIPs) {
         LogPrint(BCLog::NET, "Added connection to %s peer=%d\n", addrName, id);
@@ -2782,6 +2789,26 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     }
 }
 
+void CNode::RecordMessageProcessed(const std::string& strCommand, int64_t nProcessTime, int64_t nLockWaitTime)
+{
+    LOCK(cs_msgStats);
+    mapMsgCmdStats::iterator it = mapStatsPerMsgCmd.find(strCommand);
+    if (it == mapStatsPerMsgCmd.end())
+        it = mapStatsPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(it != mapStatsPerMsgCmd.end());
+    it->second.nRecvCount++;
+    it->second.nProcessTime += nProcessTime;
+    it->second.nLockWaitTime += nLockWaitTime;
+}
+
+void CNode::RecordMessageSent(const std::string& strCommand, int64_t nSerializeTime)
+{
+    LOCK(cs_msgStats);
+    CMsgCmdStats& stats = mapStatsPerMsgCmd[strCommand];
+    stats.nSendCount++;
+    stats.nSerializeTime += nSerializeTime;
+}
+
 CNode::~CNode()
 {
     CloseSocket(hSocket);
@@ -2835,6 +2862,7 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
     size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
     LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
 
+    int64_t nStart = GetTimeMicros();
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
     uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
@@ -2842,6 +2870,7 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+    pnode->RecordMessageSent(msg.command, msg.nSerializeTime + GetTimeMicros() - nStart);
 
     size_t nBytesSent = 0;
     {
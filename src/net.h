@@ -113,6 +113,8 @@ struct CSerializedNetMsg
 
     std::vector<unsigned char> data;
     std::string command;
+    //! Time spent serializing the payload, in microseconds
+    int64_t nSerializeTime = 0;
 };
 
 class NetEventsInterface;
@@ -515,6 +517,43 @@ extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
 
+/** Message counts and handling costs of one command. Times are in microseconds. */
+struct CMsgCmdStats
+{
+    uint64_t nRecvCount;
+    uint64_t nSendCount;
+    //! Wall time spent in ProcessMessage
+    int64_t nProcessTime;
+    //! Part of nProcessTime spent blocked waiting for cs_main
+    int64_t nLockWaitTime;
+    //! Time spent serializing sent messages
+    int64_t nSerializeTime;
+
+    CMsgCmdStats() : nRecvCount(0), nSendCount(0), nProcessTime(0), nLockWaitTime(0), nSerializeTime(0) {}
+
+    CMsgCmdStats& operator+=(const CMsgCmdStats& other)
+    {
+        nRecvCount += other.nRecvCount;
+        nSendCount += other.nSendCount;
+        nProcessTime += other.nProcessTime;
+        nLockWaitTime += other.nLockWaitTime;
+        nSerializeTime += other.nSerializeTime;
+        return *this;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nRecvCount);
+        READWRITE(nSendCount);
+        READWRITE(nProcessTime);
+        READWRITE(nLockWaitTime);
+        READWRITE(nSerializeTime);
+    }
+};
+typedef std::map<std::string, CMsgCmdStats> mapMsgCmdStats; //command, stats
+
 class CNodeStats
 {
 public:
@@ -535,6 +574,7 @@ public:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    mapMsgCmdStats mapStatsPerMsgCmd;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -663,6 +703,9 @@ protected:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
 
+    CCriticalSection cs_msgStats;
+    mapMsgCmdStats mapStatsPerMsgCmd GUARDED_BY(cs_msgStats);
+
 public:
     uint256 hashContinue;
     std::atomic<int> nStartingHeight;
@@ -677,9 +720,6 @@ public:
 
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
-    // Set of transaction ids we still have to announce.
-    // They are sorted by the mempool before relay, so the order is not important.
-    std::set<uint256> setInventoryTxToSend;
     // List of block ids we still have announce.
     // There is no final sorting before sending, as they are always sent immediately
     // and in the order requested.
@@ -697,6 +737,10 @@ public:
     // Last time a "MEMPOOL" request was serviced.
     std::atomic<int64_t> timeLastMempoolReq;
 
+    // Orphan transactions whose parents were accepted from this peer and that
+    // still need to be reconsidered. Only used by the message handler thread.
+    std::set<uint256> setOrphanWorkSet;
+
     // Block and TXN accept times
     std::atomic<int64_t> nLastBlockTime;
     std::atomic<int64_t> nLastTXTime;
@@ -821,11 +865,7 @@ public:
     void PushInventory(const CInv& inv)
     {
         LOCK(cs_inventory);
-        if (inv.type == MSG_TX) {
-            if (!filterInventoryKnown.contains(inv.hash)) {
-                setInventoryTxToSend.insert(inv.hash);
-            }
-        } else if (inv.type == MSG_BLOCK) {
+        if (inv.type == MSG_BLOCK) {
             vInventoryBlockToSend.push_back(inv.hash);
         }
     }
@@ -842,6 +882,11 @@ public:
 
     void copyStats(CNodeStats &stats);
 
+    //! Account for a received message handled by ProcessMessage
+    void RecordMessageProcessed(const std::string& strCommand, int64_t nProcessTime, int64_t nLockWaitTime);
+    //! Account for a message queued for sending
+    void RecordMessageSent(const std::string& strCommand, int64_t nSerializeTime);
+
     ServiceFlags GetLocalServices() const
     {
         return nLocalServices;
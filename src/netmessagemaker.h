@@ -8,6 +8,7 @@
 
 #include "net.h"
 #include "serialize.h"
+#include "utiltime.h"
 
 class CNetMsgMaker
 {
@@ -17,9 +18,11 @@ public:
     template <typename... Args>
     CSerializedNetMsg Make(int nFlags, std::string sCommand, Args&&... args) const
     {
+        int64_t nStart = GetTimeMicros();
         CSerializedNetMsg msg;
         msg.command = std::move(sCommand);
         CVectorWriter{ SER_NETWORK, nFlags | nVersion, msg.data, 0, std::forward<Args>(args)... };
+        msg.nSerializeTime = GetTimeMicros() - nStart;
         return msg;
     }
 
@@ -16,6 +16,9 @@
 
 static constexpr double INF_FEERATE = 1e99;
 
+/** Decay factor below which the stored moving averages are rescaled, long before they could overflow */
+static constexpr double MIN_DECAY_FACTOR = 1e-100;
+
 std::string StringForFeeEstimateHorizon(FeeEstimateHorizon horizon) {
     static const std::map<FeeEstimateHorizon, std::string> horizon_strings = {
         {FeeEstimateHorizon::SHORT_HALFLIFE, "short"},
@@ -100,6 +103,11 @@ private:
 
     double decay;
 
+    // The moving averages above are stored divided by the product of the
+    // decays applied since they were last rescaled, so decaying them every
+    // block only has to update this factor. They are multiplied by it when read.
+    double decayFactor;
+
     // Resolution (# of blocks) with which confirmations are tracked
     unsigned int scale;
 
@@ -112,6 +120,9 @@ private:
 
     void resizeInMemoryCounters(size_t newbuckets);
 
+    /** Apply decayFactor to the stored moving averages and reset it to 1 */
+    void Rescale();
+
 public:
     /**
      * Create new TxConfirmStats. This is called by BlockPolicyEstimator's
@@ -141,8 +152,7 @@ public:
     void removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight,
                   unsigned int bucketIndex, bool inBlock);
 
-    /** Update our estimates by decaying our historical moving average and updating
-        with the data gathered from the current block */
+    /** Decay our historical moving averages by one block */
     void UpdateMovingAverages();
 
     /**
@@ -180,6 +190,7 @@ TxConfirmStats::TxConfirmStats(const std::vector<double>& defaultBuckets,
     : buckets(defaultBuckets), bucketMap(defaultBucketMap)
 {
     decay = _decay;
+    decayFactor = 1;
     scale = _scale;
     confAvg.resize(maxPeriods);
     for (unsigned int i = 0; i < maxPeriods; i++) {
@@ -222,23 +233,32 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
         return;
     int periodsToConfirm = (blocksToConfirm + scale - 1)/scale;
     unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+    const double weight = 1 / decayFactor;
     for (size_t i = periodsToConfirm; i <= confAvg.size(); i++) {
-        confAvg[i - 1][bucketindex]++;
+        confAvg[i - 1][bucketindex] += weight;
     }
-    txCtAvg[bucketindex]++;
-    avg[bucketindex] += val;
+    txCtAvg[bucketindex] += weight;
+    avg[bucketindex] += val * weight;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
+    decayFactor *= decay;
+    if (decayFactor < MIN_DECAY_FACTOR)
+        Rescale();
+}
+
+void TxConfirmStats::Rescale()
+{
+    for (unsigned int j = 0; j < avg.size(); j++) {
         for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay;
+            confAvg[i][j] *= decayFactor;
         for (unsigned int i = 0; i < failAvg.size(); i++)
-            failAvg[i][j] = failAvg[i][j] * decay;
-        avg[j] = avg[j] * decay;
-        txCtAvg[j] = txCtAvg[j] * decay;
+            failAvg[i][j] *= decayFactor;
+        avg[j] *= decayFactor;
+        txCtAvg[j] *= decayFactor;
     }
+    decayFactor = 1;
 }
 
 // returns -1 on error conditions
@@ -286,9 +306,9 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
             newBucketRange = false;
         }
         curFarBucket = bucket;
-        nConf += confAvg[periodTarget - 1][bucket];
-        totalNum += txCtAvg[bucket];
-        failNum += failAvg[periodTarget - 1][bucket];
+        nConf += confAvg[periodTarget - 1][bucket] * decayFactor;
+        totalNum += txCtAvg[bucket] * decayFactor;
+        failNum += failAvg[periodTarget - 1][bucket] * decayFactor;
         for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
             extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
         extraNum += oldUnconfTxs[bucket];
@@ -343,6 +363,7 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     // Find the bucket with the median transaction and then report the average feerate from that bucket
     // This is a compromise between finding the median which we can't since we don't save all tx's
     // and reporting the average which is less accurate
+    // (Only ratios of the stored averages are used here, so decayFactor is not applied)
     unsigned int minBucket = std::min(bestNearBucket, bestFarBucket);
     unsigned int maxBucket = std::max(bestNearBucket, bestFarBucket);
     for (unsigned int j = minBucket; j <= maxBucket; j++) {
@@ -396,12 +417,15 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
 
 void TxConfirmStats::Write(CAutoFile& fileout) const
 {
-    fileout << decay;
-    fileout << scale;
-    fileout << avg;
-    fileout << txCtAvg;
-    fileout << confAvg;
-    fileout << failAvg;
+    // Write the actual averages, so the file format does not depend on decayFactor
+    TxConfirmStats stats(*this);
+    stats.Rescale();
+    fileout << stats.decay;
+    fileout << stats.scale;
+    fileout << stats.avg;
+    fileout << stats.txCtAvg;
+    fileout << stats.confAvg;
+    fileout << stats.failAvg;
 }
 
 void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets)
@@ -461,6 +485,7 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
     // Resize the current block variables which aren't stored in the data file
     // to match the number of confirms and buckets
     resizeInMemoryCounters(numBuckets);
+    decayFactor = 1;
 
     LogPrint(BCLog::ESTIMATEFEE, "Reading estimates: %u buckets counting confirms up to %u blocks\n",
              numBuckets, maxConfirms);
@@ -504,8 +529,9 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
     }
     if (!inBlock && (unsigned int)blocksAgo >= scale) { // Only counts as a failure if not confirmed for entire period
         unsigned int periodsAgo = blocksAgo / scale;
+        const double weight = 1 / decayFactor;
         for (size_t i = 0; i < periodsAgo && i < failAvg.size(); i++) {
-            failAvg[i][bucketindex]++;
+            failAvg[i][bucketindex] += weight;
         }
     }
 }
@@ -518,12 +544,12 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
 bool CBlockPolicyEstimator::removeTx(uint256 hash, bool inBlock)
 {
     LOCK(cs_feeEstimator);
-    std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
+    auto pos = mapMemPoolTxs.find(hash);
     if (pos != mapMemPoolTxs.end()) {
         feeStats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex, inBlock);
         shortStats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex, inBlock);
         longStats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex, inBlock);
-        mapMemPoolTxs.erase(hash);
+        mapMemPoolTxs.erase(pos);
         return true;
     } else {
         return false;
@@ -585,9 +611,10 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     // Feerates are stored and reported as BTC-per-kb:
     CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
 
-    mapMemPoolTxs[hash].blockHeight = txHeight;
+    TxStatsInfo& info = mapMemPoolTxs[hash];
+    info.blockHeight = txHeight;
     unsigned int bucketIndex = feeStats->NewTx(txHeight, (double)feeRate.GetFeePerK());
-    mapMemPoolTxs[hash].bucketIndex = bucketIndex;
+    info.bucketIndex = bucketIndex;
     unsigned int bucketIndex2 = shortStats->NewTx(txHeight, (double)feeRate.GetFeePerK());
     assert(bucketIndex == bucketIndex2);
     unsigned int bucketIndex3 = longStats->NewTx(txHeight, (double)feeRate.GetFeePerK());
@@ -10,9 +10,11 @@
 #include "uint256.h"
 #include "random.h"
 #include "sync.h"
+#include "txmempool.h"
 
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 class CAutoFile;
@@ -242,7 +244,7 @@ private:
     };
 
     // map of txids to information about that transaction
-    std::map<uint256, TxStatsInfo> mapMemPoolTxs;
+    std::unordered_map<uint256, TxStatsInfo, SaltedTxidHasher> mapMemPoolTxs;
 
     /** Classes to track historical data on transaction confirmations */
     TxConfirmStats* feeStats;
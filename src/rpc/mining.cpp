@@ -12,6 +12,7 @@
 #include "consensus/validation.h"
 #include "core_io.h"
 #include "init.h"
+#include "mempooljournal.h"
 #include "validation.h"
 #include "miner.h"
 #include "net.h"
@@ -117,6 +118,7 @@ UniValue generateBlocks(std::shared_ptr<CReserveScript> coinbaseScript, int nGen
         nHeightEnd = nHeight+nGenerate;
     }
     unsigned int nExtraNonce = 0;
+    const int nThreads = GetGenerateThreads();
     UniValue blockHashes(UniValue::VARR);
     while (nHeight < nHeightEnd)
     {
@@ -128,14 +130,13 @@ UniValue generateBlocks(std::shared_ptr<CReserveScript> coinbaseScript, int nGen
             LOCK(cs_main);
             IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
         }
-        while (nMaxTries > 0 && pblock->nNonce < nInnerLoopCount && !CheckProofOfWork(pblock->GetPoWHash(), pblock->nBits, Params().GetConsensus())) {
-            ++pblock->nNonce;
-            --nMaxTries;
-        }
+        uint32_t nNonceStart = pblock->nNonce;
+        bool fFound = ScanProofOfWork(*pblock, std::min<uint64_t>(nMaxTries, nInnerLoopCount - nNonceStart), Params().GetConsensus(), nThreads);
+        nMaxTries -= pblock->nNonce - nNonceStart;
         if (nMaxTries == 0) {
             break;
         }
-        if (pblock->nNonce == nInnerLoopCount) {
+        if (!fFound) {
             continue;
         }
         std::shared_ptr<const CBlock> shared_pblock = std::make_shared<const CBlock>(*pblock);
@@ -254,7 +255,14 @@ UniValue prioritisetransaction(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Priority is no longer supported, dummy argument to prioritisetransaction must be 0.");
     }
 
-    mempool.PrioritiseTransaction(hash, nAmount);
+    {
+        // Journal the delta under mempool.cs, so that a compaction either
+        // includes it in its snapshot or follows the record.
+        LOCK(mempool.cs);
+        mempool.PrioritiseTransaction(hash, nAmount);
+        if (g_mempool_journal)
+            g_mempool_journal->PrioritiseTransaction(hash, nAmount);
+    }
     return true;
 }
 
@@ -504,9 +512,21 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     // Cache whether the last invocation was with segwit support, to avoid returning
     // a segwit-block to a non-segwit caller.
     static bool fLastTemplateSupportsSegwit = true;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5) ||
-        fLastTemplateSupportsSegwit != fSupportsSegwit)
+    bool fFromBuilder = false;
+    if (g_template_builder && fSupportsSegwit) {
+        // The background builder keeps a template for the tip ready
+        std::unique_ptr<CBlockTemplate> pblocktemplateReady = g_template_builder->GetTemplate(chainActive.Tip(), nTransactionsUpdatedLast);
+        if (pblocktemplateReady) {
+            pblocktemplate = std::move(pblocktemplateReady);
+            pindexPrev = chainActive.Tip();
+            nStart = GetTimeMillis();
+            fLastTemplateSupportsSegwit = true;
+            fFromBuilder = true;
+        }
+    }
+    if (!fFromBuilder && (pindexPrev != chainActive.Tip() ||
+        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTimeMillis() - nStart > gArgs.GetArg("-blocktemplaterefresh", DEFAULT_BLOCK_TEMPLATE_REFRESH)) ||
+        fLastTemplateSupportsSegwit != fSupportsSegwit))
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = nullptr;
@@ -514,7 +534,7 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
         // Store the pindexBest used before CreateNewBlock, to avoid races
         nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
         CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
+        nStart = GetTimeMillis();
         fLastTemplateSupportsSegwit = fSupportsSegwit;
 
         // Create new block
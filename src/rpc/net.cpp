@@ -390,6 +390,81 @@ UniValue getnettotals(const JSONRPCRequest& request)
     return obj;
 }
 
+static UniValue MsgCmdStatsToJSON(const mapMsgCmdStats& mapStats)
+{
+    UniValue ret(UniValue::VOBJ);
+    for (const mapMsgCmdStats::value_type& i : mapStats) {
+        const CMsgCmdStats& stats = i.second;
+        if (stats.nRecvCount == 0 && stats.nSendCount == 0)
+            continue;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("recv", stats.nRecvCount));
+        obj.push_back(Pair("sent", stats.nSendCount));
+        obj.push_back(Pair("process_us", stats.nProcessTime));
+        obj.push_back(Pair("cs_main_wait_us", stats.nLockWaitTime));
+        obj.push_back(Pair("serialize_us", stats.nSerializeTime));
+        ret.push_back(Pair(i.first, obj));
+    }
+    return ret;
+}
+
+UniValue getnetstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            "getnetstats\n"
+            "\nReturns per-peer and per-message-type message counts and processing costs.\n"
+            "Only message types that were sent or received are listed. Times are in microseconds.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"totals\": {            (json object) Sums over all connected peers\n"
+            "    \"msg\": {             (json object) Statistics of one message type\n"
+            "      \"recv\": n,            (numeric) Messages received\n"
+            "      \"sent\": n,            (numeric) Messages sent\n"
+            "      \"process_us\": n,      (numeric) Time spent processing received messages\n"
+            "      \"cs_main_wait_us\": n, (numeric) Part of process_us spent waiting for cs_main\n"
+            "      \"serialize_us\": n     (numeric) Time spent serializing sent messages\n"
+            "    },\n"
+            "    ...\n"
+            "  },\n"
+            "  \"peers\": [\n"
+            "    {\n"
+            "      \"id\": n,              (numeric) Peer index\n"
+            "      \"addr\": \"host:port\",  (string) The IP address and port of the peer\n"
+            "      \"msgs\": { ... }       (json object) Statistics per message type, as in totals\n"
+            "    },\n"
+            "    ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetstats", "")
+            + HelpExampleRpc("getnetstats", "")
+        );
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    std::vector<CNodeStats> vstats;
+    g_connman->GetNodeStats(vstats);
+
+    mapMsgCmdStats mapTotals;
+    UniValue peers(UniValue::VARR);
+    for (const CNodeStats& stats : vstats) {
+        for (const mapMsgCmdStats::value_type& i : stats.mapStatsPerMsgCmd) {
+            mapTotals[i.first] += i.second;
+        }
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("id", stats.nodeid));
+        obj.push_back(Pair("addr", stats.addrName));
+        obj.push_back(Pair("msgs", MsgCmdStatsToJSON(stats.mapStatsPerMsgCmd)));
+        peers.push_back(obj);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("totals", MsgCmdStatsToJSON(mapTotals)));
+    ret.push_back(Pair("peers", peers));
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -632,6 +707,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         true,  {"address", "nodeid"} },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,  {"node"} },
     { "network",            "getnettotals",           &getnettotals,           true,  {} },
+    { "network",            "getnetstats",            &getnetstats,            true,  {} },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true,  {} },
     { "network",            "setban",                 &setban,                 true,  {"subnet", "command", "bantime", "absolute"} },
     { "network",            "listbanned",             &listbanned,             true,  {} },
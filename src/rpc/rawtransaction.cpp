@@ -13,6 +13,7 @@
 #include "validation.h"
 #include "merkleblock.h"
 #include "net.h"
+#include "net_processing.h"
 #include "policy/policy.h"
 #include "policy/rbf.h"
 #include "primitives/transaction.h"
@@ -950,11 +951,7 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     if(!g_connman)
         throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
 
-    CInv inv(MSG_TX, hashTx);
-    g_connman->ForEachNode([&inv](CNode* pnode)
-    {
-        pnode->PushInventory(inv);
-    });
+    RelayTransaction(*tx);
     return hashTx.GetHex();
 }
 
@@ -0,0 +1,590 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/merkle.h"
+#include "crypto/common.h"
+#include "miner.h"
+#include "netbase.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "timedata.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "utiltime.h"
+#include "validation.h"
+#include "validationinterface.h"
+#include "version.h"
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+/** Number of jobs for the current tip that shares are accepted for */
+static const size_t MAX_STRATUM_JOBS = 16;
+/** Disconnect miners that do not read what we send */
+static const size_t MAX_STRATUM_SEND_BUFFER = 1024 * 1024;
+
+static const int STRATUM_ERROR_OTHER = 20;
+static const int STRATUM_ERROR_JOB_NOT_FOUND = 21;
+static const int STRATUM_ERROR_DUPLICATE = 22;
+static const int STRATUM_ERROR_LOW_DIFFICULTY = 23;
+static const int STRATUM_ERROR_UNAUTHORIZED = 24;
+static const int STRATUM_ERROR_NOT_SUBSCRIBED = 25;
+
+StratumJob::StratumJob(const std::string& strIdIn, const CBlockTemplate& blocktemplate, const CScript& scriptPubKeyIn, int nHeight, bool fCleanIn)
+    : strId(strIdIn), fClean(fCleanIn), block(blocktemplate.block)
+{
+    // Reserve room for both extranonces in the coinbase scriptSig, right
+    // after the height, and remember where it is in the serialization.
+    CMutableTransaction coinbaseTx(*block.vtx[0]);
+    CScript scriptSig = CScript() << nHeight;
+    const size_t nExtraNonceOffset = scriptSig.size() + 1;
+    scriptSig << std::vector<unsigned char>(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    scriptSig += COINBASE_FLAGS;
+    coinbaseTx.vin[0].scriptSig = scriptSig;
+    coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
+
+    CDataStream ssCoinbase(SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
+    ssCoinbase << coinbaseTx;
+    // Version, input count and prevout precede the scriptSig
+    const size_t nScriptSigOffset = 4 + 1 + 36 + GetSizeOfCompactSize(scriptSig.size());
+    const size_t nOffset = nScriptSigOffset + nExtraNonceOffset;
+    vchCoinbase1.assign(ssCoinbase.begin(), ssCoinbase.begin() + nOffset);
+    vchCoinbase2.assign(ssCoinbase.begin() + nOffset + STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, ssCoinbase.end());
+
+    block.vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    vMerkleBranch = BlockMerkleBranch(block, 0);
+}
+
+UniValue StratumJob::GetNotifyParams() const
+{
+    // The previous block hash is sent as eight 32-bit words, each in big
+    // endian byte order
+    std::vector<unsigned char> vchPrevHash(block.hashPrevBlock.begin(), block.hashPrevBlock.end());
+    for (size_t i = 0; i < vchPrevHash.size(); i += 4) {
+        std::reverse(vchPrevHash.begin() + i, vchPrevHash.begin() + i + 4);
+    }
+
+    UniValue branch(UniValue::VARR);
+    for (const uint256& hash : vMerkleBranch) {
+        branch.push_back(HexStr(hash.begin(), hash.end()));
+    }
+
+    UniValue params(UniValue::VARR);
+    params.push_back(strId);
+    params.push_back(HexStr(vchPrevHash));
+    params.push_back(HexStr(vchCoinbase1));
+    params.push_back(HexStr(vchCoinbase2));
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", block.nVersion));
+    params.push_back(strprintf("%08x", block.nBits));
+    params.push_back(strprintf("%08x", block.nTime));
+    params.push_back(fClean);
+    return params;
+}
+
+CTransactionRef StratumJob::GetCoinbase(const std::vector<unsigned char>& vchExtraNonce1, const std::vector<unsigned char>& vchExtraNonce2) const
+{
+    assert(vchExtraNonce1.size() == STRATUM_EXTRANONCE1_SIZE && vchExtraNonce2.size() == STRATUM_EXTRANONCE2_SIZE);
+    std::vector<unsigned char> vchCoinbase(vchCoinbase1);
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce1.begin(), vchExtraNonce1.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchCoinbase2.begin(), vchCoinbase2.end());
+    CDataStream ssCoinbase(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
+    CMutableTransaction coinbaseTx;
+    ssCoinbase >> coinbaseTx;
+    // The witness reserved value is not part of the txid
+    coinbaseTx.vin[0].scriptWitness = block.vtx[0]->vin[0].scriptWitness;
+    return MakeTransactionRef(std::move(coinbaseTx));
+}
+
+CBlockHeader StratumJob::GetHeader(const CTransaction& coinbase, uint32_t nTime, uint32_t nNonce) const
+{
+    CBlockHeader header = block.GetBlockHeader();
+    header.hashMerkleRoot = ComputeMerkleRootFromBranch(coinbase.GetHash(), vMerkleBranch, 0);
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+    return header;
+}
+
+CBlock StratumJob::GetBlock(const CTransactionRef& coinbase, uint32_t nTime, uint32_t nNonce) const
+{
+    CBlock blockNew(block);
+    blockNew.vtx[0] = coinbase;
+    static_cast<CBlockHeader&>(blockNew) = GetHeader(*coinbase, nTime, nNonce);
+    return blockNew;
+}
+
+arith_uint256 GetStratumShareTarget(double dDifficulty)
+{
+    // 0x0000ffff00...00 at difficulty 1, kept 16 bits wider while dividing
+    // so fractional difficulties work
+    arith_uint256 target;
+    target.SetCompact(0x2100ffff);
+    uint64_t nDivisor = std::max<uint64_t>(1, std::min<double>(dDifficulty * 65536, std::numeric_limits<int64_t>::max()));
+    target /= arith_uint256(nDivisor);
+    return target;
+}
+
+namespace {
+
+/** A connected miner; only accessed from the stratum event thread */
+struct StratumClient
+{
+    std::string strAddr;
+    std::vector<unsigned char> vchExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+
+    StratumClient() : fSubscribed(false), fAuthorized(false) {}
+};
+
+/** Sends a new job when the tip changes */
+class StratumNotifier : public CValidationInterface
+{
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) override;
+};
+
+} // namespace
+
+//! libevent event loop
+static struct event_base* eventBase = nullptr;
+static std::vector<struct evconnlistener*> vListeners;
+//! Manually activated on tip changes
+static struct event* eventNewTip = nullptr;
+//! Periodic check for a changed mempool
+static struct event* eventJobTimer = nullptr;
+static std::thread threadStratum;
+static std::unique_ptr<StratumNotifier> notifier;
+
+static CScript scriptPayout;
+static double dShareDifficulty = DEFAULT_STRATUM_DIFFICULTY;
+
+// State of the event thread
+static std::map<struct bufferevent*, StratumClient> mapClients;
+static std::map<std::string, std::unique_ptr<StratumJob> > mapJobs;
+static std::deque<std::string> dequeJobIds;
+static uint32_t nNextJobId = 0;
+static uint32_t nNextExtraNonce1 = 0;
+static unsigned int nTransactionsUpdatedLast = 0;
+
+void StratumNotifier::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+{
+    if (!fInitialDownload)
+        event_active(eventNewTip, 0, 0);
+}
+
+static void Disconnect(struct bufferevent* bev)
+{
+    auto it = mapClients.find(bev);
+    if (it != mapClients.end()) {
+        LogPrint(BCLog::STRATUM, "stratum: disconnecting %s\n", it->second.strAddr);
+        mapClients.erase(it);
+    }
+    bufferevent_free(bev);
+}
+
+static void Send(struct bufferevent* bev, const std::string& strLine)
+{
+    if (evbuffer_get_length(bufferevent_get_output(bev)) > MAX_STRATUM_SEND_BUFFER) {
+        Disconnect(bev);
+        return;
+    }
+    bufferevent_write(bev, strLine.data(), strLine.size());
+}
+
+static std::string JSONLine(const UniValue& msg)
+{
+    return msg.write() + "\n";
+}
+
+static UniValue StratumNotification(const std::string& strMethod, const UniValue& params)
+{
+    UniValue msg(UniValue::VOBJ);
+    msg.push_back(Pair("id", NullUniValue));
+    msg.push_back(Pair("method", strMethod));
+    msg.push_back(Pair("params", params));
+    return msg;
+}
+
+static UniValue StratumReply(const UniValue& id, const UniValue& result, int nError = 0, const std::string& strError = "")
+{
+    UniValue msg(UniValue::VOBJ);
+    msg.push_back(Pair("id", id));
+    msg.push_back(Pair("result", nError ? NullUniValue : result));
+    if (nError) {
+        UniValue error(UniValue::VARR);
+        error.push_back(nError);
+        error.push_back(strError);
+        error.push_back(NullUniValue);
+        msg.push_back(Pair("error", error));
+    } else {
+        msg.push_back(Pair("error", NullUniValue));
+    }
+    return msg;
+}
+
+static void SendDifficulty(struct bufferevent* bev)
+{
+    UniValue params(UniValue::VARR);
+    params.push_back(dShareDifficulty);
+    Send(bev, JSONLine(StratumNotification("mining.set_difficulty", params)));
+}
+
+/** Build a job from a new template and send it to all subscribed miners */
+static void UpdateJob(bool fClean)
+{
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    int nHeight;
+    try {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            return;
+        unsigned int nTransactionsUpdated = 0;
+        if (g_template_builder)
+            pblocktemplate = g_template_builder->GetTemplate(chainActive.Tip(), nTransactionsUpdated);
+        if (!pblocktemplate) {
+            nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptPayout);
+        }
+        nHeight = chainActive.Height() + 1;
+        UpdateTime(&pblocktemplate->block, Params().GetConsensus(), chainActive.Tip());
+        nTransactionsUpdatedLast = nTransactionsUpdated;
+    } catch (const std::exception& e) {
+        LogPrintf("stratum: could not create a block template: %s\n", e.what());
+        return;
+    }
+
+    std::string strId = strprintf("%x", nNextJobId++);
+    if (fClean || (!mapJobs.empty() && mapJobs.begin()->second->block.hashPrevBlock != pblocktemplate->block.hashPrevBlock)) {
+        fClean = true;
+        mapJobs.clear();
+        dequeJobIds.clear();
+    }
+    while (dequeJobIds.size() >= MAX_STRATUM_JOBS) {
+        mapJobs.erase(dequeJobIds.front());
+        dequeJobIds.pop_front();
+    }
+    std::unique_ptr<StratumJob> job(new StratumJob(strId, *pblocktemplate, scriptPayout, nHeight, fClean));
+
+    // The notification is the same for every miner, so it is encoded once
+    std::string strNotify = JSONLine(StratumNotification("mining.notify", job->GetNotifyParams()));
+    mapJobs[strId] = std::move(job);
+    dequeJobIds.push_back(strId);
+
+    size_t nSent = 0;
+    for (auto it = mapClients.begin(); it != mapClients.end(); ) {
+        // Send may disconnect the miner and erase it
+        auto itCurrent = it++;
+        if (itCurrent->second.fSubscribed) {
+            Send(itCurrent->first, strNotify);
+            ++nSent;
+        }
+    }
+    LogPrint(BCLog::STRATUM, "stratum: job %s for height %d sent to %u miners\n", strId, nHeight, nSent);
+}
+
+static void NewTipCallback(evutil_socket_t, short, void*)
+{
+    UpdateJob(true);
+}
+
+static void JobTimerCallback(evutil_socket_t, short, void*)
+{
+    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast)
+        UpdateJob(false);
+}
+
+static bool ParseHexUint32(const UniValue& value, uint32_t& n)
+{
+    if (!value.isStr() || value.get_str().size() != 8 || !IsHex(value.get_str()))
+        return false;
+    n = ReadBE32(ParseHex(value.get_str()).data());
+    return true;
+}
+
+static UniValue HandleSubmit(StratumClient& client, const UniValue& id, const UniValue& params)
+{
+    if (!client.fSubscribed)
+        return StratumReply(id, NullUniValue, STRATUM_ERROR_NOT_SUBSCRIBED, "Not subscribed");
+    if (!client.fAuthorized)
+        return StratumReply(id, NullUniValue, STRATUM_ERROR_UNAUTHORIZED, "Unauthorized worker");
+    if (params.size() < 5 || !params[1].isStr() || !params[2].isStr())
+        return StratumReply(id, NullUniValue, STRATUM_ERROR_OTHER, "Invalid parameters");
+
+    auto itJob = mapJobs.find(params[1].get_str());
+    if (itJob == mapJobs.end())
+        return StratumReply(id, NullUniValue, STRATUM_ERROR_JOB_NOT_FOUND, "Job not found");
+    StratumJob& job = *itJob->second;
+
+    uint32_t nTime, nNonce;
+    std::vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+    if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE || !IsHex(params[2].get_str()) ||
+            !ParseHexUint32(params[3], nTime) || !ParseHexUint32(params[4], nNonce))
+        return StratumReply(id, NullUniValue, STRATUM_ERROR_OTHER, "Invalid parameters");
+    if (nTime < job.block.nTime || nTime > GetAdjustedTime() + MAX_FUTURE_BLOCK_TIME)
+        return StratumReply(id, NullUniValue, STRATUM_ERROR_OTHER, "Time out of range");
+
+    CTransactionRef coinbase = job.GetCoinbase(client.vchExtraNonce1, vchExtraNonce2);
+    CBlockHeader header = job.GetHeader(*coinbase, nTime, nNonce);
+    uint256 hash = header.GetHash();
+    if (!job.setShares.insert(hash).second)
+        return StratumReply(id, NullUniValue, STRATUM_ERROR_DUPLICATE, "Duplicate share");
+
+    arith_uint256 hashPoW = UintToArith256(header.GetPoWHash());
+    arith_uint256 targetBlock;
+    targetBlock.SetCompact(header.nBits);
+    if (hashPoW <= targetBlock) {
+        std::shared_ptr<const CBlock> pblock = std::make_shared<const CBlock>(job.GetBlock(coinbase, nTime, nNonce));
+        bool fNewBlock = false;
+        bool fAccepted = ProcessNewBlock(Params(), pblock, true, &fNewBlock);
+        LogPrintf("stratum: block %s found by %s was %s\n", hash.ToString(), client.strAddr, fAccepted && fNewBlock ? "accepted" : "rejected");
+        if (!fAccepted)
+            return StratumReply(id, NullUniValue, STRATUM_ERROR_OTHER, "Block rejected");
+        return StratumReply(id, true);
+    }
+    if (hashPoW > GetStratumShareTarget(dShareDifficulty))
+        return StratumReply(id, NullUniValue, STRATUM_ERROR_LOW_DIFFICULTY, "Low difficulty share");
+    return StratumReply(id, true);
+}
+
+/** Handle one request; returns false if the miner should be disconnected */
+static bool HandleRequest(struct bufferevent* bev, const std::string& strLine)
+{
+    UniValue request;
+    if (!request.read(strLine) || !request.isObject())
+        return false;
+    const UniValue& id = find_value(request, "id");
+    const UniValue& method = find_value(request, "method");
+    const UniValue& params = find_value(request, "params");
+    if (!method.isStr())
+        return false;
+    const std::string& strMethod = method.get_str();
+    StratumClient& client = mapClients[bev];
+    LogPrint(BCLog::STRATUM, "stratum: %s from %s\n", strMethod, client.strAddr);
+
+    if (strMethod == "mining.subscribe") {
+        UniValue subscription(UniValue::VARR);
+        subscription.push_back("mining.notify");
+        subscription.push_back(HexStr(client.vchExtraNonce1));
+        UniValue subscriptions(UniValue::VARR);
+        subscriptions.push_back(subscription);
+        UniValue result(UniValue::VARR);
+        result.push_back(subscriptions);
+        result.push_back(HexStr(client.vchExtraNonce1));
+        result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+        Send(bev, JSONLine(StratumReply(id, result)));
+        if (mapClients.count(bev) == 0)
+            return true;
+        client.fSubscribed = true;
+        SendDifficulty(bev);
+        if (!dequeJobIds.empty() && mapClients.count(bev)) {
+            const UniValue notify = mapJobs[dequeJobIds.back()]->GetNotifyParams();
+            // A fresh miner has no earlier work, so the job is always clean
+            UniValue paramsNotify(UniValue::VARR);
+            for (size_t i = 0; i + 1 < notify.size(); i++) {
+                paramsNotify.push_back(notify[i]);
+            }
+            paramsNotify.push_back(true);
+            Send(bev, JSONLine(StratumNotification("mining.notify", paramsNotify)));
+        }
+    } else if (strMethod == "mining.authorize") {
+        // Anyone who can connect may mine to -stratumaddress
+        client.fAuthorized = true;
+        Send(bev, JSONLine(StratumReply(id, true)));
+    } else if (strMethod == "mining.submit") {
+        Send(bev, JSONLine(HandleSubmit(client, id, params.isArray() ? params : UniValue(UniValue::VARR))));
+    } else {
+        Send(bev, JSONLine(StratumReply(id, NullUniValue, STRATUM_ERROR_OTHER, "Method not found")));
+    }
+    return true;
+}
+
+static void ReadCallback(struct bufferevent* bev, void*)
+{
+    struct evbuffer* input = bufferevent_get_input(bev);
+    while (mapClients.count(bev)) {
+        size_t nLength;
+        char* line = evbuffer_readln(input, &nLength, EVBUFFER_EOL_CRLF);
+        if (!line) {
+            if (evbuffer_get_length(input) > MAX_STRATUM_LINE_LENGTH)
+                Disconnect(bev);
+            return;
+        }
+        std::string strLine(line, nLength);
+        free(line);
+        if (strLine.empty())
+            continue;
+        if (strLine.size() > MAX_STRATUM_LINE_LENGTH || !HandleRequest(bev, strLine)) {
+            if (mapClients.count(bev))
+                Disconnect(bev);
+            return;
+        }
+    }
+}
+
+static void EventCallback(struct bufferevent* bev, short events, void*)
+{
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        Disconnect(bev);
+}
+
+static void AcceptCallback(struct evconnlistener*, evutil_socket_t fd, struct sockaddr* addr, int, void*)
+{
+    struct bufferevent* bev = bufferevent_socket_new(eventBase, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return;
+    }
+    CService service;
+    service.SetSockAddr(addr);
+    StratumClient& client = mapClients[bev];
+    client.strAddr = service.ToString();
+    client.vchExtraNonce1.resize(STRATUM_EXTRANONCE1_SIZE);
+    WriteBE32(client.vchExtraNonce1.data(), nNextExtraNonce1++);
+    LogPrint(BCLog::STRATUM, "stratum: new connection from %s\n", client.strAddr);
+
+    bufferevent_setcb(bev, ReadCallback, nullptr, EventCallback, nullptr);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+static void ThreadStratum()
+{
+    RenameThread("bitcoin-stratum");
+    LogPrint(BCLog::STRATUM, "Entering stratum event loop\n");
+    event_base_dispatch(eventBase);
+    LogPrint(BCLog::STRATUM, "Exited stratum event loop\n");
+}
+
+bool InitStratumServer()
+{
+    if (!gArgs.GetBoolArg("-stratum", DEFAULT_STRATUM))
+        return true;
+
+    CBitcoinAddress address(gArgs.GetArg("-stratumaddress", ""));
+    if (!address.IsValid())
+        return InitError(_("-stratum requires a valid -stratumaddress to pay block rewards to"));
+    scriptPayout = GetScriptForDestination(address.Get());
+
+    if (gArgs.IsArgSet("-stratumdifficulty") &&
+            (!ParseDouble(gArgs.GetArg("-stratumdifficulty", ""), &dShareDifficulty) || dShareDifficulty <= 0))
+        return InitError(strprintf(_("Invalid -stratumdifficulty: '%s'"), gArgs.GetArg("-stratumdifficulty", "")));
+    int64_t nJobInterval = gArgs.GetArg("-stratumjobinterval", DEFAULT_STRATUM_JOB_INTERVAL);
+    if (nJobInterval <= 0)
+        return InitError(_("-stratumjobinterval must be positive"));
+
+#ifdef WIN32
+    evthread_use_windows_threads();
+#else
+    evthread_use_pthreads();
+#endif
+    eventBase = event_base_new();
+    if (!eventBase)
+        return InitError(_("Unable to create the stratum event loop"));
+
+    int nPort = gArgs.GetArg("-stratumport", DEFAULT_STRATUM_PORT);
+    std::vector<std::string> vBind = gArgs.GetArgs("-stratumbind");
+    if (vBind.empty()) {
+        vBind.push_back("127.0.0.1");
+        vBind.push_back("::1");
+    }
+    for (const std::string& strBind : vBind) {
+        int port = nPort;
+        std::string host;
+        SplitHostPort(strBind, port, host);
+        CService addrBind = LookupNumeric(host.c_str(), port);
+        struct sockaddr_storage sockaddr;
+        socklen_t len = sizeof(sockaddr);
+        struct evconnlistener* listener = nullptr;
+        if (addrBind.IsValid() && addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len)) {
+            listener = evconnlistener_new_bind(eventBase, AcceptCallback, nullptr, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, (struct sockaddr*)&sockaddr, len);
+        }
+        if (listener) {
+            LogPrintf("Stratum server listening on %s\n", addrBind.ToString());
+            vListeners.push_back(listener);
+        } else {
+            LogPrintf("Binding stratum server on %s failed\n", strBind);
+        }
+    }
+    if (vListeners.empty())
+        return InitError(_("Unable to bind any endpoint for the stratum server"));
+
+    eventNewTip = event_new(eventBase, -1, 0, NewTipCallback, nullptr);
+    eventJobTimer = event_new(eventBase, -1, EV_PERSIST, JobTimerCallback, nullptr);
+    struct timeval tv = {nJobInterval, 0};
+    evtimer_add(eventJobTimer, &tv);
+    return true;
+}
+
+bool StartStratumServer()
+{
+    if (!eventBase)
+        return true;
+    notifier.reset(new StratumNotifier());
+    RegisterValidationInterface(notifier.get());
+    // Have the first job ready for the first miner
+    event_active(eventNewTip, 0, 0);
+    threadStratum = std::thread(ThreadStratum);
+    return true;
+}
+
+void InterruptStratumServer()
+{
+    for (struct evconnlistener* listener : vListeners) {
+        evconnlistener_disable(listener);
+    }
+}
+
+void StopStratumServer()
+{
+    if (notifier) {
+        UnregisterValidationInterface(notifier.get());
+        notifier.reset();
+    }
+    if (eventBase) {
+        event_base_loopbreak(eventBase);
+        if (threadStratum.joinable())
+            threadStratum.join();
+    }
+    for (auto& client : mapClients) {
+        bufferevent_free(client.first);
+    }
+    mapClients.clear();
+    mapJobs.clear();
+    dequeJobIds.clear();
+    for (struct evconnlistener* listener : vListeners) {
+        evconnlistener_free(listener);
+    }
+    vListeners.clear();
+    if (eventNewTip) {
+        event_free(eventNewTip);
+        eventNewTip = nullptr;
+    }
+    if (eventJobTimer) {
+        event_free(eventJobTimer);
+        eventJobTimer = nullptr;
+    }
+    if (eventBase) {
+        event_base_free(eventBase);
+        eventBase = nullptr;
+    }
+}
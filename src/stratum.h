@@ -0,0 +1,80 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include "arith_uint256.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <univalue.h>
+
+struct CBlockTemplate;
+
+/** Default for -stratum */
+static const bool DEFAULT_STRATUM = false;
+/** Default for -stratumport */
+static const unsigned short DEFAULT_STRATUM_PORT = 3333;
+/** Default for -stratumdifficulty */
+static const double DEFAULT_STRATUM_DIFFICULTY = 1.0;
+/** Default for -stratumjobinterval, the minimum time in seconds between jobs for a changed mempool */
+static const int64_t DEFAULT_STRATUM_JOB_INTERVAL = 30;
+/** Size of the per-connection extranonce assigned by the server */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+/** Size of the extranonce rolled by miners */
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+/** Maximum length of a stratum request line */
+static const size_t MAX_STRATUM_LINE_LENGTH = 16 * 1024;
+
+/**
+ * A stratum mining job: a block template with its coinbase split around the
+ * extranonces, and the merkle branch that commits the coinbase to the block.
+ */
+class StratumJob
+{
+public:
+    StratumJob(const std::string& strIdIn, const CBlockTemplate& blocktemplate, const CScript& scriptPubKeyIn, int nHeight, bool fCleanIn);
+
+    const std::string strId;
+    const bool fClean;
+    //! The template, with the coinbase paying to scriptPubKeyIn
+    CBlock block;
+    //! The non-witness serialization of the coinbase before and after the extranonces
+    std::vector<unsigned char> vchCoinbase1;
+    std::vector<unsigned char> vchCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+    //! Headers of the shares already submitted for this job
+    std::set<uint256> setShares;
+
+    /** Parameters of the mining.notify message for this job */
+    UniValue GetNotifyParams() const;
+
+    /** Assemble the coinbase a miner worked on from its extranonces */
+    CTransactionRef GetCoinbase(const std::vector<unsigned char>& vchExtraNonce1, const std::vector<unsigned char>& vchExtraNonce2) const;
+    /** Header of a share */
+    CBlockHeader GetHeader(const CTransaction& coinbase, uint32_t nTime, uint32_t nNonce) const;
+    /** Full block of a share */
+    CBlock GetBlock(const CTransactionRef& coinbase, uint32_t nTime, uint32_t nNonce) const;
+};
+
+/** Target a share of the given stratum difficulty must meet. Difficulty 1
+ *  corresponds to 2^16 scrypt hashes, as used by scrypt mining software. */
+arith_uint256 GetStratumShareTarget(double dDifficulty);
+
+/** Bind the stratum server, if enabled with -stratum */
+bool InitStratumServer();
+/** Start the stratum event loop and send jobs for the current tip */
+bool StartStratumServer();
+/** Stop accepting connections and sending jobs */
+void InterruptStratumServer();
+/** Disconnect all miners and stop the event loop */
+void StopStratumServer();
+
+#endif // BITCOIN_STRATUM_H
@@ -7,10 +7,34 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <stdio.h>
 
 #include <boost/thread.hpp>
 
+static std::atomic<void*> g_timed_lock(nullptr);
+static thread_local int64_t g_thread_lock_wait_time = 0;
+
+void SetTimedLock(void* cs)
+{
+    g_timed_lock = cs;
+}
+
+bool IsTimedLock(void* cs)
+{
+    return cs == g_timed_lock.load(std::memory_order_relaxed);
+}
+
+void AddThreadLockWaitTime(int64_t nMicros)
+{
+    g_thread_lock_wait_time += nMicros;
+}
+
+int64_t GetThreadLockWaitTime()
+{
+    return g_thread_lock_wait_time;
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
@@ -7,6 +7,7 @@
 #define BITCOIN_SYNC_H
 
 #include "threadsafety.h"
+#include "utiltime.h"
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
@@ -106,6 +107,17 @@ typedef boost::condition_variable CConditionVariable;
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/**
+ * Contention timing for one lock (normally cs_main): the time threads spend
+ * blocked acquiring it is added up per thread, see GetThreadLockWaitTime().
+ * Uncontended acquisitions are not timed.
+ */
+void SetTimedLock(void* cs);
+bool IsTimedLock(void* cs);
+void AddThreadLockWaitTime(int64_t nMicros);
+/** Total time (in microseconds) the calling thread spent blocked on the timed lock */
+int64_t GetThreadLockWaitTime();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class SCOPED_LOCKABLE CMutexLock
@@ -116,14 +128,18 @@ private:
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
-#ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock()) {
+#ifdef DEBUG_LOCKCONTENTION
             PrintLockContention(pszName, pszFile, nLine);
 #endif
-            lock.lock();
-#ifdef DEBUG_LOCKCONTENTION
+            if (IsTimedLock((void*)(lock.mutex()))) {
+                int64_t nStart = GetTimeMicros();
+                lock.lock();
+                AddThreadLockWaitTime(GetTimeMicros() - nStart);
+            } else {
+                lock.lock();
+            }
         }
-#endif
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
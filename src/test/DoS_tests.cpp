@@ -11,6 +11,7 @@
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "txorphanage.h"
 #include "util.h"
 #include "validation.h"
 
@@ -20,17 +21,6 @@
 
 #include <boost/test/unit_test.hpp>
 
-// Tests these internal-to-net_processing.cpp methods:
-extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -264,14 +254,26 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     peerLogic->FinalizeNode(dummyNode.GetId(), dummy);
 }
 
-CTransactionRef RandomOrphan()
+class TxOrphanageTest : public TxOrphanage
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(InsecureRand256());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
-}
+public:
+    CTransactionRef RandomOrphan()
+    {
+        LOCK(cs);
+        std::map<uint256, OrphanTx>::iterator it;
+        it = mapOrphanTransactions.lower_bound(InsecureRand256());
+        if (it == mapOrphanTransactions.end())
+            it = mapOrphanTransactions.begin();
+        return it->second.tx;
+    }
+
+    size_t PeerCount(NodeId peer)
+    {
+        LOCK(cs);
+        auto it = mapOrphansByPeer.find(peer);
+        return it == mapOrphansByPeer.end() ? 0 : it->second.size();
+    }
+};
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 {
@@ -280,6 +282,8 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    TxOrphanageTest orphanage;
+
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
@@ -292,13 +296,13 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        orphanage.AddTx(MakeTransactionRef(tx), i);
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = orphanage.RandomOrphan();
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -309,13 +313,13 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, *txPrev, tx, 0, SIGHASH_ALL);
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        orphanage.AddTx(MakeTransactionRef(tx), i);
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = orphanage.RandomOrphan();
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -333,24 +337,62 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
+        BOOST_CHECK(!orphanage.AddTx(MakeTransactionRef(tx), i));
+    }
+
+    // Test the orphan work set:
+    {
+        CTransactionRef txParent = orphanage.RandomOrphan();
+        std::set<uint256> setOrphanWorkSet;
+        orphanage.AddChildrenToWorkSet(*txParent, setOrphanWorkSet);
+        for (const uint256& hash : setOrphanWorkSet) {
+            CTransactionRef txChild;
+            NodeId fromPeer;
+            BOOST_CHECK(orphanage.GetTx(hash, txChild, fromPeer));
+            BOOST_CHECK(txChild->vin[0].prevout.hash == txParent->GetHash());
+        }
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphanage.Size();
+        orphanage.EraseForPeer(i);
+        BOOST_CHECK(orphanage.Size() < sizeBefore);
+        BOOST_CHECK_EQUAL(orphanage.PeerCount(i), 0);
     }
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
+    // Test LimitOrphansForPeer:
+    for (int i = 0; i < 3; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = 0;
+        tx.vin[0].prevout.hash = InsecureRand256();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        BOOST_CHECK(orphanage.AddTx(MakeTransactionRef(tx), 100));
+    }
+    size_t sizeBefore = orphanage.Size();
+    BOOST_CHECK_EQUAL(orphanage.PeerCount(100), 3);
+    BOOST_CHECK_EQUAL(orphanage.LimitOrphansForPeer(100, 1), 2);
+    BOOST_CHECK_EQUAL(orphanage.PeerCount(100), 1);
+    BOOST_CHECK_EQUAL(orphanage.LimitOrphansForPeer(100, 0), 1);
+    BOOST_CHECK_EQUAL(orphanage.PeerCount(100), 0);
+    BOOST_CHECK_EQUAL(orphanage.Size(), sizeBefore - 3);
+
+    // Test LimitOrphans() function:
+    orphanage.LimitOrphans(40, std::numeric_limits<size_t>::max());
+    BOOST_CHECK(orphanage.Size() <= 40);
+    orphanage.LimitOrphans(10, std::numeric_limits<size_t>::max());
+    BOOST_CHECK(orphanage.Size() <= 10);
+    size_t nHalfUsage = orphanage.TotalSize() / 2;
+    orphanage.LimitOrphans(10, nHalfUsage);
+    BOOST_CHECK(orphanage.Size() < 10);
+    BOOST_CHECK(orphanage.TotalSize() <= nHalfUsage);
+    orphanage.LimitOrphans(0, std::numeric_limits<size_t>::max());
+    BOOST_CHECK_EQUAL(orphanage.Size(), 0);
+    BOOST_CHECK_EQUAL(orphanage.TotalSize(), 0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -314,6 +314,44 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(LargeMempoolRoundTripTest)
+{
+    // Large enough that short IDs are matched in several chunks
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+    block.vtx.resize(1);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+    for (size_t i = 0; i < 3 * SHORTTXIDS_PARALLEL_CHUNK; i++) {
+        tx.vin[0].prevout.hash = InsecureRand256();
+        CTransactionRef txref = MakeTransactionRef(tx);
+        pool.addUnchecked(txref->GetHash(), entry.FromTx(*txref));
+        if (i % 1000 == 999)
+            block.vtx.push_back(txref);
+    }
+    bool mutated;
+    block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
+    assert(!mutated);
+    while (!CheckProofOfWork(block.GetPoWHash(), block.nBits, Params().GetConsensus())) ++block.nNonce;
+
+    CBlockHeaderAndShortTxIDs shortIDs(block, true);
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, extra_txn) == READ_STATUS_OK);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock block2;
+    std::vector<CTransactionRef> vtx_missing;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.hashMerkleRoot.ToString(), BlockMerkleRoot(block2, &mutated).ToString());
+    BOOST_CHECK(!mutated);
+}
+
 BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
     BlockTransactionsRequest req1;
     req1.blockhash = InsecureRand256();
@@ -0,0 +1,162 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "blockfilterindex.h"
+
+#include "chainparams.h"
+#include "coins.h"
+#include "random.h"
+#include "script/standard.h"
+#include "undo.h"
+#include "utiltime.h"
+#include "validation.h"
+#include "test/test_bitcoin.h"
+
+#include <ios>
+#include <limits>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilter_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test)
+{
+    GCSFilter::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++) {
+        const uint256 hashIncluded = GetRandHash(), hashExcluded = GetRandHash();
+        included.emplace(hashIncluded.begin(), hashIncluded.end());
+        excluded.emplace(hashExcluded.begin(), hashExcluded.end());
+    }
+
+    const GCSFilter::Params params(GetRand(std::numeric_limits<uint64_t>::max()), GetRand(std::numeric_limits<uint64_t>::max()), BASIC_FILTER_P, BASIC_FILTER_M);
+    const GCSFilter filter(params, included);
+    BOOST_CHECK_EQUAL(filter.GetN(), included.size());
+    for (const GCSFilter::Element& element : included) {
+        BOOST_CHECK(filter.Match(element));
+        GCSFilter::ElementSet query = excluded;
+        query.insert(element);
+        BOOST_CHECK(filter.MatchAny(query));
+    }
+    // False positives are possible, but at a rate of 1 in BASIC_FILTER_M
+    BOOST_CHECK(!filter.MatchAny(excluded));
+    BOOST_CHECK(!filter.MatchAny(GCSFilter::ElementSet()));
+
+    // The encoding round trips
+    const GCSFilter decoded(params, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), filter.GetN());
+    BOOST_CHECK(decoded.GetEncoded() == filter.GetEncoded());
+    for (const GCSFilter::Element& element : included) {
+        BOOST_CHECK(decoded.Match(element));
+    }
+
+    // A truncated encoding is rejected
+    std::vector<unsigned char> vchTruncated = filter.GetEncoded();
+    vchTruncated.resize(vchTruncated.size() / 2);
+    BOOST_CHECK_THROW(GCSFilter(params, vchTruncated), std::ios_base::failure);
+    BOOST_CHECK_THROW(GCSFilter(params, std::vector<unsigned char>()), std::ios_base::failure);
+
+    // The empty filter matches nothing
+    const GCSFilter empty(params);
+    BOOST_CHECK_EQUAL(empty.GetN(), 0);
+    BOOST_CHECK(empty.GetEncoded() == std::vector<unsigned char>(1, 0));
+    BOOST_CHECK(!empty.MatchAny(included));
+    BOOST_CHECK(GCSFilter(params, GCSFilter::ElementSet()).GetEncoded() == empty.GetEncoded());
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
+{
+    const CScript scriptIncluded1 = CScript() << OP_1 << std::vector<unsigned char>(32, 1);
+    const CScript scriptIncluded2 = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 2) << OP_EQUALVERIFY << OP_CHECKSIG;
+    const CScript scriptSpent = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 3) << OP_EQUAL;
+    const CScript scriptOpReturn = CScript() << OP_RETURN << std::vector<unsigned char>(4, 4);
+    const CScript scriptExcluded = CScript() << OP_2 << std::vector<unsigned char>(32, 5);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.emplace_back(100, scriptIncluded1);
+    tx.vout.emplace_back(200, scriptIncluded2);
+    tx.vout.emplace_back(0, scriptOpReturn);
+    tx.vout.emplace_back(0, CScript());
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(tx));
+
+    CBlockUndo blockUndo;
+    blockUndo.vtxundo.emplace_back();
+    blockUndo.vtxundo.back().vprevout.emplace_back(CTxOut(300, scriptSpent), 1, false);
+
+    const BlockFilter blockFilter(BLOCK_FILTER_BASIC, block, blockUndo);
+    const GCSFilter& filter = blockFilter.GetFilter();
+    BOOST_CHECK_EQUAL(filter.GetN(), 3);
+    for (const CScript& script : {scriptIncluded1, scriptIncluded2, scriptSpent}) {
+        BOOST_CHECK(filter.Match(GCSFilter::Element(script.begin(), script.end())));
+    }
+    for (const CScript& script : {scriptOpReturn, scriptExcluded}) {
+        BOOST_CHECK(!filter.Match(GCSFilter::Element(script.begin(), script.end())));
+    }
+
+    // The filter is keyed by the block hash
+    GCSFilter::Params params;
+    BOOST_CHECK(BlockFilter::BuildParams(BLOCK_FILTER_BASIC, block.GetHash(), params));
+    BOOST_CHECK(GCSFilter(params, BlockFilter::BasicFilterElements(block, blockUndo)).GetEncoded() == blockFilter.GetEncodedFilter());
+
+    // It is reconstructed from its encoding, and headers chain
+    const BlockFilter decoded(BLOCK_FILTER_BASIC, block.GetHash(), blockFilter.GetEncodedFilter());
+    BOOST_CHECK(decoded.GetHash() == blockFilter.GetHash());
+    BOOST_CHECK(decoded.GetFilter().Match(GCSFilter::Element(scriptSpent.begin(), scriptSpent.end())));
+    const uint256 hashHeader = blockFilter.ComputeHeader(uint256());
+    BOOST_CHECK(hashHeader != blockFilter.GetHash());
+    BOOST_CHECK(blockFilter.ComputeHeader(hashHeader) != hashHeader);
+}
+
+BOOST_FIXTURE_TEST_CASE(blockfilterindex_test, TestChain100Setup)
+{
+    CBlockFilterIndex index(1 << 20, true);
+    index.Start();
+    const int64_t nStart = GetTimeMillis();
+    while (!index.IsSynced()) {
+        BOOST_REQUIRE(GetTimeMillis() < nStart + 60 * 1000);
+        MilliSleep(10);
+    }
+
+    // Blocks connected after the initial sync are indexed as well
+    const CScript scriptPubKey = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    CreateAndProcessBlock({}, scriptPubKey);
+    BOOST_CHECK(index.IsSynced());
+
+    LOCK(cs_main);
+    uint256 hashPrevHeader;
+    for (const CBlockIndex* pindex = chainActive.Genesis(); pindex; pindex = chainActive.Next(pindex)) {
+        CBlock block;
+        BOOST_REQUIRE(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+        CBlockUndo blockUndo;
+        if (pindex->pprev)
+            BOOST_REQUIRE(UndoReadFromDisk(blockUndo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash()));
+        const BlockFilter expected(BLOCK_FILTER_BASIC, block, blockUndo);
+
+        BlockFilter filter;
+        BOOST_REQUIRE(index.LookupFilter(pindex, filter));
+        BOOST_CHECK(filter.GetEncodedFilter() == expected.GetEncodedFilter());
+        uint256 hashHeader;
+        BOOST_REQUIRE(index.LookupFilterHeader(pindex, hashHeader));
+        BOOST_CHECK(hashHeader == expected.ComputeHeader(hashPrevHeader));
+        hashPrevHeader = hashHeader;
+
+        const CScript& scriptCoinbase = block.vtx[0]->vout[0].scriptPubKey;
+        BOOST_CHECK(filter.GetFilter().Match(GCSFilter::Element(scriptCoinbase.begin(), scriptCoinbase.end())));
+    }
+
+    // Blocks not in the index are not found
+    CBlockIndex indexUnknown;
+    const uint256 hashUnknown = GetRandHash();
+    indexUnknown.phashBlock = &hashUnknown;
+    BlockFilter filter;
+    BOOST_CHECK(!index.LookupFilter(&indexUnknown, filter));
+
+    index.Interrupt();
+    index.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -543,7 +543,8 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
         pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() / 2); // should maximize mempool size by only removing 5/7
+    // mapNextTx's bucket array does not shrink, so keep some room over half
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 5); // should maximize mempool size by only removing 5/7
     BOOST_CHECK(pool.exists(tx4.GetHash()));
     BOOST_CHECK(!pool.exists(tx5.GetHash()));
     BOOST_CHECK(pool.exists(tx6.GetHash()));
@@ -581,4 +582,197 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+static CMutableTransaction ClusterTx(const std::vector<COutPoint>& vPrevouts, int nOutputs)
+{
+    CMutableTransaction tx;
+    for (const COutPoint& prevout : vPrevouts) {
+        tx.vin.emplace_back(prevout.IsNull() ? COutPoint(InsecureRand256(), 0) : prevout);
+    }
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout.emplace_back(COIN, CScript() << OP_TRUE);
+    }
+    return tx;
+}
+
+static void AddClusterTx(CTxMemPool& pool, const CMutableTransaction& tx, CAmount nFee)
+{
+    TestMemPoolEntryHelper entry;
+    pool.addUnchecked(tx.GetHash(), entry.Fee(nFee).FromTx(tx));
+}
+
+// Every transaction is in one cluster, after its parents, and chunk feerates do not increase
+static void CheckClusters(CTxMemPool& pool)
+{
+    LOCK(pool.cs);
+    size_t nTxs = 0;
+    for (const auto& item : pool.mapClusters) {
+        const CTxMemPool::TxCluster& cluster = item.second;
+        std::set<uint256> setSeen;
+        for (CTxMemPool::txiter it : cluster.vTxs) {
+            for (CTxMemPool::txiter parentIt : pool.GetMemPoolParents(it)) {
+                BOOST_CHECK(setSeen.count(parentIt->GetTx().GetHash()));
+            }
+            setSeen.insert(it->GetTx().GetHash());
+        }
+        for (size_t i = 1; i < cluster.vChunks.size(); i++) {
+            BOOST_CHECK(CFeeRate(cluster.vChunks[i - 1].nFee, cluster.vChunks[i - 1].nSize) >= CFeeRate(cluster.vChunks[i].nFee, cluster.vChunks[i].nSize));
+        }
+        BOOST_CHECK_EQUAL(cluster.vChunks.back().nEnd, cluster.vTxs.size());
+        nTxs += cluster.vTxs.size();
+    }
+    BOOST_CHECK_EQUAL(nTxs, pool.mapTx.size());
+}
+
+static CFeeRate ChunkFeeRate(CTxMemPool& pool, const CMutableTransaction& tx)
+{
+    LOCK(pool.cs);
+    return pool.GetChunkFeeRate(pool.mapTx.find(tx.GetHash()));
+}
+
+static bool SortedByHash(const CTxMemPool::vecEntries& v)
+{
+    for (size_t i = 1; i < v.size(); i++) {
+        if (!(v[i - 1]->GetTx().GetHash() < v[i]->GetTx().GetHash())) return false;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolLinksTest)
+{
+    CTxMemPool pool;
+    const COutPoint nullOut;
+
+    // A parent with four children, two of which have a common child
+    CMutableTransaction parent = ClusterTx({nullOut}, 4);
+    AddClusterTx(pool, parent, 1000);
+    std::vector<CMutableTransaction> vChildren;
+    for (uint32_t i = 0; i < 4; i++) {
+        vChildren.push_back(ClusterTx({COutPoint(parent.GetHash(), i)}, 1));
+        AddClusterTx(pool, vChildren.back(), 1000);
+    }
+    CMutableTransaction grandchild = ClusterTx({COutPoint(vChildren[0].GetHash(), 0), COutPoint(vChildren[1].GetHash(), 0)}, 1);
+    AddClusterTx(pool, grandchild, 1000);
+
+    LOCK(pool.cs);
+    BOOST_CHECK_EQUAL(pool.mapNextTx.size(), 7U);
+    for (uint32_t i = 0; i < 4; i++) {
+        auto it = pool.mapNextTx.find(COutPoint(parent.GetHash(), i));
+        BOOST_CHECK(it != pool.mapNextTx.end() && it->second->GetHash() == vChildren[i].GetHash());
+    }
+    CTxMemPool::txiter parentIt = pool.mapTx.find(parent.GetHash());
+    CTxMemPool::txiter grandchildIt = pool.mapTx.find(grandchild.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(parentIt).size(), 4U);
+    BOOST_CHECK(SortedByHash(pool.GetMemPoolChildren(parentIt)));
+    BOOST_CHECK(pool.GetMemPoolParents(parentIt).empty());
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(grandchildIt).size(), 2U);
+    BOOST_CHECK(SortedByHash(pool.GetMemPoolParents(grandchildIt)));
+
+    // Removing a child takes the grandchild along and unlinks both
+    size_t nUsage = pool.DynamicMemoryUsage();
+    pool.removeRecursive(vChildren[0]);
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+    BOOST_CHECK_EQUAL(pool.mapNextTx.size(), 4U);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(parentIt).size(), 3U);
+    BOOST_CHECK(SortedByHash(pool.GetMemPoolChildren(parentIt)));
+    BOOST_CHECK(pool.GetMemPoolChildren(pool.mapTx.find(vChildren[1].GetHash())).empty());
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    CTxMemPool pool;
+    pool.SetClusterTracking(true);
+    const COutPoint nullOut;
+
+    // A child pays for its parent: both form one chunk
+    CMutableTransaction txParent = ClusterTx({nullOut}, 2);
+    CMutableTransaction txChild = ClusterTx({COutPoint(txParent.GetHash(), 0)}, 1);
+    AddClusterTx(pool, txParent, 1000);
+    AddClusterTx(pool, txChild, 30000);
+    BOOST_CHECK_EQUAL(pool.mapClusters.size(), 1U);
+    CFeeRate chunkFeeRate(31000, GetVirtualTransactionSize(txParent) + GetVirtualTransactionSize(txChild));
+    BOOST_CHECK(ChunkFeeRate(pool, txParent) == chunkFeeRate);
+    BOOST_CHECK(ChunkFeeRate(pool, txChild) == chunkFeeRate);
+
+    // A transaction spending from two clusters merges them
+    CMutableTransaction txOther = ClusterTx({nullOut}, 1);
+    AddClusterTx(pool, txOther, 5000);
+    BOOST_CHECK_EQUAL(pool.mapClusters.size(), 2U);
+    CMutableTransaction txMerge = ClusterTx({COutPoint(txChild.GetHash(), 0), COutPoint(txOther.GetHash(), 0)}, 1);
+    AddClusterTx(pool, txMerge, 2000);
+    BOOST_CHECK_EQUAL(pool.mapClusters.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.mapClusters.begin()->second.vTxs.size(), 4U);
+    {
+        LOCK(pool.cs);
+        BOOST_CHECK_EQUAL(pool.CalculateClusterCount({pool.mapTx.find(txMerge.GetHash())}), 5U);
+    }
+    CheckClusters(pool);
+
+    // Removing it splits them again
+    pool.removeRecursive(txMerge);
+    BOOST_CHECK_EQUAL(pool.mapClusters.size(), 2U);
+    BOOST_CHECK(ChunkFeeRate(pool, txParent) == chunkFeeRate);
+    CheckClusters(pool);
+
+    // Confirming the parent leaves the child on its own
+    pool.removeForBlock({MakeTransactionRef(txParent)}, 1);
+    BOOST_CHECK_EQUAL(pool.mapClusters.size(), 2U);
+    BOOST_CHECK(ChunkFeeRate(pool, txChild) == CFeeRate(30000, GetVirtualTransactionSize(txChild)));
+    CheckClusters(pool);
+    pool.clear();
+    BOOST_CHECK(pool.mapClusters.empty());
+
+    // A wide fan-out with children of varying fees
+    CMutableTransaction txFan = ClusterTx({nullOut}, 20);
+    AddClusterTx(pool, txFan, 1000);
+    std::vector<CMutableTransaction> vFanChildren;
+    for (int i = 0; i < 20; i++) {
+        vFanChildren.push_back(ClusterTx({COutPoint(txFan.GetHash(), i)}, 1));
+        AddClusterTx(pool, vFanChildren.back(), (i % 4) * 3000 + 100);
+    }
+    BOOST_CHECK_EQUAL(pool.mapClusters.size(), 1U);
+    CheckClusters(pool);
+    // The parent is linearized first, and the cheapest children last
+    const CTxMemPool::TxCluster& fan = pool.mapClusters.begin()->second;
+    BOOST_CHECK(fan.vTxs.front()->GetTx().GetHash() == txFan.GetHash());
+    BOOST_CHECK_EQUAL(fan.vTxs.back()->GetFee(), 100);
+
+    // Prioritising a low fee child pulls it forward
+    pool.PrioritiseTransaction(vFanChildren[0].GetHash(), 1 * COIN);
+    BOOST_CHECK(pool.mapClusters.begin()->second.vTxs[1]->GetTx().GetHash() == vFanChildren[0].GetHash());
+    CheckClusters(pool);
+    pool.PrioritiseTransaction(vFanChildren[0].GetHash(), -1 * COIN);
+    pool.clear();
+
+    // Size limiting evicts the lowest feerate last chunk: a low fee child
+    // of a high fee parent goes first, then a parent and child that pay
+    // less together than an unrelated transaction
+    CMutableTransaction txHigh = ClusterTx({nullOut}, 1);
+    CMutableTransaction txHighChild = ClusterTx({COutPoint(txHigh.GetHash(), 0)}, 1);
+    CMutableTransaction txLow = ClusterTx({nullOut}, 1);
+    CMutableTransaction txLowChild = ClusterTx({COutPoint(txLow.GetHash(), 0)}, 1);
+    CMutableTransaction txAlone = ClusterTx({nullOut}, 1);
+    AddClusterTx(pool, txHigh, 50000);
+    AddClusterTx(pool, txHighChild, 100);
+    AddClusterTx(pool, txLow, 1000);
+    AddClusterTx(pool, txLowChild, 5000);
+    AddClusterTx(pool, txAlone, 10000);
+    CheckClusters(pool);
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK(!pool.exists(txHighChild.GetHash()));
+    BOOST_CHECK(pool.exists(txLow.GetHash()));
+    BOOST_CHECK(pool.exists(txLowChild.GetHash()));
+    CheckClusters(pool);
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    BOOST_CHECK(!pool.exists(txLowChild.GetHash()));
+    BOOST_CHECK(pool.exists(txAlone.GetHash()));
+    BOOST_CHECK_EQUAL(pool.mapClusters.size(), 2U);
+    CheckClusters(pool);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
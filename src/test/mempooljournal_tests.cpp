@@ -0,0 +1,128 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "mempooljournal.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "validation.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mempooljournal_tests, TestingSetup)
+
+static CMutableTransaction CreateTx(const COutPoint& prevout)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    return tx;
+}
+
+static std::vector<uint256> ReadHashes(const fs::path& path, std::map<uint256, CAmount>& mapDeltas)
+{
+    std::vector<TxMempoolInfo> vinfo;
+    BOOST_CHECK(CMempoolJournal::Read(path, vinfo, mapDeltas));
+    std::vector<uint256> vHashes;
+    for (const TxMempoolInfo& info : vinfo) {
+        vHashes.push_back(info.tx->GetHash());
+    }
+    return vHashes;
+}
+
+BOOST_AUTO_TEST_CASE(journal_replay)
+{
+    const fs::path path = pathTemp / MEMPOOL_JOURNAL_FILENAME;
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction txA = CreateTx(COutPoint(InsecureRand256(), 0));
+    CMutableTransaction txB = CreateTx(COutPoint(txA.GetHash(), 0));
+    CMutableTransaction txC = CreateTx(COutPoint(InsecureRand256(), 0));
+    mempool.addUnchecked(txA.GetHash(), entry.Time(100).FromTx(txA));
+    mempool.addUnchecked(txB.GetHash(), entry.Time(200).FromTx(txB));
+
+    // The snapshot covers what was in the mempool before the journal started
+    CMempoolJournal journal(path);
+    BOOST_CHECK(journal.Start());
+    std::map<uint256, CAmount> mapDeltas;
+    BOOST_CHECK(ReadHashes(path, mapDeltas) == std::vector<uint256>({txA.GetHash(), txB.GetHash()}));
+
+    // Later changes only reach the file when flushed
+    mempool.addUnchecked(txC.GetHash(), entry.FromTx(txC));
+    mempool.removeRecursive(txB);
+    {
+        LOCK(mempool.cs);
+        mempool.PrioritiseTransaction(txC.GetHash(), 500);
+        journal.PrioritiseTransaction(txC.GetHash(), 500);
+    }
+    BOOST_CHECK(ReadHashes(path, mapDeltas).size() == 2);
+    journal.Flush();
+    mapDeltas.clear();
+    BOOST_CHECK(ReadHashes(path, mapDeltas) == std::vector<uint256>({txA.GetHash(), txC.GetHash()}));
+    BOOST_CHECK(mapDeltas.size() == 1 && mapDeltas[txC.GetHash()] == 500);
+
+    // Stopping compacts the journal to a snapshot with the same contents,
+    // keeping the entry times of the snapshot transactions
+    BOOST_CHECK(journal.Stop());
+    std::vector<TxMempoolInfo> vinfo;
+    mapDeltas.clear();
+    BOOST_CHECK(CMempoolJournal::Read(path, vinfo, mapDeltas));
+    std::map<uint256, int64_t> mapTimes;
+    for (const TxMempoolInfo& info : vinfo) {
+        mapTimes[info.tx->GetHash()] = info.nTime;
+    }
+    BOOST_CHECK_EQUAL(vinfo.size(), 2U);
+    BOOST_CHECK_EQUAL(mapTimes.size(), 2U);
+    BOOST_CHECK_EQUAL(mapTimes[txA.GetHash()], 100);
+    BOOST_CHECK(mapTimes.count(txC.GetHash()));
+    BOOST_CHECK(mapDeltas.size() == 1 && mapDeltas[txC.GetHash()] == 500);
+
+    // Changes after stopping are not recorded
+    mempool.removeRecursive(txA);
+    journal.Flush();
+    BOOST_CHECK(ReadHashes(path, mapDeltas).size() == 2);
+
+    mempool.clear();
+    mempool.ClearPrioritisation(txC.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(journal_order_and_truncation)
+{
+    const fs::path path = pathTemp / MEMPOOL_JOURNAL_FILENAME;
+
+    // A parent returned to the mempool by a reorg follows its child
+    CMutableTransaction txParent = CreateTx(COutPoint(InsecureRand256(), 0));
+    CMutableTransaction txChild = CreateTx(COutPoint(txParent.GetHash(), 0));
+    CMutableTransaction txOther = CreateTx(COutPoint(InsecureRand256(), 0));
+    {
+        CAutoFile file(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+        file << MEMPOOL_JOURNAL_VERSION;
+        file << (uint8_t)CMempoolJournal::ADD << txChild << (int64_t)1;
+        file << (uint8_t)CMempoolJournal::REMOVE << txParent.GetHash();
+        file << (uint8_t)CMempoolJournal::ADD << txOther << (int64_t)1;
+        file << (uint8_t)CMempoolJournal::ADD << txParent << (int64_t)2;
+        file << (uint8_t)CMempoolJournal::ADD << txChild << (int64_t)3;
+        // A record cut short by a crash
+        file << (uint8_t)CMempoolJournal::REMOVE;
+        file << (uint8_t)0x12;
+    }
+    std::map<uint256, CAmount> mapDeltas;
+    BOOST_CHECK(ReadHashes(path, mapDeltas) == std::vector<uint256>({txParent.GetHash(), txChild.GetHash(), txOther.GetHash()}));
+
+    // Files from a newer version are not replayed
+    {
+        CAutoFile file(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+        file << (MEMPOOL_JOURNAL_VERSION + 1);
+    }
+    std::vector<TxMempoolInfo> vinfo;
+    BOOST_CHECK(!CMempoolJournal::Read(path, vinfo, mapDeltas));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
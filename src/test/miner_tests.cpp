@@ -12,14 +12,17 @@
 #include "miner.h"
 #include "policy/policy.h"
 #include "pubkey.h"
+#include "script/interpreter.h"
 #include "script/standard.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "versionbits.h"
 
 #include "test/test_bitcoin.h"
 
+#include <limits>
 #include <memory>
 
 #include <boost/test/unit_test.hpp>
@@ -502,4 +505,311 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+// Fill the mempool with random chains and trees of transactions
+static void AddRandomPackages(int nTx)
+{
+    TestMemPoolEntryHelper entry;
+    std::vector<COutPoint> vOutputs;
+    LOCK(mempool.cs);
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        int nInputs = 1 + InsecureRandRange(3);
+        for (int j = 0; j < nInputs; j++) {
+            if (vOutputs.empty() || InsecureRandBool()) {
+                tx.vin.emplace_back(COutPoint(InsecureRand256(), 0));
+            } else {
+                size_t n = InsecureRandRange(vOutputs.size());
+                tx.vin.emplace_back(vOutputs[n]);
+                vOutputs.erase(vOutputs.begin() + n);
+            }
+            tx.vin.back().scriptSig = CScript() << std::vector<unsigned char>(InsecureRandRange(100));
+        }
+        int nOutputs = 1 + InsecureRandRange(2);
+        tx.vout.resize(nOutputs);
+        for (int j = 0; j < nOutputs; j++) {
+            tx.vout[j].nValue = COIN;
+            tx.vout[j].scriptPubKey = CScript() << OP_TRUE;
+        }
+        for (int j = 0; j < nOutputs; j++) {
+            vOutputs.emplace_back(tx.GetHash(), j);
+        }
+        mempool.addUnchecked(tx.GetHash(), entry.Fee(1000 + InsecureRandRange(100000)).SigOpsCost(InsecureRandRange(100)).FromTx(tx));
+    }
+}
+
+static CAmount SelectForTest(const CChainParams& params, bool fHeapSelection, unsigned int nBlockMaxWeight, std::vector<uint256>& vTxHashes)
+{
+    BlockAssembler::Options options;
+    options.nBlockMaxWeight = nBlockMaxWeight;
+    options.blockMinFeeRate = blockMinFeeRate;
+    options.fHeapSelection = fHeapSelection;
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(params, options).SelectTransactions(1, 0, true);
+
+    vTxHashes.clear();
+    std::set<uint256> setSeen;
+    uint64_t nWeight = 4000;
+    for (size_t i = 1; i < pblocktemplate->block.vtx.size(); i++) {
+        const CTransaction& tx = *pblocktemplate->block.vtx[i];
+        // Parents must come first
+        for (const CTxIn& txin : tx.vin) {
+            BOOST_CHECK(!mempool.exists(txin.prevout.hash) || setSeen.count(txin.prevout.hash));
+        }
+        BOOST_CHECK(setSeen.insert(tx.GetHash()).second);
+        vTxHashes.push_back(tx.GetHash());
+        nWeight += GetTransactionWeight(tx);
+    }
+    BOOST_CHECK(nWeight < std::max<unsigned int>(nBlockMaxWeight, 4000));
+    return -pblocktemplate->vTxFees[0];
+}
+
+BOOST_AUTO_TEST_CASE(HeapPackageSelection_test)
+{
+    const CChainParams& chainparams = Params();
+    SeedInsecureRand(true);
+    AddRandomPackages(500);
+
+    // With room for everything, both select the same transactions in the same order
+    std::vector<uint256> vTxAncestor, vTxHeap;
+    CAmount nFeesAncestor = SelectForTest(chainparams, false, MAX_BLOCK_WEIGHT, vTxAncestor);
+    CAmount nFeesHeap = SelectForTest(chainparams, true, MAX_BLOCK_WEIGHT, vTxHeap);
+    BOOST_CHECK_EQUAL(vTxAncestor.size(), mempool.size());
+    BOOST_CHECK(vTxAncestor == vTxHeap);
+    BOOST_CHECK_EQUAL(nFeesAncestor, nFeesHeap);
+
+    // In a full block the heap selection collects at least as much
+    for (unsigned int nBlockMaxWeight : {20000, 50000, 100000, 200000}) {
+        nFeesAncestor = SelectForTest(chainparams, false, nBlockMaxWeight, vTxAncestor);
+        nFeesHeap = SelectForTest(chainparams, true, nBlockMaxWeight, vTxHeap);
+        BOOST_CHECK(nFeesHeap >= nFeesAncestor);
+    }
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(ClusterChunkSelection_test)
+{
+    const CChainParams& chainparams = Params();
+    SeedInsecureRand(true);
+    AddRandomPackages(500);
+    std::vector<uint256> vTxAncestor, vTxChunk;
+    CAmount nFeesAncestor = SelectForTest(chainparams, false, MAX_BLOCK_WEIGHT, vTxAncestor);
+    mempool.clear();
+
+    // The same transactions, grouped into clusters
+    mempool.SetClusterTracking(true);
+    SeedInsecureRand(true);
+    AddRandomPackages(500);
+
+    // With room for everything, all chunks are selected
+    CAmount nFeesChunk = SelectForTest(chainparams, false, MAX_BLOCK_WEIGHT, vTxChunk);
+    BOOST_CHECK_EQUAL(vTxChunk.size(), mempool.size());
+    BOOST_CHECK_EQUAL(nFeesChunk, nFeesAncestor);
+
+    // In a full block the selection stays valid and still collects fees
+    for (unsigned int nBlockMaxWeight : {20000, 50000, 100000, 200000}) {
+        nFeesChunk = SelectForTest(chainparams, false, nBlockMaxWeight, vTxChunk);
+        BOOST_CHECK(nFeesChunk > 0);
+    }
+
+    mempool.clear();
+    mempool.SetClusterTracking(false);
+}
+
+static bool TemplateContains(BlockTemplateBuilder& builder, const uint256& hash)
+{
+    // The builder runs in the background; give it a moment to catch up.
+    for (int i = 0; i < 200; i++) {
+        {
+            LOCK(cs_main);
+            unsigned int nTransactionsUpdated;
+            std::unique_ptr<CBlockTemplate> pblocktemplate = builder.GetTemplate(chainActive.Tip(), nTransactionsUpdated);
+            if (pblocktemplate) {
+                for (const CTransactionRef& tx : pblocktemplate->block.vtx) {
+                    if (tx->GetHash() == hash)
+                        return true;
+                }
+            }
+        }
+        MilliSleep(50);
+    }
+    return false;
+}
+
+BOOST_FIXTURE_TEST_CASE(BlockTemplateBuilder_test, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    BlockTemplateBuilder builder(Params(), 0);
+    builder.Start();
+
+    // A spend of a mature coinbase ends up in a rebuilt template
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = coinbaseTxns[0].vout[0].nValue - 10000;
+    txParent.vout[0].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, txParent, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txParent.vin[0].scriptSig << vchSig;
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, MakeTransactionRef(txParent), false, nullptr, nullptr, true, 0));
+    }
+    BOOST_CHECK(TemplateContains(builder, txParent.GetHash()));
+
+    // Its child is appended, and the coinbase collects both fees
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = txParent.vout[0].nValue - 20000;
+    txChild.vout[0].scriptPubKey = scriptPubKey;
+    vchSig.clear();
+    hash = SignatureHash(scriptPubKey, txChild, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txChild.vin[0].scriptSig << vchSig;
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, MakeTransactionRef(txChild), false, nullptr, nullptr, true, 0));
+    }
+    BOOST_CHECK(TemplateContains(builder, txChild.GetHash()));
+    {
+        LOCK(cs_main);
+        unsigned int nTransactionsUpdated;
+        std::unique_ptr<CBlockTemplate> pblocktemplate = builder.GetTemplate(chainActive.Tip(), nTransactionsUpdated);
+        BOOST_CHECK(pblocktemplate);
+        if (pblocktemplate) {
+            BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -30000);
+            BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->GetValueOut(), GetBlockSubsidy(chainActive.Height() + 1, Params().GetConsensus(), chainActive.Tip()->GetBlockHash()) + 30000);
+        }
+    }
+
+    // Removing a transaction for any reason but a block drops the template
+    {
+        LOCK(mempool.cs);
+        mempool.removeRecursive(txParent);
+    }
+    {
+        LOCK(cs_main);
+        unsigned int nTransactionsUpdated;
+        std::unique_ptr<CBlockTemplate> pblocktemplate = builder.GetTemplate(chainActive.Tip(), nTransactionsUpdated);
+        if (pblocktemplate) {
+            // ... unless it was already rebuilt without it
+            BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+        }
+    }
+
+    builder.Stop();
+    mempool.clear();
+}
+
+// Replace the witness commitment after changing the transactions of a template
+static void UpdateCommitment(CBlock& block, bool fHasCommitment)
+{
+    if (!fHasCommitment)
+        return;
+    CMutableTransaction coinbaseTx(*block.vtx[0]);
+    coinbaseTx.vout.pop_back();
+    block.vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+    GenerateCoinbaseCommitment(block, chainActive.Tip(), Params().GetConsensus());
+}
+
+BOOST_FIXTURE_TEST_CASE(TestBlockTemplateValidity_test, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // A spend of a mature coinbase through the mempool, and a child of it
+    // that is not in the mempool
+    std::vector<CMutableTransaction> spends(2);
+    for (int i = 0; i < 2; i++) {
+        spends[i].vin.resize(1);
+        spends[i].vin[0].prevout = i == 0 ? COutPoint(coinbaseTxns[0].GetHash(), 0) : COutPoint(spends[0].GetHash(), 0);
+        spends[i].vout.resize(1);
+        spends[i].vout[0].nValue = (i == 0 ? coinbaseTxns[0].vout[0].nValue : spends[0].vout[0].nValue) - 10000;
+        spends[i].vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, spends[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spends[i].vin[0].scriptSig << vchSig;
+    }
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, MakeTransactionRef(spends[0]), false, nullptr, nullptr, true, 0));
+    }
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK(pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+
+    LOCK(cs_main);
+    CBlock block = pblocktemplate->block;
+    bool fHasCommitment = !pblocktemplate->vchCoinbaseCommitment.empty();
+    CValidationState state;
+    BOOST_CHECK(TestBlockTemplateValidity(state, Params(), block, chainActive.Tip()));
+
+    // A transaction that did not go through the mempool has its scripts checked
+    CMutableTransaction txBadSig = spends[1];
+    txBadSig.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30);
+    block.vtx.push_back(MakeTransactionRef(txBadSig));
+    UpdateCommitment(block, fHasCommitment);
+    BOOST_CHECK(!TestBlockTemplateValidity(state, Params(), block, chainActive.Tip()));
+
+    // ... and one with a valid signature passes
+    block.vtx.back() = MakeTransactionRef(spends[1]);
+    UpdateCommitment(block, fHasCommitment);
+    state = CValidationState();
+    BOOST_CHECK(TestBlockTemplateValidity(state, Params(), block, chainActive.Tip()));
+
+    // Spending a coin twice is caught without running scripts
+    CMutableTransaction txDoubleSpend = spends[0];
+    txDoubleSpend.vout[0].nValue -= 1000;
+    block.vtx.push_back(MakeTransactionRef(txDoubleSpend));
+    UpdateCommitment(block, fHasCommitment);
+    BOOST_CHECK(!TestBlockTemplateValidity(state, Params(), block, chainActive.Tip()));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-inputs-missingorspent");
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(ScanProofOfWork_test)
+{
+    const std::unique_ptr<CChainParams> regtestParams = CreateChainParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& consensusParams = regtestParams->GetConsensus();
+    CBlockHeader header;
+    header.nVersion = VERSIONBITS_TOP_BITS;
+    header.nTime = 1500000000;
+    header.nBits = 0x200fffff;
+    for (int i = 0; i < 8; i++) {
+        header.hashPrevBlock = InsecureRand256();
+        header.hashMerkleRoot = InsecureRand256();
+        header.nNonce = 0;
+        CBlockHeader expected(header);
+        while (!CheckProofOfWork(expected.GetPoWHash(), expected.nBits, consensusParams)) ++expected.nNonce;
+
+        // Every thread count finds the nonce of a sequential search
+        for (int nThreads : {1, 3, 8}) {
+            CBlockHeader work(header);
+            BOOST_CHECK(ScanProofOfWork(work, 1000000, consensusParams, nThreads));
+            BOOST_CHECK_EQUAL(work.nNonce, expected.nNonce);
+
+            work.nNonce = 0;
+            BOOST_CHECK(!ScanProofOfWork(work, expected.nNonce, consensusParams, nThreads));
+            BOOST_CHECK_EQUAL(work.nNonce, expected.nNonce);
+        }
+    }
+
+    // The search ends at the last nonce
+    header.nNonce = std::numeric_limits<uint32_t>::max();
+    header.nBits = 0x1d00ffff;
+    BOOST_CHECK(!ScanProofOfWork(header, 1000, consensusParams, 4));
+    BOOST_CHECK_EQUAL(header.nNonce, 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
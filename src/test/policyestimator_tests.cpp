@@ -2,8 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "policy/policy.h"
 #include "policy/fees.h"
+#include "streams.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "util.h"
@@ -179,4 +181,56 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(EstimatesAcrossRescale)
+{
+    // The moving averages are decayed lazily and rescaled once the decay
+    // gets too small, which is after about 5900 blocks for the short
+    // horizon. Estimates must not change across a rescale or a write and
+    // read of the estimates file.
+    CBlockPolicyEstimator feeEst;
+    CFeeRate feeRate(5000);
+    LockPoints lp;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    std::vector<CFeeRate> vEstimates;
+    unsigned int nHeight = 0;
+    for (int nBlocks : {5000, 2000}) {
+        for (int i = 0; i < nBlocks; i++) {
+            std::vector<CTxMemPoolEntry> vEntries;
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10 * nHeight + k; // make transaction unique
+                CTransaction txEntry(tx);
+                vEntries.emplace_back(MakeTransactionRef(txEntry), feeRate.GetFee(GetVirtualTransactionSize(txEntry)), 0, nHeight, false, 4, lp);
+            }
+            std::vector<const CTxMemPoolEntry*> vBlock;
+            for (const CTxMemPoolEntry& entry : vEntries) {
+                feeEst.processTransaction(entry, true);
+                vBlock.push_back(&entry);
+            }
+            feeEst.processBlock(++nHeight, vBlock);
+        }
+        vEstimates.push_back(feeEst.estimateRawFee(2, 0.95, FeeEstimateHorizon::SHORT_HALFLIFE));
+        vEstimates.push_back(feeEst.estimateRawFee(2, 0.95, FeeEstimateHorizon::MED_HALFLIFE));
+    }
+    BOOST_CHECK(vEstimates[0] == vEstimates[2]);
+    BOOST_CHECK(vEstimates[1] == vEstimates[3]);
+    BOOST_CHECK(std::abs(vEstimates[0].GetFeePerK() - feeRate.GetFeePerK()) <= 10);
+
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(feeEst.Write(file));
+    rewind(file.Get());
+    CBlockPolicyEstimator feeEstRead;
+    BOOST_CHECK(feeEstRead.Read(file));
+    for (FeeEstimateHorizon horizon : {FeeEstimateHorizon::SHORT_HALFLIFE, FeeEstimateHorizon::MED_HALFLIFE, FeeEstimateHorizon::LONG_HALFLIFE}) {
+        for (int i = 1; i <= 12; i++) {
+            EstimationResult result, resultRead;
+            BOOST_CHECK(feeEst.estimateRawFee(i, 0.95, horizon, &result) == feeEstRead.estimateRawFee(i, 0.95, horizon, &resultRead));
+            BOOST_CHECK_CLOSE(result.pass.totalConfirmed, resultRead.pass.totalConfirmed, 1e-9);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
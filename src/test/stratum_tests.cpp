@@ -0,0 +1,110 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/merkle.h"
+#include "miner.h"
+#include "stratum.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+#include "utilstrencodings.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(stratum_tests, BasicTestingSetup)
+
+static CBlockTemplate RandomTemplate(int nTx)
+{
+    CBlockTemplate blocktemplate;
+    CBlock& block = blocktemplate.block;
+    block.nVersion = 0x20000000;
+    block.hashPrevBlock = InsecureRand256();
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0ffff0;
+
+    CMutableTransaction coinbaseTx;
+    coinbaseTx.vin.resize(1);
+    coinbaseTx.vin[0].prevout.SetNull();
+    coinbaseTx.vout.resize(1);
+    coinbaseTx.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(MakeTransactionRef(coinbaseTx));
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.emplace_back(COutPoint(InsecureRand256(), 0));
+        tx.vout.emplace_back(COIN, CScript() << OP_TRUE);
+        block.vtx.push_back(MakeTransactionRef(tx));
+    }
+    return blocktemplate;
+}
+
+BOOST_AUTO_TEST_CASE(stratum_job_coinbase)
+{
+    const CScript scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    const std::vector<unsigned char> vchExtraNonce1 = ParseHex("01020304");
+    const std::vector<unsigned char> vchExtraNonce2 = ParseHex("a0b0c0d0");
+
+    for (int nTx : {0, 1, 2, 5, 16}) {
+        StratumJob job("1", RandomTemplate(nTx), scriptPubKey, 1000, true);
+        size_t nDepth = 0;
+        while ((1 << nDepth) < nTx + 1) nDepth++;
+        BOOST_CHECK_EQUAL(job.vMerkleBranch.size(), nDepth);
+
+        // The coinbase of a share is the concatenation the miner hashes
+        CTransactionRef coinbase = job.GetCoinbase(vchExtraNonce1, vchExtraNonce2);
+        std::vector<unsigned char> vchCoinbase(job.vchCoinbase1);
+        vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce1.begin(), vchExtraNonce1.end());
+        vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+        vchCoinbase.insert(vchCoinbase.end(), job.vchCoinbase2.begin(), job.vchCoinbase2.end());
+        BOOST_CHECK(Hash(vchCoinbase.begin(), vchCoinbase.end()) == coinbase->GetHash());
+
+        BOOST_CHECK(coinbase->IsCoinBase());
+        BOOST_CHECK(coinbase->vout[0].scriptPubKey == scriptPubKey);
+        const CScript& scriptSig = coinbase->vin[0].scriptSig;
+        BOOST_CHECK(CScript(scriptSig.begin(), scriptSig.begin() + 3) == CScript() << 1000);
+        std::vector<unsigned char> vchExtraNonce(vchExtraNonce1);
+        vchExtraNonce.insert(vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+        BOOST_CHECK(CScript(scriptSig.begin() + 3, scriptSig.begin() + 12) == CScript() << vchExtraNonce);
+
+        // The merkle root from the branch is that of the full block
+        CBlock block = job.GetBlock(coinbase, 1500000100, 42);
+        BOOST_CHECK(block.hashMerkleRoot == BlockMerkleRoot(block));
+        BOOST_CHECK(block.GetHash() == job.GetHeader(*coinbase, 1500000100, 42).GetHash());
+        BOOST_CHECK_EQUAL(block.nTime, 1500000100U);
+        BOOST_CHECK_EQUAL(block.nNonce, 42U);
+        BOOST_CHECK_EQUAL(block.vtx.size(), (size_t)nTx + 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stratum_job_notify)
+{
+    CBlockTemplate blocktemplate = RandomTemplate(3);
+    blocktemplate.block.hashPrevBlock = uint256S("00112233445566778899aabbccddeeff0123456789abcdef0f1e2d3c4b5a6978");
+    StratumJob job("2a", blocktemplate, CScript() << OP_TRUE, 7, false);
+
+    UniValue params = job.GetNotifyParams();
+    BOOST_CHECK_EQUAL(params.size(), 9U);
+    BOOST_CHECK_EQUAL(params[0].get_str(), "2a");
+    BOOST_CHECK_EQUAL(params[1].get_str(), "4b5a69780f1e2d3c89abcdef01234567ccddeeff8899aabb4455667700112233");
+    BOOST_CHECK_EQUAL(params[2].get_str(), HexStr(job.vchCoinbase1));
+    BOOST_CHECK_EQUAL(params[3].get_str(), HexStr(job.vchCoinbase2));
+    BOOST_CHECK_EQUAL(params[4].size(), 2U);
+    BOOST_CHECK_EQUAL(params[4][0].get_str(), HexStr(job.vMerkleBranch[0].begin(), job.vMerkleBranch[0].end()));
+    BOOST_CHECK_EQUAL(params[5].get_str(), "20000000");
+    BOOST_CHECK_EQUAL(params[6].get_str(), "1e0ffff0");
+    BOOST_CHECK_EQUAL(params[7].get_str(), "59682f00");
+    BOOST_CHECK_EQUAL(params[8].get_bool(), false);
+}
+
+BOOST_AUTO_TEST_CASE(stratum_share_target)
+{
+    arith_uint256 target1;
+    target1.SetCompact(0x1f00ffff);
+    BOOST_CHECK(GetStratumShareTarget(1) == target1);
+    BOOST_CHECK(GetStratumShareTarget(2) == target1 / 2);
+    BOOST_CHECK(GetStratumShareTarget(0.5) == target1 * 2);
+    BOOST_CHECK(GetStratumShareTarget(65536) == target1 / 65536);
+    BOOST_CHECK(GetStratumShareTarget(1e30) < GetStratumShareTarget(1e6));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -22,6 +22,7 @@
 #include "rpc/register.h"
 #include "script/sigcache.h"
 
+#include <limits>
 #include <memory>
 
 void CConnmanTest::AddNode(CNode& node)
@@ -147,7 +148,7 @@ TestChain100Setup::CreateAndProcessBlock(const std::vector<CMutableTransaction>&
     unsigned int extraNonce = 0;
     IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
 
-    while (!CheckProofOfWork(block.GetPoWHash(), block.nBits, chainparams.GetConsensus())) ++block.nNonce;
+    while (!ScanProofOfWork(block, std::numeric_limits<uint32_t>::max(), chainparams.GetConsensus(), GetGenerateThreads())) {}
 
     std::shared_ptr<const CBlock> shared_pblock = std::make_shared<const CBlock>(block);
     ProcessNewBlock(chainparams, shared_pblock, true, nullptr);
@@ -0,0 +1,133 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txmempool.h"
+#include "txrelay.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+BOOST_FIXTURE_TEST_SUITE(txrelay_tests, BasicTestingSetup)
+
+static CTransactionRef MakeTx(const uint256& prevHash, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout.hash = prevHash;
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return MakeTransactionRef(tx);
+}
+
+static bool AcceptAll(const TxRelayScheduler::RelayTx&)
+{
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(TxRelayOrderTest)
+{
+    CTxMemPool pool;
+    TxRelayScheduler relay(pool);
+    TestMemPoolEntryHelper entry;
+    int64_t nNow = 1000000;
+
+    TxRelayCursor cursor = relay.GetHeadCursor();
+
+    // A low fee parent with a high fee child, and an unrelated medium fee tx
+    CTransactionRef txParent = MakeTx(InsecureRand256(), 10 * COIN);
+    CTransactionRef txChild = MakeTx(txParent->GetHash(), 9 * COIN);
+    CTransactionRef txOther = MakeTx(InsecureRand256(), 10 * COIN);
+    pool.addUnchecked(txParent->GetHash(), entry.Fee(1000).FromTx(*txParent));
+    pool.addUnchecked(txChild->GetHash(), entry.Fee(100000).FromTx(*txChild));
+    pool.addUnchecked(txOther->GetHash(), entry.Fee(10000).FromTx(*txOther));
+
+    // Queue the child first, and the parent twice
+    relay.QueueTransaction(txChild->GetHash());
+    relay.QueueTransaction(txParent->GetHash());
+    relay.QueueTransaction(txOther->GetHash());
+    relay.QueueTransaction(txParent->GetHash());
+
+    // Nothing is available to getdata before it was announced
+    BOOST_CHECK(!relay.FindTx(txOther->GetHash()));
+
+    // Transactions without ancestors come first, by fee rate; each only once
+    std::vector<uint256> vAnnounce;
+    relay.GetAnnouncements(cursor, 2, AcceptAll, vAnnounce, nNow);
+    BOOST_CHECK_EQUAL(vAnnounce.size(), 2);
+    BOOST_CHECK(vAnnounce[0] == txOther->GetHash());
+    BOOST_CHECK(vAnnounce[1] == txParent->GetHash());
+    BOOST_CHECK(relay.FindTx(txOther->GetHash())->GetHash() == txOther->GetHash());
+    BOOST_CHECK(!relay.FindTx(txChild->GetHash()));
+
+    // The cursor continues where it stopped
+    vAnnounce.clear();
+    relay.GetAnnouncements(cursor, 2, AcceptAll, vAnnounce, nNow);
+    BOOST_CHECK_EQUAL(vAnnounce.size(), 1);
+    BOOST_CHECK(vAnnounce[0] == txChild->GetHash());
+
+    // A peer connecting now does not see earlier transactions
+    TxRelayCursor cursorNew = relay.GetHeadCursor();
+    vAnnounce.clear();
+    relay.GetAnnouncements(cursorNew, 10, AcceptAll, vAnnounce, nNow);
+    BOOST_CHECK(vAnnounce.empty());
+
+    // Relayed transactions stay available until their batch expires
+    relay.GetAnnouncements(cursor, 10, AcceptAll, vAnnounce, nNow + RELAY_TX_EXPIRY);
+    BOOST_CHECK(relay.FindTx(txChild->GetHash()));
+    relay.GetAnnouncements(cursor, 10, AcceptAll, vAnnounce, nNow + RELAY_TX_EXPIRY + 1);
+    BOOST_CHECK(!relay.FindTx(txChild->GetHash()));
+    BOOST_CHECK(vAnnounce.empty());
+}
+
+BOOST_AUTO_TEST_CASE(TxRelayFilterTest)
+{
+    CTxMemPool pool;
+    TxRelayScheduler relay(pool);
+    TestMemPoolEntryHelper entry;
+    int64_t nNow = 1000000;
+
+    TxRelayCursor cursorA = relay.GetHeadCursor();
+    TxRelayCursor cursorB = relay.GetHeadCursor();
+    TxRelayCursor cursorC = relay.GetHeadCursor();
+
+    CTransactionRef txLow = MakeTx(InsecureRand256(), 10 * COIN);
+    CTransactionRef txHigh = MakeTx(InsecureRand256(), 10 * COIN);
+    CTransactionRef txGone = MakeTx(InsecureRand256(), 10 * COIN);
+    pool.addUnchecked(txLow->GetHash(), entry.Fee(1000).FromTx(*txLow));
+    pool.addUnchecked(txHigh->GetHash(), entry.Fee(100000).FromTx(*txHigh));
+    pool.addUnchecked(txGone->GetHash(), entry.Fee(10000).FromTx(*txGone));
+    relay.QueueTransaction(txLow->GetHash());
+    relay.QueueTransaction(txHigh->GetHash());
+    relay.QueueTransaction(txGone->GetHash());
+
+    // Peer A filters by fee rate
+    CFeeRate minFeeRate(50000, ::GetSerializeSize(*txHigh, SER_NETWORK, PROTOCOL_VERSION));
+    std::vector<uint256> vAnnounce;
+    relay.GetAnnouncements(cursorA, 10, [&](const TxRelayScheduler::RelayTx& relayTx) {
+        return relayTx.feeRate > minFeeRate;
+    }, vAnnounce, nNow);
+    BOOST_CHECK_EQUAL(vAnnounce.size(), 1);
+    BOOST_CHECK(vAnnounce[0] == txHigh->GetHash());
+
+    // Transactions which left the mempool are not announced to peer B
+    pool.removeRecursive(*txGone);
+    vAnnounce.clear();
+    relay.GetAnnouncements(cursorB, 10, AcceptAll, vAnnounce, nNow);
+    BOOST_CHECK_EQUAL(vAnnounce.size(), 2);
+    BOOST_CHECK(vAnnounce[0] == txHigh->GetHash());
+    BOOST_CHECK(vAnnounce[1] == txLow->GetHash());
+
+    // Peer C skips everything
+    relay.SkipAll(cursorC, nNow);
+    vAnnounce.clear();
+    relay.GetAnnouncements(cursorC, 10, AcceptAll, vAnnounce, nNow);
+    BOOST_CHECK(vAnnounce.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
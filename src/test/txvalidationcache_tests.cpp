@@ -90,6 +90,72 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(tx_mempool_parallel_script_checks, TestChain100Setup)
+{
+    // Transactions with enough inputs have their scripts checked on the
+    // script check threads; failures must be reported as they are inline.
+    BOOST_CHECK(nScriptCheckThreads > 0);
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // Split a mature coinbase into outputs for a transaction with many inputs
+    CMutableTransaction fanout;
+    fanout.nVersion = 1;
+    fanout.vin.resize(1);
+    fanout.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    fanout.vin[0].prevout.n = 0;
+    fanout.vout.resize(8);
+    for (unsigned int i = 0; i < fanout.vout.size(); i++) {
+        fanout.vout[i].nValue = 2*CENT;
+        fanout.vout[i].scriptPubKey = scriptPubKey;
+    }
+    {
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, fanout, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        fanout.vin[0].scriptSig << vchSig;
+    }
+    BOOST_CHECK(ToMemPool(fanout));
+
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(fanout.vout.size());
+    for (unsigned int i = 0; i < spend.vin.size(); i++) {
+        spend.vin[i].prevout.hash = fanout.GetHash();
+        spend.vin[i].prevout.n = i;
+    }
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    for (unsigned int i = 0; i < spend.vin.size(); i++) {
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, spend, i, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spend.vin[i].scriptSig = CScript() << vchSig;
+    }
+
+    // A bad signature in any one input is caught
+    for (unsigned int i : {0u, 5u, 7u}) {
+        CMutableTransaction badSpend = spend;
+        std::vector<unsigned char> vchSig(badSpend.vin[i].scriptSig.begin() + 1, badSpend.vin[i].scriptSig.end());
+        vchSig[10] ^= 1; // within R
+        badSpend.vin[i].scriptSig = CScript() << vchSig;
+
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(!AcceptToMemoryPool(mempool, state, MakeTransactionRef(badSpend), false, nullptr, nullptr, true, 0));
+        int nDoS;
+        BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+        BOOST_CHECK(state.GetRejectReason().find("mandatory-script-verify-flag-failed") == 0);
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+
+    BOOST_CHECK(ToMemPool(spend));
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+    mempool.clear();
+}
+
 // Run CheckInputs (using pcoinsTip) on the given transaction, for all script
 // flags.  Test that CheckInputs passes for all flags that don't overlap with
 // the failing_flags argument, but otherwise fails.
@@ -6,6 +6,7 @@
 #include "txmempool.h"
 
 #include "consensus/consensus.h"
+#include "crypto/common.h"
 #include "consensus/tx_verify.h"
 #include "consensus/validation.h"
 #include "validation.h"
@@ -19,11 +20,14 @@
 #include "utiltime.h"
 #include "chainparams.h"
 
+#include <algorithm>
+#include <queue>
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
-    tx(_tx), nFee(_nFee), nTime(_nTime), entryHeight(_entryHeight),
-    spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp)
+    tx(_tx), nFee(_nFee), nTime(_nTime), lockPoints(lp), entryHeight(_entryHeight),
+    sigOpCost(_sigOpsCost), spendsCoinbase(_spendsCoinbase)
 {
     nTxWeight = GetTransactionWeight(*tx);
     nUsageSize = RecursiveDynamicUsage(tx);
@@ -67,14 +71,14 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const vecEntries &children = GetMemPoolChildren(updateIt);
+    setEntries stageEntries(children.begin(), children.end()), setAllDescendants;
 
     while (!stageEntries.empty()) {
         const txiter cit = *stageEntries.begin();
         setAllDescendants.insert(cit);
         stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
+        const vecEntries &setChildren = GetMemPoolChildren(cit);
         for (const txiter childEntry : setChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
@@ -137,10 +141,13 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
         if (it == mapTx.end()) {
             continue;
         }
-        auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
         // First calculate the children, and update setMemPoolChildren to
         // include them, and update their setMemPoolParents to include this tx.
-        for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
+        for (uint32_t n = 0; n < it->GetTx().vout.size(); n++) {
+            auto iter = mapNextTx.find(COutPoint(hash, n));
+            if (iter == mapNextTx.end()) {
+                continue;
+            }
             const uint256 &childHash = iter->second->GetHash();
             txiter childIter = mapTx.find(childHash);
             assert(childIter != mapTx.end());
@@ -153,6 +160,35 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
         }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
     }
+
+    if (fTrackClusters) {
+        // The transactions were added without knowing about their in-mempool
+        // children, so their clusters may need to be merged.
+        std::set<uint64_t> setUpdated;
+        for (const uint256 &hash : vHashesToUpdate) {
+            txiter it = mapTx.find(hash);
+            if (it == mapTx.end()) {
+                continue;
+            }
+            for (txiter childIt : GetMemPoolChildren(it)) {
+                uint64_t nCluster = mapLinks[it].nCluster;
+                uint64_t nChildCluster = mapLinks[childIt].nCluster;
+                if (nCluster == nChildCluster) {
+                    continue;
+                }
+                if (mapClusters[nCluster].vTxs.size() < mapClusters[nChildCluster].vTxs.size()) {
+                    std::swap(nCluster, nChildCluster);
+                }
+                MergeClusters(nCluster, nChildCluster);
+            }
+            setUpdated.insert(mapLinks[it].nCluster);
+        }
+        for (uint64_t nCluster : setUpdated) {
+            if (mapClusters.count(nCluster)) {
+                LinearizeCluster(nCluster);
+            }
+        }
+    }
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
@@ -180,7 +216,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        const vecEntries &parents = GetMemPoolParents(it);
+        parentHashes.insert(parents.begin(), parents.end());
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
@@ -203,7 +240,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
+        const vecEntries & setMemPoolParents = GetMemPoolParents(stageit);
         for (const txiter &phash : setMemPoolParents) {
             // If this is a new ancestor, add it.
             if (setAncestors.count(phash) == 0) {
@@ -221,7 +258,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const vecEntries parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     for (txiter piter : parentIters) {
         UpdateChild(piter, it, add);
@@ -250,7 +287,7 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
+    const vecEntries &setMemPoolChildren = GetMemPoolChildren(it);
     for (txiter updateIt : setMemPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
@@ -335,7 +372,7 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
-    nTransactionsUpdated(0), minerPolicyEstimator(estimator)
+    nTransactionsUpdated(0), minerPolicyEstimator(estimator), fTrackClusters(false), nNextCluster(1)
 {
     _clear(); //lock free clear
 
@@ -411,6 +448,9 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     }
     UpdateAncestorsOf(true, newit, setAncestors);
     UpdateEntryForAncestors(newit, setAncestors);
+    if (fTrackClusters) {
+        AddToCluster(newit);
+    }
 
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
@@ -467,7 +507,7 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants
         setDescendants.insert(it);
         stage.erase(it);
 
-        const setEntries &setChildren = GetMemPoolChildren(it);
+        const vecEntries &setChildren = GetMemPoolChildren(it);
         for (const txiter &childiter : setChildren) {
             if (!setDescendants.count(childiter)) {
                 stage.insert(childiter);
@@ -598,6 +638,8 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 void CTxMemPool::_clear()
 {
     mapLinks.clear();
+    mapClusters.clear();
+    setClustersByLastChunk.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
@@ -666,7 +708,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        // The link vectors must hold the same entries, in set order
+        const vecEntries &parents = GetMemPoolParents(it);
+        assert(parents.size() == setParentCheck.size() && std::equal(parents.begin(), parents.end(), setParentCheck.begin()));
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -690,16 +734,20 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
         // Check children against mapNextTx
         CTxMemPool::setEntries setChildrenCheck;
-        auto iter = mapNextTx.lower_bound(COutPoint(it->GetTx().GetHash(), 0));
         int64_t childSizes = 0;
-        for (; iter != mapNextTx.end() && iter->first->hash == it->GetTx().GetHash(); ++iter) {
+        for (uint32_t n = 0; n < tx.vout.size(); n++) {
+            auto iter = mapNextTx.find(COutPoint(tx.GetHash(), n));
+            if (iter == mapNextTx.end()) {
+                continue;
+            }
             txiter childit = mapTx.find(iter->second->GetHash());
             assert(childit != mapTx.end()); // mapNextTx points to in-mempool transactions
             if (setChildrenCheck.insert(childit).second) {
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        const vecEntries &children = GetMemPoolChildren(it);
+        assert(children.size() == setChildrenCheck.size() && std::equal(children.begin(), children.end(), setChildrenCheck.begin()));
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -741,6 +789,45 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+
+    if (fTrackClusters) {
+        size_t nClusterTxs = 0;
+        for (const auto& item : mapClusters) {
+            const TxCluster& cluster = item.second;
+            assert(!cluster.vTxs.empty() && !cluster.vChunks.empty());
+            assert(cluster.vChunks.back().nEnd == cluster.vTxs.size());
+            assert(setClustersByLastChunk.count(ClusterEvictionKey(cluster, item.first)));
+            uint32_t nPos = 0;
+            for (size_t i = 0; i < cluster.vChunks.size(); i++) {
+                const TxClusterChunk& chunk = cluster.vChunks[i];
+                CAmount nFee = 0;
+                int64_t nSize = 0;
+                for (; nPos < chunk.nEnd; nPos++) {
+                    txiter it = cluster.vTxs[nPos];
+                    const TxLinks& links = mapLinks.find(it)->second;
+                    assert(links.nCluster == item.first && links.nClusterPos == nPos);
+                    // Parents come first, and all neighbours are in the same cluster
+                    for (txiter parentIt : links.parents) {
+                        const TxLinks& parentLinks = mapLinks.find(parentIt)->second;
+                        assert(parentLinks.nCluster == item.first && parentLinks.nClusterPos < nPos);
+                    }
+                    for (txiter childIt : links.children) {
+                        assert(mapLinks.find(childIt)->second.nCluster == item.first);
+                    }
+                    nFee += it->GetModifiedFee();
+                    nSize += it->GetTxSize();
+                }
+                assert(chunk.nFee == nFee && chunk.nSize == nSize);
+                if (i > 0) {
+                    const TxClusterChunk& prev = cluster.vChunks[i - 1];
+                    assert((double)prev.nFee * chunk.nSize >= (double)chunk.nFee * prev.nSize);
+                }
+            }
+            nClusterTxs += cluster.vTxs.size();
+        }
+        assert(nClusterTxs == mapTx.size());
+        assert(setClustersByLastChunk.size() == mapClusters.size());
+    }
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
@@ -861,6 +948,9 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
             for (txiter descendantIt : setDescendants) {
                 mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0, 0));
             }
+            if (fTrackClusters) {
+                LinearizeCluster(mapLinks[it].nCluster);
+            }
             ++nTransactionsUpdated;
         }
     }
@@ -912,15 +1002,29 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    size_t nUsage = memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    if (fTrackClusters) {
+        // Every transaction is in one cluster and starts at most one chunk
+        nUsage += memusage::DynamicUsage(mapClusters) + memusage::DynamicUsage(setClustersByLastChunk) + mapTx.size() * (sizeof(txiter) + sizeof(TxClusterChunk));
+    }
+    return nUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
+    std::set<uint64_t> setClusters;
+    if (fTrackClusters) {
+        for (txiter it : stage) {
+            const TxLinks& links = mapLinks[it];
+            mapClusters[links.nCluster].vTxs[links.nClusterPos] = mapTx.end();
+            setClusters.insert(links.nCluster);
+        }
+    }
     for (const txiter& it : stage) {
         removeUnchecked(it, reason);
     }
+    SplitClusters(setClusters);
 }
 
 int CTxMemPool::Expire(int64_t time) {
@@ -949,27 +1053,38 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
     return addUnchecked(hash, entry, setAncestors, validFeeEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+// Insert into or erase from a link vector, keeping it sorted like setEntries
+// and accounting for its allocation in cachedInnerUsage
+void CTxMemPool::UpdateLinks(vecEntries& v, txiter link, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    vecEntries::iterator pos = std::lower_bound(v.begin(), v.end(), link, CompareIteratorByHash());
+    bool fFound = pos != v.end() && *pos == link;
+    if (add == fFound) {
+        return;
     }
+    cachedInnerUsage -= memusage::DynamicUsage(v);
+    if (add) {
+        v.insert(pos, link);
+    } else {
+        v.erase(pos);
+        if (v.empty()) {
+            vecEntries().swap(v);
+        }
+    }
+    cachedInnerUsage += memusage::DynamicUsage(v);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateLinks(mapLinks[entry].children, child, add);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateLinks(mapLinks[entry].parents, parent, add);
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -977,7 +1092,7 @@ const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
     return it->second.parents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1023,19 +1138,30 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
     while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        setEntries stage;
+        CFeeRate removed;
+        if (fTrackClusters) {
+            // The last chunk of a cluster contains all its in-mempool
+            // descendants, so it can be evicted on its own.
+            const ClusterEvictionKey& key = *setClustersByLastChunk.begin();
+            const TxCluster& cluster = mapClusters[key.nCluster];
+            uint32_t nStart = cluster.vChunks.size() > 1 ? cluster.vChunks[cluster.vChunks.size() - 2].nEnd : 0;
+            stage.insert(cluster.vTxs.begin() + nStart, cluster.vTxs.end());
+            removed = CFeeRate(key.nFee, key.nSize);
+        } else {
+            indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+            CalculateDescendants(mapTx.project<0>(it), stage);
+            removed = CFeeRate(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        }
 
         // We set the new mempool min fee to the feerate of the removed set, plus the
         // "minimum reasonable fee rate" (ie some value under which we consider txn
         // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
         // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
         removed += incrementalRelayFee;
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
         nTxnRemoved += stage.size();
 
         std::vector<CTransaction> txn;
@@ -1060,6 +1186,364 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
     }
 }
 
+bool CTxMemPool::ClusterEvictionKey::operator<(const ClusterEvictionKey& b) const
+{
+    double f1 = (double)nFee * b.nSize;
+    double f2 = (double)b.nFee * nSize;
+    if (f1 != f2) {
+        return f1 < f2;
+    }
+    return nCluster < b.nCluster;
+}
+
+void CTxMemPool::SetClusterTracking(bool fTrack)
+{
+    LOCK(cs);
+    assert(mapTx.empty());
+    fTrackClusters = fTrack;
+}
+
+uint64_t CTxMemPool::CalculateClusterCount(const setEntries& setAncestors) const
+{
+    LOCK(cs);
+    std::set<uint64_t> setClusters;
+    uint64_t nCount = 1;
+    for (txiter it : setAncestors) {
+        uint64_t nCluster = mapLinks.find(it)->second.nCluster;
+        if (setClusters.insert(nCluster).second) {
+            nCount += mapClusters.find(nCluster)->second.vTxs.size();
+        }
+    }
+    return nCount;
+}
+
+CFeeRate CTxMemPool::GetChunkFeeRate(txiter it) const
+{
+    LOCK(cs);
+    if (!fTrackClusters) {
+        return CFeeRate(it->GetModifiedFee(), it->GetTxSize());
+    }
+    const TxLinks& links = mapLinks.find(it)->second;
+    const TxCluster& cluster = mapClusters.find(links.nCluster)->second;
+    auto chunk = std::upper_bound(cluster.vChunks.begin(), cluster.vChunks.end(), links.nClusterPos,
+        [](uint32_t nPos, const TxClusterChunk& c) { return nPos < c.nEnd; });
+    assert(chunk != cluster.vChunks.end());
+    return CFeeRate(chunk->nFee, chunk->nSize);
+}
+
+void CTxMemPool::AddToCluster(txiter it)
+{
+    // Merge the clusters of all parents into the largest one
+    std::set<uint64_t> setParentClusters;
+    for (txiter parentIt : GetMemPoolParents(it)) {
+        setParentClusters.insert(mapLinks[parentIt].nCluster);
+    }
+    uint64_t nCluster = 0;
+    for (uint64_t nParentCluster : setParentClusters) {
+        if (nCluster == 0 || mapClusters[nParentCluster].vTxs.size() > mapClusters[nCluster].vTxs.size()) {
+            nCluster = nParentCluster;
+        }
+    }
+    if (nCluster == 0) {
+        nCluster = nNextCluster++;
+    }
+    for (uint64_t nParentCluster : setParentClusters) {
+        if (nParentCluster != nCluster) {
+            MergeClusters(nCluster, nParentCluster);
+        }
+    }
+    if (setParentClusters.size() == 1) {
+        InsertIntoCluster(nCluster, it);
+    } else {
+        mapClusters[nCluster].vTxs.push_back(it);
+        LinearizeCluster(nCluster);
+    }
+}
+
+void CTxMemPool::InsertIntoCluster(uint64_t nCluster, txiter it)
+{
+    TxCluster& cluster = mapClusters[nCluster];
+    setClustersByLastChunk.erase(ClusterEvictionKey(cluster, nCluster));
+
+    // A new transaction has no children in the mempool, so any position
+    // after its parents is topological. Insert it before the first chunk
+    // after them with a lower feerate, so it is not held back by worse
+    // transactions that do not depend on it.
+    uint32_t nAfterParents = 0;
+    for (txiter parentIt : GetMemPoolParents(it)) {
+        nAfterParents = std::max(nAfterParents, mapLinks[parentIt].nClusterPos + 1);
+    }
+    const CAmount nFee = it->GetModifiedFee();
+    const int64_t nSize = it->GetTxSize();
+    uint32_t nPos = cluster.vTxs.size();
+    uint32_t nStart = 0;
+    for (const TxClusterChunk& chunk : cluster.vChunks) {
+        if (nStart >= nAfterParents && (double)chunk.nFee * nSize < (double)nFee * chunk.nSize) {
+            nPos = nStart;
+            break;
+        }
+        nStart = chunk.nEnd;
+    }
+    cluster.vTxs.insert(cluster.vTxs.begin() + nPos, it);
+    ChunkCluster(nCluster);
+}
+
+void CTxMemPool::MergeClusters(uint64_t nTo, uint64_t nFrom)
+{
+    clusterMap::iterator itFrom = mapClusters.find(nFrom);
+    setClustersByLastChunk.erase(ClusterEvictionKey(itFrom->second, nFrom));
+    std::vector<txiter>& vTxs = mapClusters[nTo].vTxs;
+    for (txiter it : itFrom->second.vTxs) {
+        mapLinks[it].nCluster = nTo;
+        vTxs.push_back(it);
+    }
+    mapClusters.erase(itFrom);
+}
+
+void CTxMemPool::SplitClusters(const std::set<uint64_t>& setClusters)
+{
+    for (uint64_t nCluster : setClusters) {
+        clusterMap::iterator itCluster = mapClusters.find(nCluster);
+        std::vector<txiter> vRemaining;
+        for (txiter it : itCluster->second.vTxs) {
+            if (it != mapTx.end()) {
+                vRemaining.push_back(it);
+                mapLinks[it].nCluster = 0;
+            }
+        }
+        if (vRemaining.empty()) {
+            setClustersByLastChunk.erase(ClusterEvictionKey(itCluster->second, nCluster));
+            mapClusters.erase(itCluster);
+            continue;
+        }
+
+        // Collect the connected parts, the first of which keeps the cluster
+        setClustersByLastChunk.erase(ClusterEvictionKey(itCluster->second, nCluster));
+        itCluster->second.vTxs.clear();
+        std::vector<uint64_t> vParts;
+        for (txiter start : vRemaining) {
+            if (mapLinks[start].nCluster != 0) {
+                continue;
+            }
+            uint64_t nPart = vParts.empty() ? nCluster : nNextCluster++;
+            vParts.push_back(nPart);
+            std::vector<txiter> vStack(1, start);
+            mapLinks[start].nCluster = nPart;
+            while (!vStack.empty()) {
+                const TxLinks& links = mapLinks[vStack.back()];
+                vStack.pop_back();
+                for (const vecEntries* pNeighbours : {&links.parents, &links.children}) {
+                    for (txiter next : *pNeighbours) {
+                        TxLinks& nextLinks = mapLinks[next];
+                        if (nextLinks.nCluster == 0) {
+                            nextLinks.nCluster = nPart;
+                            vStack.push_back(next);
+                        }
+                    }
+                }
+            }
+        }
+
+        // What remains of a linearization is still topological, so each part
+        // keeps its order and only has to be chunked again
+        for (txiter it : vRemaining) {
+            mapClusters[mapLinks[it].nCluster].vTxs.push_back(it);
+        }
+        for (uint64_t nPart : vParts) {
+            ChunkCluster(nPart);
+        }
+    }
+}
+
+/** Clusters larger than this are not reordered for feerate, as that is
+ *  quadratic in their size. Policy keeps clusters far smaller; only a reorg
+ *  can create them. */
+static const size_t MAX_CLUSTER_LINEARIZATION_SIZE = 1000;
+
+/** Call f for the position of every bit set in a bitset of nWords words,
+ *  in increasing order */
+template<typename F>
+static void ForEachBit(const uint64_t* pWords, size_t nWords, F f)
+{
+    for (size_t w = 0; w < nWords; w++) {
+        for (uint64_t nWord = pWords[w]; nWord != 0; nWord &= nWord - 1) {
+            f(w * 64 + CountBits(nWord & -nWord) - 1);
+        }
+    }
+}
+
+void CTxMemPool::LinearizeCluster(uint64_t nCluster)
+{
+    TxCluster& cluster = mapClusters[nCluster];
+    if (!cluster.vChunks.empty()) {
+        setClustersByLastChunk.erase(ClusterEvictionKey(cluster, nCluster));
+    }
+    std::vector<txiter>& vTxs = cluster.vTxs;
+    const size_t n = vTxs.size();
+    std::vector<TxLinks*> vLinks(n);
+    for (size_t i = 0; i < n; i++) {
+        vLinks[i] = &mapLinks[vTxs[i]];
+        vLinks[i]->nCluster = nCluster;
+        vLinks[i]->nClusterPos = i;
+    }
+
+    // Sort topologically: vOrder lists positions in vTxs, parents first
+    std::vector<uint32_t> vOrder;
+    vOrder.reserve(n);
+    std::vector<size_t> vMissingParents(n);
+    for (size_t i = 0; i < n; i++) {
+        vMissingParents[i] = vLinks[i]->parents.size();
+        if (vMissingParents[i] == 0) {
+            vOrder.push_back(i);
+        }
+    }
+    std::vector<std::vector<uint32_t> > vChildren(n);
+    for (size_t i = 0; i < vOrder.size(); i++) {
+        for (txiter childIt : vLinks[vOrder[i]]->children) {
+            uint32_t nChild = mapLinks[childIt].nClusterPos;
+            vChildren[vOrder[i]].push_back(nChild);
+            if (--vMissingParents[nChild] == 0) {
+                vOrder.push_back(nChild);
+            }
+        }
+    }
+    assert(vOrder.size() == n);
+
+    // Ancestor sort: repeatedly append the remaining transaction whose
+    // remaining ancestors have the highest feerate, with those ancestors.
+    // Everything below indexes transactions by their rank in vOrder.
+    std::vector<CAmount> vFee(n);
+    std::vector<int64_t> vSize(n);
+    for (size_t r = 0; r < n; r++) {
+        vFee[r] = vTxs[vOrder[r]]->GetModifiedFee();
+        vSize[r] = vTxs[vOrder[r]]->GetTxSize();
+    }
+    std::vector<uint32_t> vLinearization;
+    vLinearization.reserve(n);
+    if (n > MAX_CLUSTER_LINEARIZATION_SIZE) {
+        for (size_t r = 0; r < n; r++) {
+            vLinearization.push_back(r);
+        }
+    } else {
+        std::vector<uint32_t> vRank(n);
+        for (size_t r = 0; r < n; r++) {
+            vRank[vOrder[r]] = r;
+        }
+        const size_t nWords = (n + 63) / 64;
+        std::vector<uint64_t> vAncestors(n * nWords);
+        std::vector<uint64_t> vDescendants(n * nWords);
+        for (size_t r = 0; r < n; r++) {
+            vAncestors[r * nWords + r / 64] |= (uint64_t)1 << (r % 64);
+            for (uint32_t nChild : vChildren[vOrder[r]]) {
+                uint32_t c = vRank[nChild];
+                for (size_t w = 0; w < nWords; w++) {
+                    vAncestors[c * nWords + w] |= vAncestors[r * nWords + w];
+                }
+            }
+        }
+        for (size_t r = n; r-- > 0; ) {
+            vDescendants[r * nWords + r / 64] |= (uint64_t)1 << (r % 64);
+            for (uint32_t nChild : vChildren[vOrder[r]]) {
+                uint32_t c = vRank[nChild];
+                for (size_t w = 0; w < nWords; w++) {
+                    vDescendants[r * nWords + w] |= vDescendants[c * nWords + w];
+                }
+            }
+        }
+        std::vector<CAmount> vAncestorFee(n, 0);
+        std::vector<int64_t> vAncestorSize(n, 0);
+        for (size_t r = 0; r < n; r++) {
+            ForEachBit(&vAncestors[r * nWords], nWords, [&](uint32_t a) {
+                vAncestorFee[r] += vFee[a];
+                vAncestorSize[r] += vSize[a];
+            });
+        }
+
+        // Candidates by ancestor feerate, lowest rank first on ties. Entries
+        // are pushed again whenever their ancestor state changes, and stale
+        // ones are skipped when popped.
+        struct Candidate {
+            CAmount nFee;
+            int64_t nSize;
+            uint32_t r;
+        };
+        auto compare = [](const Candidate& a, const Candidate& b) {
+            double f1 = (double)a.nFee * b.nSize;
+            double f2 = (double)b.nFee * a.nSize;
+            if (f1 == f2) {
+                return a.r > b.r;
+            }
+            return f1 < f2;
+        };
+        std::priority_queue<Candidate, std::vector<Candidate>, decltype(compare)> candidates(compare);
+        for (size_t r = 0; r < n; r++) {
+            candidates.push(Candidate{vAncestorFee[r], vAncestorSize[r], (uint32_t)r});
+        }
+        std::vector<bool> vDone(n, false);
+        std::vector<uint32_t> vSelected, vUpdated;
+        while (!candidates.empty()) {
+            Candidate best = candidates.top();
+            candidates.pop();
+            if (vDone[best.r] || best.nFee != vAncestorFee[best.r] || best.nSize != vAncestorSize[best.r]) {
+                continue;
+            }
+            vSelected.clear();
+            ForEachBit(&vAncestors[best.r * nWords], nWords, [&](uint32_t a) {
+                if (!vDone[a]) {
+                    vSelected.push_back(a);
+                    vDone[a] = true;
+                }
+            });
+            vLinearization.insert(vLinearization.end(), vSelected.begin(), vSelected.end());
+            vUpdated.clear();
+            for (uint32_t a : vSelected) {
+                ForEachBit(&vDescendants[a * nWords], nWords, [&](uint32_t d) {
+                    if (!vDone[d]) {
+                        vAncestorFee[d] -= vFee[a];
+                        vAncestorSize[d] -= vSize[a];
+                        vUpdated.push_back(d);
+                    }
+                });
+            }
+            std::sort(vUpdated.begin(), vUpdated.end());
+            vUpdated.erase(std::unique(vUpdated.begin(), vUpdated.end()), vUpdated.end());
+            for (uint32_t d : vUpdated) {
+                candidates.push(Candidate{vAncestorFee[d], vAncestorSize[d], d});
+            }
+        }
+    }
+
+    std::vector<txiter> vLinearized;
+    vLinearized.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        vLinearized.push_back(vTxs[vOrder[vLinearization[i]]]);
+    }
+    vTxs.swap(vLinearized);
+    ChunkCluster(nCluster);
+}
+
+void CTxMemPool::ChunkCluster(uint64_t nCluster)
+{
+    // Merge each transaction into the chunks before it while it has a
+    // higher feerate than them
+    TxCluster& cluster = mapClusters[nCluster];
+    cluster.vChunks.clear();
+    for (size_t i = 0; i < cluster.vTxs.size(); i++) {
+        const txiter it = cluster.vTxs[i];
+        TxLinks& links = mapLinks[it];
+        links.nCluster = nCluster;
+        links.nClusterPos = i;
+        TxClusterChunk chunk(it->GetModifiedFee(), it->GetTxSize(), i + 1);
+        while (!cluster.vChunks.empty() && (double)chunk.nFee * cluster.vChunks.back().nSize > (double)cluster.vChunks.back().nFee * chunk.nSize) {
+            chunk.nFee += cluster.vChunks.back().nFee;
+            chunk.nSize += cluster.vChunks.back().nSize;
+            cluster.vChunks.pop_back();
+        }
+        cluster.vChunks.push_back(chunk);
+    }
+    setClustersByLastChunk.insert(ClusterEvictionKey(cluster, nCluster));
+}
+
 bool CTxMemPool::TransactionWithinChainLimit(const uint256& txid, size_t chainLimit) const {
     LOCK(cs);
     auto it = mapTx.find(txid);
@@ -65,14 +65,12 @@ class CTxMemPool;
 class CTxMemPoolEntry
 {
 private:
+    // Fields are grouped by size to avoid padding, as there is one entry per
+    // mempool transaction. Per-transaction quantities that are bounded by
+    // consensus or policy (weight, usage, sigops) are stored in 32 bits.
     CTransactionRef tx;
     CAmount nFee;              //!< Cached to avoid expensive parent-transaction lookups
-    size_t nTxWeight;          //!< ... and avoid recomputing tx weight (also used for GetTxSize())
-    size_t nUsageSize;         //!< ... and total memory usage
     int64_t nTime;             //!< Local time when entering the mempool
-    unsigned int entryHeight;  //!< Chain height when entering the mempool
-    bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
-    int64_t sigOpCost;         //!< Total sigop cost
     int64_t feeDelta;          //!< Used for determining the priority of the transaction for mining in a block
     LockPoints lockPoints;     //!< Track the height and time at which tx was final
 
@@ -89,6 +87,12 @@ private:
     CAmount nModFeesWithAncestors;
     int64_t nSigOpCostWithAncestors;
 
+    uint32_t nTxWeight;        //!< Cached to avoid recomputing tx weight (also used for GetTxSize())
+    uint32_t nUsageSize;       //!< ... and total memory usage
+    unsigned int entryHeight;  //!< Chain height when entering the mempool
+    int32_t sigOpCost;         //!< Total sigop cost
+    bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
+
 public:
     CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                     int64_t _nTime, unsigned int _entryHeight,
@@ -130,7 +134,7 @@ public:
     CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
-    mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint32_t vTxHashesIdx; //!< Index in mempool's vTxHashes
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -411,6 +415,19 @@ public:
  * CalculateMemPoolAncestors() takes configurable limits that are designed to
  * prevent these calculations from being too CPU intensive.
  *
+ * Clusters:
+ *
+ * With SetClusterTracking(true), the mempool also groups transactions into
+ * clusters, the sets of transactions connected by spends. Each cluster is
+ * kept linearized: its transactions are in a topological order that is split
+ * into chunks of non-increasing feerate, so a prefix of chunks is what a
+ * miner would include from it. Adding a transaction merges the clusters of
+ * its parents; removing transactions splits their clusters into the
+ * remaining connected parts. Either way only the affected clusters are
+ * relinearized. Size limiting evicts the lowest feerate last chunk of any
+ * cluster, block assembly merges the chunks of all clusters by feerate, and
+ * replacements must beat the chunk feerate of the transactions they replace.
+ *
  */
 class CTxMemPool
 {
@@ -422,6 +439,9 @@ private:
     uint64_t totalTxSize;      //!< sum of all mempool tx's virtual sizes. Differs from serialized tx size since witness data is discounted. Defined in BIP 141.
     uint64_t cachedInnerUsage; //!< sum of dynamic memory usage of all the map elements (NOT the maps themselves)
 
+    bool fTrackClusters; //!< Whether transactions are grouped into linearized clusters
+    uint64_t nNextCluster; //!< Id of the next cluster created
+
     mutable int64_t lastRollingFeeUpdate;
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
@@ -476,27 +496,87 @@ public:
         }
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    /** In-mempool parents or children of a transaction, ordered like
+     *  setEntries. Most transactions have very few, so a sorted vector is
+     *  much smaller than a set node per link. */
+    typedef std::vector<txiter> vecEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
+    const vecEntries & GetMemPoolParents(txiter entry) const;
+    const vecEntries & GetMemPoolChildren(txiter entry) const;
 private:
     typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        vecEntries parents;
+        vecEntries children;
+        //! Cluster of the transaction and its position in the cluster's
+        //! linearization, when tracking clusters
+        uint64_t nCluster;
+        uint32_t nClusterPos;
+
+        TxLinks() : nCluster(0), nClusterPos(0) {}
     };
 
     typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
     txlinksMap mapLinks;
 
+    void UpdateLinks(vecEntries& v, txiter link, bool add);
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
+public:
+    /** Consecutive transactions of a cluster linearization with their
+     *  combined modified fee and virtual size */
+    struct TxClusterChunk {
+        CAmount nFee;
+        int64_t nSize;
+        uint32_t nEnd; //!< Position after the last transaction of the chunk
+
+        TxClusterChunk(CAmount nFeeIn, int64_t nSizeIn, uint32_t nEndIn) : nFee(nFeeIn), nSize(nSizeIn), nEnd(nEndIn) {}
+    };
+
+    struct TxCluster {
+        //! Topological order of the transactions in the cluster
+        std::vector<txiter> vTxs;
+        //! Partition of vTxs in chunks of non-increasing feerate
+        std::vector<TxClusterChunk> vChunks;
+    };
+
+    typedef std::map<uint64_t, TxCluster> clusterMap;
+    clusterMap mapClusters;
+
+private:
+    //! Identifies a cluster by the feerate of its last chunk
+    struct ClusterEvictionKey {
+        CAmount nFee;
+        int64_t nSize;
+        uint64_t nCluster;
+
+        ClusterEvictionKey(const TxCluster& cluster, uint64_t nClusterIn) : nFee(cluster.vChunks.back().nFee), nSize(cluster.vChunks.back().nSize), nCluster(nClusterIn) {}
+        bool operator<(const ClusterEvictionKey& b) const;
+    };
+    //! All clusters, lowest last chunk feerate first
+    std::set<ClusterEvictionKey> setClustersByLastChunk;
+
+    /** Add a new transaction to the cluster of its parents, merging them */
+    void AddToCluster(txiter it);
+    /** Move all transactions of cluster nFrom into cluster nTo */
+    void MergeClusters(uint64_t nTo, uint64_t nFrom);
+    /** Split clusters that lost transactions into their connected parts,
+     *  after the removed transactions were replaced by mapTx.end() */
+    void SplitClusters(const std::set<uint64_t>& setClusters);
+    /** Add a new transaction to the linearization of its parents' only
+     *  cluster, without reordering the rest */
+    void InsertIntoCluster(uint64_t nCluster, txiter it);
+    /** Recompute the linearization and chunks of a cluster */
+    void LinearizeCluster(uint64_t nCluster);
+    /** Recompute the chunks of a cluster for its current linearization */
+    void ChunkCluster(uint64_t nCluster);
+
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
-    indirectmap<COutPoint, const CTransaction*> mapNextTx;
+    unordered_indirectmap<COutPoint, const CTransaction*, SaltedOutpointHasher> mapNextTx;
     std::map<uint256, CAmount> mapDeltas;
 
     /** Create a new CTxMemPool.
@@ -600,6 +680,18 @@ public:
     /** Returns false if the transaction is in the mempool and not within the chain limit specified. */
     bool TransactionWithinChainLimit(const uint256& txid, size_t chainLimit) const;
 
+    /** Group transactions into linearized clusters. Only possible while the mempool is empty. */
+    void SetClusterTracking(bool fTrack);
+    bool IsClusterTracking() const { return fTrackClusters; }
+
+    /** Number of transactions in the cluster a new transaction with the
+     *  given in-mempool ancestors would be part of, itself included */
+    uint64_t CalculateClusterCount(const setEntries& setAncestors) const;
+
+    /** Feerate of the chunk of a transaction when tracking clusters, and
+     *  otherwise its own feerate */
+    CFeeRate GetChunkFeeRate(txiter it) const;
+
     unsigned long size()
     {
         LOCK(cs);
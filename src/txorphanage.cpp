@@ -0,0 +1,247 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanage.h"
+
+#include "consensus/validation.h"
+#include "core_memusage.h"
+#include "policy/policy.h"
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+
+TxOrphanage::TxOrphanage() : nTotalUsage(0), nNextSweep(0)
+{
+}
+
+bool TxOrphanage::AddTx(const CTransactionRef& tx, NodeId peer)
+{
+    LOCK(cs);
+
+    const uint256& hash = tx->GetHash();
+    if (mapOrphanTransactions.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    // 100 orphans, each of which is at most 99,999 bytes big is
+    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
+    unsigned int sz = GetTransactionWeight(*tx);
+    if (sz >= MAX_STANDARD_TX_WEIGHT)
+    {
+        LogPrint(BCLog::MEMPOOL, "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    std::vector<OrphanMapIter>& vPeerOrphans = mapOrphansByPeer[peer];
+    size_t nUsage = RecursiveDynamicUsage(tx);
+    auto ret = mapOrphanTransactions.emplace(hash, OrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, nUsage, vOrphanList.size(), vPeerOrphans.size()});
+    assert(ret.second);
+    vOrphanList.push_back(ret.first);
+    vPeerOrphans.push_back(ret.first);
+    nTotalUsage += nUsage;
+    for (const CTxIn& txin : tx->vin) {
+        mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
+    }
+
+    LogPrint(BCLog::MEMPOOL, "stored orphan tx %s (mapsz %u outsz %u usage %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nTotalUsage);
+    return true;
+}
+
+bool TxOrphanage::HaveTx(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphanTransactions.count(hash);
+}
+
+bool TxOrphanage::GetTx(const uint256& hash, CTransactionRef& tx, NodeId& fromPeer) const
+{
+    LOCK(cs);
+    auto it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
+        return false;
+    tx = it->second.tx;
+    fromPeer = it->second.fromPeer;
+    return true;
+}
+
+int TxOrphanage::EraseTx(const uint256& hash)
+{
+    LOCK(cs);
+    return EraseTxLocked(hash);
+}
+
+int TxOrphanage::EraseTxLocked(const uint256& hash)
+{
+    AssertLockHeld(cs);
+    std::map<uint256, OrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
+        return 0;
+    for (const CTxIn& txin : it->second.tx->vin)
+    {
+        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(it);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+
+    // Unlink from the eviction list and the sender's list by moving the last
+    // element into the freed slot.
+    size_t nListPos = it->second.nListPos;
+    vOrphanList[nListPos] = vOrphanList.back();
+    vOrphanList[nListPos]->second.nListPos = nListPos;
+    vOrphanList.pop_back();
+
+    auto itPeer = mapOrphansByPeer.find(it->second.fromPeer);
+    assert(itPeer != mapOrphansByPeer.end());
+    std::vector<OrphanMapIter>& vPeerOrphans = itPeer->second;
+    size_t nPeerPos = it->second.nPeerPos;
+    vPeerOrphans[nPeerPos] = vPeerOrphans.back();
+    vPeerOrphans[nPeerPos]->second.nPeerPos = nPeerPos;
+    vPeerOrphans.pop_back();
+    if (vPeerOrphans.empty())
+        mapOrphansByPeer.erase(itPeer);
+
+    nTotalUsage -= it->second.nUsage;
+    mapOrphanTransactions.erase(it);
+    return 1;
+}
+
+void TxOrphanage::EraseForPeer(NodeId peer)
+{
+    LOCK(cs);
+    auto itPeer = mapOrphansByPeer.find(peer);
+    if (itPeer == mapOrphansByPeer.end())
+        return;
+
+    // Copy the hashes first, as erasing modifies the peer's list
+    std::vector<uint256> vErase;
+    vErase.reserve(itPeer->second.size());
+    for (const OrphanMapIter& it : itPeer->second)
+        vErase.push_back(it->first);
+
+    int nErased = 0;
+    for (const uint256& hash : vErase)
+        nErased += EraseTxLocked(hash);
+    if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx from peer=%d\n", nErased, peer);
+}
+
+void TxOrphanage::EraseForBlock(const CBlock& block)
+{
+    LOCK(cs);
+
+    std::vector<uint256> vOrphanErase;
+
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
+
+        // Which orphan pool entries must we evict?
+        for (const auto& txin : tx.vin) {
+            auto itByPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+            if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
+            for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+                vOrphanErase.push_back((*mi)->first);
+            }
+        }
+    }
+
+    // Erase orphan transactions include or precluded by this block
+    if (vOrphanErase.size()) {
+        int nErased = 0;
+        for (const uint256& orphanHash : vOrphanErase) {
+            nErased += EraseTxLocked(orphanHash);
+        }
+        LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx included or conflicted by block\n", nErased);
+    }
+}
+
+unsigned int TxOrphanage::LimitOrphans(unsigned int nMaxOrphans, size_t nMaxOrphansSize)
+{
+    LOCK(cs);
+
+    unsigned int nEvicted = 0;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        std::map<uint256, OrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
+        {
+            std::map<uint256, OrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                nErased += EraseTxLocked(maybeErase->first);
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx due to expiration\n", nErased);
+    }
+    FastRandomContext rng;
+    while (mapOrphanTransactions.size() > nMaxOrphans || nTotalUsage > nMaxOrphansSize)
+    {
+        // Evict a random orphan:
+        size_t randompos = rng.randrange(vOrphanList.size());
+        EraseTxLocked(vOrphanList[randompos]->first);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+unsigned int TxOrphanage::LimitOrphansForPeer(NodeId peer, unsigned int nMaxPerPeer)
+{
+    LOCK(cs);
+
+    unsigned int nEvicted = 0;
+    auto itPeer = mapOrphansByPeer.find(peer);
+    if (itPeer == mapOrphansByPeer.end())
+        return 0;
+    FastRandomContext rng;
+    while (itPeer->second.size() > nMaxPerPeer)
+    {
+        // Evict a random orphan from this peer. Erasing the peer's last
+        // orphan also removes its list, so only loop while one is left over.
+        size_t randompos = rng.randrange(itPeer->second.size());
+        bool fLast = itPeer->second.size() == 1;
+        EraseTxLocked(itPeer->second[randompos]->first);
+        ++nEvicted;
+        if (fLast)
+            break;
+    }
+    return nEvicted;
+}
+
+void TxOrphanage::AddChildrenToWorkSet(const CTransaction& tx, std::set<uint256>& orphanWorkSet) const
+{
+    LOCK(cs);
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(tx.GetHash(), i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (const OrphanMapIter& mi : itByPrev->second) {
+            orphanWorkSet.insert(mi->first);
+        }
+    }
+}
+
+size_t TxOrphanage::Size() const
+{
+    LOCK(cs);
+    return mapOrphanTransactions.size();
+}
+
+size_t TxOrphanage::TotalSize() const
+{
+    LOCK(cs);
+    return nTotalUsage;
+}
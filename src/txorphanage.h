@@ -0,0 +1,108 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXORPHANAGE_H
+#define BITCOIN_TXORPHANAGE_H
+
+#include "net.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+
+/**
+ * A pool of transactions whose inputs could not be found, kept until their
+ * parents arrive (or they expire or get evicted).
+ *
+ * The orphanage is bounded by transaction count, by the memory used by its
+ * transactions and by the number of transactions each peer may have in it.
+ * Eviction picks a random entry in constant time. All methods take the
+ * orphanage's own lock, so callers don't need to hold cs_main.
+ */
+class TxOrphanage
+{
+public:
+    TxOrphanage();
+
+    /** Add a new orphan transaction. Returns false if it was already known or is too large */
+    bool AddTx(const CTransactionRef& tx, NodeId peer);
+
+    /** Check if we already have an orphan transaction with the given hash */
+    bool HaveTx(const uint256& hash) const;
+
+    /** Look up an orphan transaction and the peer that sent it. Returns false if unknown */
+    bool GetTx(const uint256& hash, CTransactionRef& tx, NodeId& fromPeer) const;
+
+    /** Erase an orphan by hash. Returns the number of transactions erased (0 or 1) */
+    int EraseTx(const uint256& hash);
+
+    /** Erase all orphans announced by a peer (eg, after that peer disconnects) */
+    void EraseForPeer(NodeId peer);
+
+    /** Erase all orphans included in or invalidated by a new block */
+    void EraseForBlock(const CBlock& block);
+
+    /**
+     * Expire old orphans, then evict random orphans until no more than
+     * nMaxOrphans transactions using at most nMaxOrphansSize bytes are left.
+     * Returns the number of evicted transactions (expired ones not included).
+     */
+    unsigned int LimitOrphans(unsigned int nMaxOrphans, size_t nMaxOrphansSize);
+
+    /** Evict random orphans from a peer until it holds at most nMaxPerPeer of them */
+    unsigned int LimitOrphansForPeer(NodeId peer, unsigned int nMaxPerPeer);
+
+    /** Add the hashes of orphans spending an output of tx to a peer's orphan work set */
+    void AddChildrenToWorkSet(const CTransaction& tx, std::set<uint256>& orphanWorkSet) const;
+
+    /** Number of orphans in the pool */
+    size_t Size() const;
+
+    /** Memory usage of the transactions in the pool */
+    size_t TotalSize() const;
+
+protected:
+    struct OrphanTx {
+        CTransactionRef tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        size_t nUsage;
+        size_t nListPos;    //!< Position in vOrphanList
+        size_t nPeerPos;    //!< Position in the sender's mapOrphansByPeer vector
+    };
+    typedef std::map<uint256, OrphanTx>::iterator OrphanMapIter;
+
+    struct IteratorComparator
+    {
+        template<typename I>
+        bool operator()(const I& a, const I& b) const
+        {
+            return &(*a) < &(*b);
+        }
+    };
+
+    mutable CCriticalSection cs;
+
+    std::map<uint256, OrphanTx> mapOrphanTransactions GUARDED_BY(cs);
+    std::map<COutPoint, std::set<OrphanMapIter, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs);
+    //! All orphans, for picking a random one to evict in constant time
+    std::vector<OrphanMapIter> vOrphanList GUARDED_BY(cs);
+    //! Orphans announced by each peer, for per-peer quotas and cheap erasure on disconnect
+    std::map<NodeId, std::vector<OrphanMapIter>> mapOrphansByPeer GUARDED_BY(cs);
+    size_t nTotalUsage GUARDED_BY(cs);
+    int64_t nNextSweep GUARDED_BY(cs);
+
+    int EraseTxLocked(const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs);
+};
+
+#endif // BITCOIN_TXORPHANAGE_H
@@ -0,0 +1,139 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txrelay.h"
+
+#include "txmempool.h"
+
+#include <algorithm>
+#include <set>
+
+TxRelayScheduler::TxRelayScheduler(CTxMemPool& poolIn) : pool(poolIn), nFirstBatch(0)
+{
+}
+
+void TxRelayScheduler::QueueTransaction(const uint256& hash)
+{
+    LOCK(cs);
+    vQueued.push_back(hash);
+}
+
+TxRelayCursor TxRelayScheduler::GetHeadCursor() const
+{
+    LOCK(cs);
+    TxRelayCursor cursor;
+    cursor.nBatch = nFirstBatch + vBatches.size();
+    return cursor;
+}
+
+void TxRelayScheduler::SealBatch(int64_t nNow)
+{
+    AssertLockHeld(cs);
+    if (vQueued.empty())
+        return;
+
+    std::vector<CTxMemPool::txiter> vIters;
+    vIters.reserve(vQueued.size());
+    Batch batch;
+    {
+        LOCK(pool.cs);
+        std::set<uint256> setSeen;
+        for (const uint256& hash : vQueued) {
+            // Transactions which already left the mempool are never announced
+            CTxMemPool::txiter it = pool.mapTx.find(hash);
+            if (it != pool.mapTx.end() && setSeen.insert(hash).second)
+                vIters.push_back(it);
+        }
+
+        // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
+        std::sort(vIters.begin(), vIters.end(), [](const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) {
+            uint64_t counta = a->GetCountWithAncestors();
+            uint64_t countb = b->GetCountWithAncestors();
+            if (counta == countb) {
+                return CompareTxMemPoolEntryByScore()(*a, *b);
+            }
+            return counta < countb;
+        });
+
+        batch.vEntries.reserve(vIters.size());
+        for (const CTxMemPool::txiter& it : vIters) {
+            batch.vEntries.push_back(std::make_shared<RelayTx>(RelayTx{it->GetSharedTx(), CFeeRate(it->GetFee(), it->GetTxSize()), false}));
+        }
+    }
+    vQueued.clear();
+
+    if (batch.vEntries.empty())
+        return;
+    batch.nTimeExpire = nNow + RELAY_TX_EXPIRY;
+    vBatches.push_back(std::move(batch));
+}
+
+void TxRelayScheduler::ExpireBatches(int64_t nNow)
+{
+    AssertLockHeld(cs);
+    while (!vBatches.empty() && vBatches.front().nTimeExpire < nNow) {
+        for (const std::shared_ptr<RelayTx>& entry : vBatches.front().vEntries) {
+            if (!entry->fAnnounced)
+                continue;
+            auto it = mapRelay.find(entry->tx->GetHash());
+            if (it != mapRelay.end() && it->second == entry)
+                mapRelay.erase(it);
+        }
+        vBatches.pop_front();
+        nFirstBatch++;
+    }
+}
+
+void TxRelayScheduler::GetAnnouncements(TxRelayCursor& cursor, unsigned int nMax, const std::function<bool(const RelayTx&)>& fnAccept, std::vector<uint256>& vAnnounce, int64_t nNow)
+{
+    LOCK(cs);
+    SealBatch(nNow);
+    ExpireBatches(nNow);
+
+    if (cursor.nBatch < nFirstBatch) {
+        cursor.nBatch = nFirstBatch;
+        cursor.nPos = 0;
+    }
+
+    unsigned int nAnnounced = 0;
+    while (nAnnounced < nMax && cursor.nBatch < nFirstBatch + vBatches.size()) {
+        const Batch& batch = vBatches[cursor.nBatch - nFirstBatch];
+        if (cursor.nPos >= batch.vEntries.size()) {
+            cursor.nBatch++;
+            cursor.nPos = 0;
+            continue;
+        }
+        const std::shared_ptr<RelayTx>& entry = batch.vEntries[cursor.nPos++];
+        if (!fnAccept(*entry))
+            continue;
+        // Not in the mempool anymore? don't bother sending it.
+        const uint256& hash = entry->tx->GetHash();
+        if (!pool.exists(hash))
+            continue;
+        vAnnounce.push_back(hash);
+        nAnnounced++;
+        if (!entry->fAnnounced) {
+            entry->fAnnounced = true;
+            mapRelay[hash] = entry;
+        }
+    }
+}
+
+void TxRelayScheduler::SkipAll(TxRelayCursor& cursor, int64_t nNow)
+{
+    LOCK(cs);
+    SealBatch(nNow);
+    cursor.nBatch = nFirstBatch + vBatches.size();
+    cursor.nPos = 0;
+}
+
+CTransactionRef TxRelayScheduler::FindTx(const uint256& hash) const
+{
+    LOCK(cs);
+    auto it = mapRelay.find(hash);
+    if (it == mapRelay.end())
+        return nullptr;
+    return it->second->tx;
+}
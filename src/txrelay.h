@@ -0,0 +1,99 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRELAY_H
+#define BITCOIN_TXRELAY_H
+
+#include "policy/feerate.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+class CTxMemPool;
+
+/** How long relayed transactions stay available to getdata requests, in microseconds */
+static const int64_t RELAY_TX_EXPIRY = 15 * 60 * 1000000LL;
+
+/** A peer's position in the TxRelayScheduler announcement queue */
+struct TxRelayCursor
+{
+    uint64_t nBatch;
+    size_t nPos;
+
+    TxRelayCursor() : nBatch(0), nPos(0) {}
+};
+
+/**
+ * Schedules transaction announcements (inv messages) to peers.
+ *
+ * Transactions to relay are appended to one global queue. Whenever some
+ * peer's trickle timer fires, the transactions queued since the last trickle
+ * are sealed into a batch which is sorted once, topologically and by
+ * feerate, using a single pass over the mempool. Peers only keep a cursor
+ * into the sealed batches; whether a transaction is actually announced to a
+ * peer is decided by the peer's known-inventory, fee and bloom filters. The
+ * sorting and mempool lookups are thus shared by all peers instead of being
+ * redone for every peer on every trickle.
+ *
+ * Transactions that have been announced to at least one peer are kept
+ * available for getdata requests until their batch expires.
+ */
+class TxRelayScheduler
+{
+public:
+    struct RelayTx {
+        CTransactionRef tx;
+        CFeeRate feeRate;
+        bool fAnnounced;
+    };
+
+    explicit TxRelayScheduler(CTxMemPool& poolIn);
+
+    /** Queue a transaction for announcement to all peers */
+    void QueueTransaction(const uint256& hash);
+
+    /** Cursor past all sealed batches, for a newly connected peer */
+    TxRelayCursor GetHeadCursor() const;
+
+    /**
+     * Move a peer's cursor forward, collecting up to nMax transactions that
+     * are still in the mempool and for which fnAccept returns true.
+     * Transactions fnAccept returns false for are skipped for this peer.
+     */
+    void GetAnnouncements(TxRelayCursor& cursor, unsigned int nMax, const std::function<bool(const RelayTx&)>& fnAccept, std::vector<uint256>& vAnnounce, int64_t nNow);
+
+    /** Move a peer's cursor past all queued transactions, without announcing them */
+    void SkipAll(TxRelayCursor& cursor, int64_t nNow);
+
+    /** Find a transaction that has been announced to some peer, for answering getdata */
+    CTransactionRef FindTx(const uint256& hash) const;
+
+private:
+    struct Batch {
+        int64_t nTimeExpire;
+        std::vector<std::shared_ptr<RelayTx>> vEntries;
+    };
+
+    CTxMemPool& pool;
+
+    mutable CCriticalSection cs;
+    //! Transactions queued since the last batch was sealed
+    std::vector<uint256> vQueued GUARDED_BY(cs);
+    //! Sealed batches, in sealing order. vBatches[0] has sequence number nFirstBatch
+    std::deque<Batch> vBatches GUARDED_BY(cs);
+    uint64_t nFirstBatch GUARDED_BY(cs);
+    //! Announced transactions, available to getdata
+    std::map<uint256, std::shared_ptr<RelayTx>> mapRelay GUARDED_BY(cs);
+
+    void SealBatch(int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void ExpireBatches(int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(cs);
+};
+
+#endif // BITCOIN_TXRELAY_H
@@ -18,6 +18,7 @@
 #include "fs.h"
 #include "hash.h"
 #include "init.h"
+#include "mempooljournal.h"
 #include "policy/fees.h"
 #include "policy/policy.h"
 #include "policy/rbf.h"
@@ -423,6 +424,34 @@ void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool f
     LimitMempoolSize(mempool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+/** Transactions with fewer inputs have their scripts checked inline by AcceptToMemoryPool */
+static const unsigned int MIN_PARALLEL_MEMPOOL_SCRIPT_CHECKS = 4;
+
+/**
+ * CheckInputs for mempool acceptance, verifying the scripts of transactions
+ * with many inputs on the script check threads. The queue only reports that
+ * some check failed, so a failure is checked again inline to fill in state;
+ * the inputs that passed are in the signature cache by then.
+ */
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, unsigned int flags, PrecomputedTransactionData& txdata)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads || tx.vin.size() < MIN_PARALLEL_MEMPOOL_SCRIPT_CHECKS)
+        return CheckInputs(tx, state, view, true, flags, true, false, txdata);
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, view, true, flags, true, false, txdata, &vChecks))
+        return false;
+    // The queue is only used under cs_main, by ConnectBlock and here
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    if (control.Wait())
+        return true;
+    return CheckInputs(tx, state, view, true, flags, true, false, txdata);
+}
+
 // Used to avoid mempool polluting consensus critical paths if CCoinsViewMempool
 // were somehow broken and returning the wrong scriptPubKeys
 static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, CTxMemPool& pool,
@@ -658,6 +687,14 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
         }
+        if (pool.IsClusterTracking()) {
+            uint64_t nClusterCount = pool.CalculateClusterCount(setAncestors);
+            uint64_t nLimitCluster = gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT);
+            if (nClusterCount > nLimitCluster) {
+                return state.DoS(0, false, REJECT_NONSTANDARD, "too-large-mempool-cluster", false,
+                    strprintf("too many transactions in cluster [limit: %u]", nLimitCluster));
+            }
+        }
 
         // A transaction that spends outputs that would be replaced by it is invalid. Now
         // that we have the set of all ancestors we can detect this
@@ -718,8 +755,10 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
                 // descendants. While that does mean high feerate children are
                 // ignored when deciding whether or not to replace, we do
                 // require the replacement to pay more overall fees too,
-                // mitigating most cases.
-                CFeeRate oldFeeRate(mi->GetModifiedFee(), mi->GetTxSize());
+                // mitigating most cases. When tracking clusters, mining
+                // takes whole chunks, so the replaced transaction's chunk
+                // feerate is what the replacement has to beat.
+                CFeeRate oldFeeRate = pool.GetChunkFeeRate(mi);
                 if (newFeeRate <= oldFeeRate)
                 {
                     return state.DoS(0, false,
@@ -811,7 +850,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
+        if (!CheckInputsForMempool(tx, state, view, scriptVerifyFlags, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
@@ -1351,6 +1390,16 @@ int GetSpendHeight(const CCoinsViewCache& inputs)
 static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
 static uint256 scriptExecutionCacheNonce(GetRandHash());
 
+static uint256 GetScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 hashCacheEntry;
+    // We only use the first 19 bytes of nonce to avoid a second SHA
+    // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
+    static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    return hashCacheEntry;
+}
+
 void InitScriptExecutionCache() {
     // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
     // setup_bytes creates the minimum possible cache (2 elements).
@@ -1399,11 +1448,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             // correct (ie that the transaction hash which is in tx's prevouts
             // properly commits to the scriptPubKey in the inputs view of that
             // transaction).
-            uint256 hashCacheEntry;
-            // We only use the first 19 bytes of nonce to avoid a second SHA
-            // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
-            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
-            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
             AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
             if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
                 return true;
@@ -1462,6 +1507,32 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
     return true;
 }
 
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
+{
+    // Open history file to read
+    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenUndoFile failed", __func__);
+
+    // Read block
+    uint256 hashChecksum;
+    CHashVerifier<CAutoFile> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
+    try {
+        verifier << hashBlock;
+        verifier >> blockundo;
+        filein >> hashChecksum;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    // Verify checksum
+    if (hashChecksum != verifier.GetHash())
+        return error("%s: Checksum mismatch", __func__);
+
+    return true;
+}
+
 namespace {
 
 bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
@@ -1491,32 +1562,6 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
-bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
-{
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenUndoFile failed", __func__);
-
-    // Read block
-    uint256 hashChecksum;
-    CHashVerifier<CAutoFile> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
-    try {
-        verifier << hashBlock;
-        verifier >> blockundo;
-        filein >> hashChecksum;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-    }
-
-    // Verify checksum
-    if (hashChecksum != verifier.GetHash())
-        return error("%s: Checksum mismatch", __func__);
-
-    return true;
-}
-
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -1667,8 +1712,6 @@ void static FlushBlockFile(bool fFinalize = false)
 
 static bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
@@ -3433,6 +3476,86 @@ bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams,
     return true;
 }
 
+bool TestBlockTemplateValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev)
+{
+    AssertLockHeld(cs_main);
+    assert(pindexPrev && pindexPrev == chainActive.Tip());
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    CCoinsViewCache viewNew(pcoinsTip);
+    CBlockIndex indexDummy(block);
+    indexDummy.pprev = pindexPrev;
+    indexDummy.nHeight = pindexPrev->nHeight + 1;
+
+    if (!ContextualCheckBlockHeader(block, state, chainparams, pindexPrev, GetAdjustedTime()))
+        return error("%s: Consensus::ContextualCheckBlockHeader: %s", __func__, FormatStateMessage(state));
+    if (!CheckBlock(block, state, consensusParams, false, false))
+        return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
+    if (!ContextualCheckBlock(block, state, consensusParams, pindexPrev))
+        return error("%s: Consensus::ContextualCheckBlock: %s", __func__, FormatStateMessage(state));
+
+    // The BIP30 check of ConnectBlock is not needed: mempool transactions
+    // never duplicate the txid of an unspent output.
+    int nLockTimeFlags = 0;
+    if (VersionBitsState(pindexPrev, consensusParams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+        nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
+    }
+    unsigned int flags = GetBlockScriptFlags(&indexDummy, consensusParams);
+
+    std::vector<int> prevheights;
+    CAmount nFees = 0;
+    int64_t nSigOpsCost = 0;
+    for (const auto& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
+        if (!tx.IsCoinBase()) {
+            if (!viewNew.HaveInputs(tx))
+                return state.DoS(100, error("%s: inputs missing/spent", __func__),
+                                 REJECT_INVALID, "bad-txns-inputs-missingorspent");
+
+            prevheights.resize(tx.vin.size());
+            for (size_t j = 0; j < tx.vin.size(); j++) {
+                prevheights[j] = viewNew.AccessCoin(tx.vin[j].prevout).nHeight;
+            }
+            if (!SequenceLocks(tx, nLockTimeFlags, &prevheights, indexDummy)) {
+                return state.DoS(100, error("%s: contains a non-BIP68-final transaction", __func__),
+                                 REJECT_INVALID, "bad-txns-nonfinal");
+            }
+        }
+
+        nSigOpsCost += GetTransactionSigOpCost(tx, viewNew, flags);
+        if (nSigOpsCost > MAX_BLOCK_SIGOPS_COST)
+            return state.DoS(100, error("%s: too many sigops", __func__),
+                             REJECT_INVALID, "bad-blk-sigops");
+
+        if (!tx.IsCoinBase()) {
+            nFees += viewNew.GetValueIn(tx) - tx.GetValueOut();
+
+            // Transactions accepted to the mempool under the same flags have
+            // their script execution cached; only run scripts of the others.
+            if (scriptExecutionCache.contains(GetScriptExecutionCacheEntry(tx, flags), false)) {
+                if (!Consensus::CheckTxInputs(tx, state, viewNew, indexDummy.nHeight))
+                    return error("%s: Consensus::CheckTxInputs on %s failed with %s", __func__,
+                        tx.GetHash().ToString(), FormatStateMessage(state));
+            } else {
+                PrecomputedTransactionData txdata(tx);
+                if (!CheckInputs(tx, state, viewNew, true, flags, true, true, txdata, nullptr))
+                    return error("%s: CheckInputs on %s failed with %s", __func__,
+                        tx.GetHash().ToString(), FormatStateMessage(state));
+            }
+        }
+
+        UpdateCoins(tx, viewNew, indexDummy.nHeight);
+    }
+
+    CAmount blockReward = nFees + GetBlockSubsidy(indexDummy.nHeight, consensusParams, pindexPrev->GetBlockHash());
+    if (block.vtx[0]->GetValueOut() > blockReward && indexDummy.nHeight > consensusParams.HardFork2Height)
+        return state.DoS(100,
+            error("%s: coinbase pays too much (actual=%d vs limit=%d)", __func__,
+                block.vtx[0]->GetValueOut(), blockReward),
+                REJECT_INVALID, "bad-cb-amount");
+
+    return true;
+}
+
 /**
  * BLOCK PRUNING CODE
  */
@@ -4483,10 +4606,9 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
 
 static const uint64_t MEMPOOL_DUMP_VERSION = 1;
 
-bool LoadMempool(void)
+/** Read a mempool.dat written by DumpMempool, with per-transaction deltas moved into mapDeltas */
+static bool ReadMempoolDump(std::vector<TxMempoolInfo>& vinfo, std::map<uint256, CAmount>& mapDeltas)
 {
-    const CChainParams& chainparams = Params();
-    int64_t nExpiryTimeout = gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
     FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat", "rb");
     CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
     if (file.IsNull()) {
@@ -4494,11 +4616,6 @@ bool LoadMempool(void)
         return false;
     }
 
-    int64_t count = 0;
-    int64_t skipped = 0;
-    int64_t failed = 0;
-    int64_t nNow = GetTime();
-
     try {
         uint64_t version;
         file >> version;
@@ -4508,43 +4625,148 @@ bool LoadMempool(void)
         uint64_t num;
         file >> num;
         while (num--) {
-            CTransactionRef tx;
-            int64_t nTime;
+            TxMempoolInfo info;
             int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
+            file >> info.tx;
+            file >> info.nTime;
             file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
-            if (amountdelta) {
-                mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
+            info.nFeeDelta = 0;
+            if (nFeeDelta) {
+                mapDeltas[info.tx->GetHash()] += nFeeDelta;
             }
-            CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
-                LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, true, nullptr, nTime, nullptr, false, 0);
-                if (state.IsValid()) {
-                    ++count;
+            vinfo.push_back(info);
+        }
+        std::map<uint256, CAmount> mapOtherDeltas;
+        file >> mapOtherDeltas;
+
+        for (const auto& i : mapOtherDeltas) {
+            mapDeltas[i.first] += i.second;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+/** Number of transactions whose scripts are checked under one cs_main lock by PreverifyMempoolScripts */
+static const size_t MEMPOOL_PREVERIFY_BATCH = 1000;
+
+/**
+ * Verify the scripts of transactions about to be re-added to the mempool on
+ * the script check threads, so that the serial AcceptToMemoryPool calls that
+ * follow find their signatures in the signature cache. Failures are left for
+ * AcceptToMemoryPool to report.
+ */
+static void PreverifyMempoolScripts(const std::vector<TxMempoolInfo>& vinfo)
+{
+    if (!nScriptCheckThreads)
+        return;
+    int64_t nStart = GetTimeMicros();
+
+    // Inputs may spend outputs of other transactions being loaded.
+    std::map<uint256, const CTransaction*> mapLoading;
+    for (const TxMempoolInfo& info : vinfo) {
+        mapLoading.emplace(info.tx->GetHash(), info.tx.get());
+    }
+
+    size_t nChecked = 0;
+    for (size_t nBatch = 0; nBatch < vinfo.size(); nBatch += MEMPOOL_PREVERIFY_BATCH) {
+        if (ShutdownRequested())
+            return;
+        const size_t nBatchEnd = std::min(vinfo.size(), nBatch + MEMPOOL_PREVERIFY_BATCH);
+
+        LOCK(cs_main);
+        std::vector<PrecomputedTransactionData> txdata;
+        txdata.reserve(nBatchEnd - nBatch); // txdata must not be resized while the checks hold pointers into it
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        for (size_t i = nBatch; i < nBatchEnd; i++) {
+            const CTransaction& tx = *vinfo[i].tx;
+            std::vector<CTxOut> vSpent;
+            vSpent.reserve(tx.vin.size());
+            for (const CTxIn& txin : tx.vin) {
+                auto it = mapLoading.find(txin.prevout.hash);
+                if (it != mapLoading.end()) {
+                    if (txin.prevout.n >= it->second->vout.size())
+                        break;
+                    vSpent.push_back(it->second->vout[txin.prevout.n]);
                 } else {
-                    ++failed;
+                    const Coin& coin = pcoinsTip->AccessCoin(txin.prevout);
+                    if (coin.IsSpent())
+                        break;
+                    vSpent.push_back(coin.out);
                 }
-            } else {
-                ++skipped;
             }
-            if (ShutdownRequested())
-                return false;
+            if (vSpent.size() != tx.vin.size())
+                continue;
+
+            txdata.emplace_back(tx);
+            std::vector<CScriptCheck> vChecks;
+            vChecks.reserve(tx.vin.size());
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                vChecks.push_back(CScriptCheck(vSpent[j].scriptPubKey, vSpent[j].nValue, tx, j, STANDARD_SCRIPT_VERIFY_FLAGS, true, &txdata.back()));
+            }
+            control.Add(vChecks);
+            nChecked++;
         }
-        std::map<uint256, CAmount> mapDeltas;
-        file >> mapDeltas;
+        control.Wait();
+    }
+
+    LogPrint(BCLog::MEMPOOL, "Verified scripts of %u of %u mempool transactions on %d threads: %.2fms\n",
+             nChecked, vinfo.size(), nScriptCheckThreads, (GetTimeMicros() - nStart) * 0.001);
+}
+
+bool LoadMempool(void)
+{
+    const CChainParams& chainparams = Params();
+    int64_t nExpiryTimeout = gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
 
-        for (const auto& i : mapDeltas) {
-            mempool.PrioritiseTransaction(i.first, i.second);
+    std::vector<TxMempoolInfo> vinfo;
+    std::map<uint256, CAmount> mapDeltas;
+    const fs::path pathJournal = GetDataDir() / MEMPOOL_JOURNAL_FILENAME;
+    if (gArgs.GetBoolArg("-mempooljournal", DEFAULT_MEMPOOL_JOURNAL) && fs::exists(pathJournal)) {
+        if (!CMempoolJournal::Read(pathJournal, vinfo, mapDeltas)) {
+            LogPrintf("Failed to read mempool journal from disk. Continuing anyway.\n");
+            return false;
         }
-    } catch (const std::exception& e) {
-        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+    } else if (!ReadMempoolDump(vinfo, mapDeltas)) {
         return false;
     }
 
+    int64_t count = 0;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    int64_t nNow = GetTime();
+
+    for (const auto& i : mapDeltas) {
+        mempool.PrioritiseTransaction(i.first, i.second);
+    }
+
+    std::vector<TxMempoolInfo> vUnexpired;
+    for (const TxMempoolInfo& info : vinfo) {
+        if (info.nTime + nExpiryTimeout > nNow) {
+            vUnexpired.push_back(info);
+        } else {
+            ++skipped;
+        }
+    }
+    PreverifyMempoolScripts(vUnexpired);
+
+    for (const TxMempoolInfo& info : vUnexpired) {
+        CValidationState state;
+        {
+            LOCK(cs_main);
+            AcceptToMemoryPoolWithTime(chainparams, mempool, state, info.tx, true, nullptr, info.nTime, nullptr, false, 0);
+        }
+        if (state.IsValid()) {
+            ++count;
+        } else {
+            ++failed;
+        }
+        if (ShutdownRequested())
+            return false;
+    }
+
     LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", count, failed, skipped);
     return true;
 }
@@ -4589,6 +4811,8 @@ void DumpMempool(void)
         FileCommit(file.Get());
         file.fclose();
         RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+        // A journal left by an earlier run would otherwise be loaded instead.
+        fs::remove(GetDataDir() / MEMPOOL_JOURNAL_FILENAME);
         int64_t last = GetTimeMicros();
         LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid-start)*0.000001, (last-mid)*0.000001);
     } catch (const std::exception& e) {
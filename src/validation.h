@@ -32,6 +32,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CChainParams;
 class CCoinsViewDB;
 class CInv;
@@ -67,6 +68,10 @@ static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 /** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -mempoolclusters, whether the mempool groups transactions into linearized clusters */
+static const bool DEFAULT_MEMPOOL_CLUSTERS = false;
+/** Default for -limitclustercount, max number of transactions in a mempool cluster */
+static const unsigned int DEFAULT_CLUSTER_LIMIT = 100;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
 /** Maximum kilobytes for transactions to store for processing during reorg */
@@ -84,6 +89,15 @@ static const int MAX_SCRIPTCHECK_THREADS = 16;
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds for the adaptive number of blocks in flight from a peer whose download rate has been measured. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE = 64;
+/** How much download time (in microseconds) beyond one round trip to keep queued at each peer. */
+static const int64_t BLOCK_DOWNLOAD_QUEUE_TIME = 1 * 1000000;
+/** A block is requested from another peer once it is overdue by this factor relative to its expected arrival... */
+static const int BLOCK_REASSIGN_SLACK = 3;
+/** ...and by at least this many microseconds. */
+static const int64_t BLOCK_REASSIGN_MIN_TIME = 1 * 1000000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -399,6 +413,7 @@ void InitScriptExecutionCache();
 /** Functions for disk access for blocks */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -408,6 +423,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
+/** Check a block assembled from our own mempool on top of the current best block, with cs_main held.
+ *  Block-level rules (weight, sigops, finality, inputs, coinbase amount) are checked as in
+ *  TestBlockValidity, but scripts are only run for transactions missing from the script execution
+ *  cache, and the BIP30 check and undo data are skipped. */
+bool TestBlockTemplateValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev);
+
 /** Check whether witness commitments are required for block. */
 bool IsWitnessEnabled(const CBlockIndex* pindexPrev, const Consensus::Params& params);
 
@@ -0,0 +1,233 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/rescan.h"
+
+#include "crypto/ripemd160.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "util.h"
+
+#include <algorithm>
+
+void CWalletScanFilter::AddKey(const CKeyID& keyID)
+{
+    setIDs.insert(keyID);
+    fElementsComplete = false;
+}
+
+void CWalletScanFilter::AddKey(const CPubKey& pubkey)
+{
+    const CKeyID keyID = pubkey.GetID();
+    setIDs.insert(keyID);
+    for (const CScript& script : {GetScriptForDestination(keyID), GetScriptForRawPubKey(pubkey), GetScriptForWitness(GetScriptForDestination(keyID))}) {
+        setElements.emplace(script.begin(), script.end());
+    }
+}
+
+void CWalletScanFilter::AddScript(const CScriptID& scriptID)
+{
+    setIDs.insert(scriptID);
+    fElementsComplete = false;
+}
+
+void CWalletScanFilter::AddScript(const CScript& script)
+{
+    const CScriptID scriptID(script);
+    setIDs.insert(scriptID);
+    for (const CScript& scriptOut : {script, GetScriptForDestination(scriptID), GetScriptForWitness(script)}) {
+        setElements.emplace(scriptOut.begin(), scriptOut.end());
+    }
+}
+
+void CWalletScanFilter::AddWatchOnly(const CScript& script)
+{
+    setWatchOnly.insert(script);
+    setElements.emplace(script.begin(), script.end());
+}
+
+bool CWalletScanFilter::HaveID(const unsigned char* pch) const
+{
+    uint160 id;
+    memcpy(id.begin(), pch, id.size());
+    return setIDs.count(id) != 0;
+}
+
+bool CWalletScanFilter::IsRelevant(const CScript& scriptPubKey) const
+{
+    if (!setWatchOnly.empty() && setWatchOnly.count(scriptPubKey))
+        return true;
+
+    // Pay-to-pubkey-hash and pay-to-script-hash outputs, by far the most
+    // common, are recognized without running the solver.
+    if (scriptPubKey.size() == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 && scriptPubKey[2] == 20 &&
+        scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG) {
+        return HaveID(&scriptPubKey[3]);
+    }
+    if (scriptPubKey.IsPayToScriptHash())
+        return HaveID(&scriptPubKey[2]);
+
+    std::vector<std::vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+    switch (whichType) {
+    case TX_PUBKEY:
+        return setIDs.count(CPubKey(vSolutions[0]).GetID()) != 0;
+    case TX_WITNESS_V0_KEYHASH:
+        return HaveID(vSolutions[0].data());
+    case TX_WITNESS_V0_SCRIPTHASH: {
+        uint160 hash;
+        CRIPEMD160().Write(vSolutions[0].data(), vSolutions[0].size()).Finalize(hash.begin());
+        return setIDs.count(hash) != 0;
+    }
+    case TX_MULTISIG:
+        for (size_t i = 1; i + 1 < vSolutions.size(); i++) {
+            if (setIDs.count(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool CWalletScanFilter::IsRelevant(const CTransaction& tx) const
+{
+    for (const CTxOut& txout : tx.vout) {
+        if (IsRelevant(txout.scriptPubKey))
+            return true;
+    }
+    return false;
+}
+
+bool CWalletScanFilter::MayMatch(const BlockFilter& blockFilter) const
+{
+    return !fElementsComplete || blockFilter.GetFilter().MatchAny(setElements);
+}
+
+CRescanPipeline::CRescanPipeline(std::vector<CBlockIndex*> vIndexIn, std::shared_ptr<const CWalletScanFilter> filterIn, int nThreads, ReadBlockFn readBlockIn, LookupFilterFn lookupFilterIn)
+    : vIndex(std::move(vIndexIn)), readBlock(std::move(readBlockIn)), lookupFilter(std::move(lookupFilterIn)), filter(std::move(filterIn)),
+      vSlots(RESCAN_READ_AHEAD), vReady(RESCAN_READ_AHEAD, false), nNextRead(0), nNextResult(0), fInterrupted(false)
+{
+    nThreads = std::min<size_t>(nThreads, vIndex.size());
+    for (int i = 0; i < nThreads; i++) {
+        vThreads.emplace_back(&TraceThread<std::function<void()> >, "rescan", std::function<void()>(std::bind(&CRescanPipeline::ThreadRead, this)));
+    }
+}
+
+CRescanPipeline::~CRescanPipeline()
+{
+    Interrupt();
+    for (std::thread& thread : vThreads) {
+        thread.join();
+    }
+}
+
+void CRescanPipeline::Interrupt()
+{
+    std::lock_guard<std::mutex> lock(cs);
+    fInterrupted = true;
+    condSpace.notify_all();
+    condReady.notify_all();
+}
+
+void CRescanPipeline::SetFilter(std::shared_ptr<const CWalletScanFilter> filterIn)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    filter = std::move(filterIn);
+}
+
+void CRescanPipeline::Match(CRescanBlock& result)
+{
+    result.vMatches.clear();
+    for (size_t i = 0; i < result.block.vtx.size(); i++) {
+        if (result.filter->IsRelevant(*result.block.vtx[i]))
+            result.vMatches.push_back(i);
+    }
+}
+
+void CRescanPipeline::Load(CRescanBlock& result) const
+{
+    result.block.SetNull();
+    result.vMatches.clear();
+    result.fSkipped = result.fHaveBlockFilter && !result.filter->MayMatch(result.blockFilter);
+    if (result.fSkipped) {
+        result.fRead = true;
+        return;
+    }
+    result.fRead = readBlock(result.block, result.pindex);
+    Match(result);
+}
+
+void CRescanPipeline::Process(size_t nPos, CRescanBlock& result) const
+{
+    result.pindex = vIndex[nPos];
+    result.fHaveBlockFilter = lookupFilter && lookupFilter(result.blockFilter, result.pindex);
+    Load(result);
+}
+
+void CRescanPipeline::ThreadRead()
+{
+    std::unique_lock<std::mutex> lock(cs);
+    while (true) {
+        condSpace.wait(lock, [this] { return fInterrupted || nNextRead >= vIndex.size() || nNextRead < nNextResult + RESCAN_READ_AHEAD; });
+        if (fInterrupted || nNextRead >= vIndex.size())
+            return;
+        const size_t nPos = nNextRead++;
+        CRescanBlock result;
+        result.filter = filter;
+        lock.unlock();
+
+        Process(nPos, result);
+
+        lock.lock();
+        vSlots[nPos % RESCAN_READ_AHEAD] = std::move(result);
+        vReady[nPos % RESCAN_READ_AHEAD] = true;
+        condReady.notify_all();
+    }
+}
+
+bool CRescanPipeline::Next(CRescanBlock& result)
+{
+    std::unique_lock<std::mutex> lock(cs);
+    if (fInterrupted || nNextResult >= vIndex.size())
+        return false;
+    if (vThreads.empty()) {
+        const size_t nPos = nNextResult++;
+        result.filter = filter;
+        lock.unlock();
+        Process(nPos, result);
+        return true;
+    }
+
+    condReady.wait(lock, [this] { return fInterrupted || vReady[nNextResult % RESCAN_READ_AHEAD]; });
+    if (fInterrupted)
+        return false;
+    result = std::move(vSlots[nNextResult % RESCAN_READ_AHEAD]);
+    vReady[nNextResult % RESCAN_READ_AHEAD] = false;
+    nNextResult++;
+    condSpace.notify_all();
+    const bool fStale = result.filter != filter;
+    if (fStale)
+        result.filter = filter;
+    lock.unlock();
+
+    if (fStale) {
+        // A skipped block may match the new filter, and then has to be read
+        if (result.fSkipped)
+            Load(result);
+        else
+            Match(result);
+    }
+    return true;
+}
+
+int GetRescanThreads()
+{
+    int nThreads = gArgs.GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    return std::max(0, std::min(nThreads, MAX_RESCAN_THREADS));
+}
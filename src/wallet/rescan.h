@@ -0,0 +1,160 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_RESCAN_H
+#define BITCOIN_WALLET_RESCAN_H
+
+#include "blockfilter.h"
+#include "crypto/common.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+class CBlockIndex;
+class CKeyID;
+class CPubKey;
+class CScriptID;
+
+/** Default for -rescanthreads, the number of threads reading and matching blocks during a rescan (0 = one per core) */
+static const int DEFAULT_RESCAN_THREADS = 0;
+/** Maximum number of rescan threads */
+static const int MAX_RESCAN_THREADS = 16;
+/** Number of blocks the rescan threads may read ahead of the block being applied to the wallet */
+static const size_t RESCAN_READ_AHEAD = 64;
+
+/**
+ * Snapshot of the keys and scripts of a wallet, for telling which outputs
+ * might be the wallet's without taking its locks.
+ *
+ * This over-approximates IsMine(): every output IsMine() accepts is relevant,
+ * but so is, for example, a multisig output with only some of its keys in the
+ * wallet. Relevant transactions still have to be checked against the wallet.
+ *
+ * Keys and scripts added with their public key or script also give the
+ * output scripts they can be paid to, which are tested against block filters
+ * to skip blocks without reading them. Adding a bare ID makes every block
+ * filter match.
+ */
+class CWalletScanFilter
+{
+public:
+    CWalletScanFilter() : fElementsComplete(true) {}
+
+    void AddKey(const CKeyID& keyID);
+    void AddKey(const CPubKey& pubkey);
+    void AddScript(const CScriptID& scriptID);
+    void AddScript(const CScript& script);
+    void AddWatchOnly(const CScript& script);
+
+    /** Whether an output with this script might belong to the wallet */
+    bool IsRelevant(const CScript& scriptPubKey) const;
+    /** Whether any output of a transaction might belong to the wallet */
+    bool IsRelevant(const CTransaction& tx) const;
+    /**
+     * Whether a block with this filter might pay to or spend from the
+     * wallet. Bare multisig outputs are only found if their script was added.
+     */
+    bool MayMatch(const BlockFilter& blockFilter) const;
+
+private:
+    struct IDHasher
+    {
+        size_t operator()(const uint160& id) const { return ReadLE64(id.begin()); }
+    };
+
+    //! Key and script IDs; a key ID is the hash of a public key, a script ID that of a redeem script
+    std::unordered_set<uint160, IDHasher> setIDs;
+    std::set<CScript> setWatchOnly;
+    //! Output scripts to test block filters with
+    GCSFilter::ElementSet setElements;
+    //! False if an ID was added without the scripts paying to it
+    bool fElementsComplete;
+
+    bool HaveID(const unsigned char* pch) const;
+};
+
+/** A block read and matched by a CRescanPipeline */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    //! False if the block could not be read from disk
+    bool fRead;
+    CBlock block;
+    //! Positions of the transactions with an output relevant to the filter
+    std::vector<size_t> vMatches;
+    //! Filter the matches were made with
+    std::shared_ptr<const CWalletScanFilter> filter;
+    //! True if the block filter ruled the block out, in which case it was not read
+    bool fSkipped;
+    //! Whether blockFilter holds the block's filter
+    bool fHaveBlockFilter;
+    BlockFilter blockFilter;
+
+    CRescanBlock() : pindex(nullptr), fRead(false), fSkipped(false), fHaveBlockFilter(false) {}
+};
+
+/**
+ * Reads a run of blocks and matches their transactions against a
+ * CWalletScanFilter on worker threads, and hands the results to a single
+ * consumer in chain order. Workers stay at most RESCAN_READ_AHEAD blocks
+ * ahead of the consumer. With no worker threads blocks are read and matched
+ * by Next() itself.
+ *
+ * If a block filter lookup is given, blocks whose filter does not match the
+ * CWalletScanFilter are skipped without being read.
+ */
+class CRescanPipeline
+{
+public:
+    typedef std::function<bool(CBlock&, const CBlockIndex*)> ReadBlockFn;
+    typedef std::function<bool(BlockFilter&, const CBlockIndex*)> LookupFilterFn;
+
+    CRescanPipeline(std::vector<CBlockIndex*> vIndexIn, std::shared_ptr<const CWalletScanFilter> filterIn, int nThreads, ReadBlockFn readBlockIn, LookupFilterFn lookupFilterIn = LookupFilterFn());
+    ~CRescanPipeline();
+
+    /** Wait for the next block in order. Returns false once every block has been returned or after Interrupt(). */
+    bool Next(CRescanBlock& result);
+    /** Use a new filter for blocks not returned yet; those already matched with the old one are matched again by Next() */
+    void SetFilter(std::shared_ptr<const CWalletScanFilter> filterIn);
+    /** Stop the workers without waiting for the remaining blocks */
+    void Interrupt();
+
+private:
+    const std::vector<CBlockIndex*> vIndex;
+    const ReadBlockFn readBlock;
+    const LookupFilterFn lookupFilter;
+
+    std::mutex cs;
+    std::condition_variable condReady;
+    std::condition_variable condSpace;
+    std::shared_ptr<const CWalletScanFilter> filter;
+    //! Slot i % RESCAN_READ_AHEAD holds block i once it is ready
+    std::vector<CRescanBlock> vSlots;
+    std::vector<bool> vReady;
+    size_t nNextRead;
+    size_t nNextResult;
+    bool fInterrupted;
+
+    std::vector<std::thread> vThreads;
+
+    static void Match(CRescanBlock& result);
+    /** Read and match a block, unless its filter rules it out */
+    void Load(CRescanBlock& result) const;
+    void Process(size_t nPos, CRescanBlock& result) const;
+    void ThreadRead();
+};
+
+/** Number of rescan threads, from -rescanthreads */
+int GetRescanThreads();
+
+#endif // BITCOIN_WALLET_RESCAN_H
@@ -0,0 +1,240 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/rescan.h"
+
+#include "chain.h"
+#include "coins.h"
+#include "key.h"
+#include "keystore.h"
+#include "script/ismine.h"
+#include "script/standard.h"
+#include "undo.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(rescan_tests, BasicTestingSetup)
+
+static CTransactionRef MakeTx(const std::vector<CScript>& vScripts, uint32_t nLockTime)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.nLockTime = nLockTime;
+    for (const CScript& script : vScripts) {
+        tx.vout.emplace_back(COIN, script);
+    }
+    return MakeTransactionRef(tx);
+}
+
+BOOST_AUTO_TEST_CASE(rescan_filter)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    const CPubKey pubkey = key.GetPubKey();
+    const CPubKey pubkeyOther = keyOther.GetPubKey();
+
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    const CScript redeemScript = GetScriptForMultisig(1, {pubkey});
+    const CScript witnessKeyScript = GetScriptForWitness(GetScriptForDestination(pubkey.GetID()));
+    const CScript witnessScriptScript = GetScriptForWitness(redeemScript);
+    keystore.AddCScript(redeemScript);
+    keystore.AddCScript(witnessKeyScript);
+    keystore.AddCScript(witnessScriptScript);
+    const CScript watchScript = CScript() << OP_RETURN << std::vector<unsigned char>(4, 0x42);
+    keystore.AddWatchOnly(watchScript);
+
+    CWalletScanFilter filter;
+    std::set<CKeyID> setKeys;
+    keystore.GetKeys(setKeys);
+    for (const CKeyID& keyID : setKeys) {
+        filter.AddKey(keyID);
+    }
+    for (const CScript& script : {redeemScript, witnessKeyScript, witnessScriptScript}) {
+        filter.AddScript(CScriptID(script));
+    }
+    filter.AddWatchOnly(watchScript);
+
+    // Everything IsMine() accepts is relevant
+    const std::vector<CScript> vMine = {
+        GetScriptForDestination(pubkey.GetID()),
+        GetScriptForRawPubKey(pubkey),
+        GetScriptForDestination(CScriptID(redeemScript)),
+        GetScriptForDestination(CScriptID(witnessKeyScript)),
+        witnessKeyScript,
+        witnessScriptScript,
+        redeemScript,
+        watchScript,
+    };
+    for (const CScript& script : vMine) {
+        BOOST_CHECK(IsMine(keystore, script) != ISMINE_NO);
+        BOOST_CHECK(filter.IsRelevant(script));
+    }
+
+    // A multisig output with only one of our keys is relevant though not ours
+    const CScript multisigOther = GetScriptForMultisig(2, {pubkey, pubkeyOther});
+    BOOST_CHECK(IsMine(keystore, multisigOther) == ISMINE_NO);
+    BOOST_CHECK(filter.IsRelevant(multisigOther));
+
+    const std::vector<CScript> vOther = {
+        GetScriptForDestination(pubkeyOther.GetID()),
+        GetScriptForRawPubKey(pubkeyOther),
+        GetScriptForDestination(CScriptID(GetScriptForDestination(pubkeyOther.GetID()))),
+        GetScriptForWitness(GetScriptForDestination(pubkeyOther.GetID())),
+        GetScriptForMultisig(1, {pubkeyOther}),
+        CScript() << OP_RETURN,
+        CScript(),
+    };
+    for (const CScript& script : vOther) {
+        BOOST_CHECK(!filter.IsRelevant(script));
+    }
+
+    BOOST_CHECK(filter.IsRelevant(*MakeTx({vOther[0], vMine[0]}, 0)));
+    BOOST_CHECK(!filter.IsRelevant(*MakeTx(vOther, 0)));
+
+    // Given the public key and scripts, block filters of blocks paying to
+    // the wallet match, and others do not
+    CWalletScanFilter filterScripts;
+    filterScripts.AddKey(pubkey);
+    for (const CScript& script : {redeemScript, witnessKeyScript, witnessScriptScript}) {
+        filterScripts.AddScript(script);
+    }
+    filterScripts.AddWatchOnly(watchScript);
+    for (const CScript& script : vMine) {
+        CBlock block;
+        block.vtx.push_back(MakeTx({vOther[0], script}, 0));
+        // OP_RETURN outputs are left out of block filters
+        BOOST_CHECK_EQUAL(filterScripts.MayMatch(BlockFilter(BLOCK_FILTER_BASIC, block, CBlockUndo())), script != watchScript);
+    }
+    CBlock blockOther;
+    blockOther.vtx.push_back(MakeTx(vOther, 0));
+    BOOST_CHECK(!filterScripts.MayMatch(BlockFilter(BLOCK_FILTER_BASIC, blockOther, CBlockUndo())));
+}
+
+BOOST_AUTO_TEST_CASE(rescan_pipeline)
+{
+    CKey key, keyLater;
+    key.MakeNewKey(true);
+    keyLater.MakeNewKey(true);
+    const CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    const CScript scriptLater = GetScriptForDestination(keyLater.GetPubKey().GetID());
+    const CScript scriptOther = CScript() << OP_TRUE;
+
+    // Every 7th transaction pays the first key, every 5th the second one,
+    // which the filter only learns about partway through.
+    const int nBlocks = 3 * RESCAN_READ_AHEAD + 5;
+    std::vector<std::unique_ptr<CBlockIndex> > vIndexOwned;
+    std::vector<CBlockIndex*> vIndex;
+    std::map<const CBlockIndex*, CBlock> mapBlocks;
+    uint32_t nTx = 0;
+    for (int nHeight = 0; nHeight < nBlocks; nHeight++) {
+        vIndexOwned.emplace_back(new CBlockIndex);
+        vIndexOwned.back()->nHeight = nHeight;
+        vIndex.push_back(vIndexOwned.back().get());
+        CBlock& block = mapBlocks[vIndex.back()];
+        for (int i = 0; i < nHeight % 4; i++, nTx++) {
+            block.vtx.push_back(MakeTx({scriptOther, nTx % 7 == 0 ? scriptMine : nTx % 5 == 0 ? scriptLater : scriptOther}, nTx));
+        }
+    }
+    auto readBlock = [&mapBlocks](CBlock& block, const CBlockIndex* pindex) {
+        if (pindex->nHeight % 50 == 3)
+            return false;
+        block = mapBlocks.at(pindex);
+        return true;
+    };
+
+    std::shared_ptr<CWalletScanFilter> filter = std::make_shared<CWalletScanFilter>();
+    filter->AddKey(key.GetPubKey().GetID());
+    std::shared_ptr<CWalletScanFilter> filterLater = std::make_shared<CWalletScanFilter>(*filter);
+    filterLater->AddKey(keyLater.GetPubKey().GetID());
+    const int nSwitchHeight = RESCAN_READ_AHEAD + 10;
+
+    for (int nThreads : {0, 1, 4}) {
+        CRescanPipeline pipeline(vIndex, filter, nThreads, readBlock);
+        CRescanBlock item;
+        int nHeight = 0;
+        while (pipeline.Next(item)) {
+            BOOST_CHECK_EQUAL(item.pindex, vIndex[nHeight]);
+            BOOST_CHECK_EQUAL(item.fRead, nHeight % 50 != 3);
+            std::vector<size_t> vExpected;
+            if (item.fRead) {
+                const CBlock& block = mapBlocks.at(item.pindex);
+                BOOST_CHECK(item.block.vtx == block.vtx);
+                for (size_t i = 0; i < block.vtx.size(); i++) {
+                    const CScript& script = block.vtx[i]->vout[1].scriptPubKey;
+                    if (script == scriptMine || (nHeight > nSwitchHeight && script == scriptLater))
+                        vExpected.push_back(i);
+                }
+            }
+            BOOST_CHECK(item.vMatches == vExpected);
+            if (nHeight == nSwitchHeight) {
+                // Blocks read ahead with the old filter are matched again
+                pipeline.SetFilter(filterLater);
+            }
+            nHeight++;
+        }
+        BOOST_CHECK_EQUAL(nHeight, nBlocks);
+    }
+
+    // With block filters, blocks without a match are skipped unread, and
+    // skipped blocks matching a newer filter are read after all
+    auto lookupFilter = [&mapBlocks](BlockFilter& blockFilter, const CBlockIndex* pindex) {
+        if (pindex->nHeight % 10 == 9)
+            return false;
+        blockFilter = BlockFilter(BLOCK_FILTER_BASIC, mapBlocks.at(pindex), CBlockUndo());
+        return true;
+    };
+    std::shared_ptr<CWalletScanFilter> filterKeys = std::make_shared<CWalletScanFilter>();
+    filterKeys->AddKey(key.GetPubKey());
+    std::shared_ptr<CWalletScanFilter> filterKeysLater = std::make_shared<CWalletScanFilter>(*filterKeys);
+    filterKeysLater->AddKey(keyLater.GetPubKey());
+    for (int nThreads : {0, 3}) {
+        CRescanPipeline pipeline(vIndex, filterKeys, nThreads, readBlock, lookupFilter);
+        CRescanBlock item;
+        int nHeight = 0, nSkipped = 0;
+        while (pipeline.Next(item)) {
+            const CBlock& block = mapBlocks.at(item.pindex);
+            bool fMatch = false;
+            for (const CTransactionRef& tx : block.vtx) {
+                const CScript& script = tx->vout[1].scriptPubKey;
+                fMatch |= script == scriptMine || (nHeight > nSwitchHeight && script == scriptLater);
+            }
+            BOOST_CHECK_EQUAL(item.fSkipped, !fMatch && nHeight % 10 != 9);
+            if (item.fSkipped) {
+                nSkipped++;
+                BOOST_CHECK(item.fRead);
+                BOOST_CHECK(item.block.vtx.empty());
+                BOOST_CHECK(item.vMatches.empty());
+            } else {
+                BOOST_CHECK_EQUAL(item.fRead, nHeight % 50 != 3);
+            }
+            if (nHeight == nSwitchHeight)
+                pipeline.SetFilter(filterKeysLater);
+            nHeight++;
+        }
+        BOOST_CHECK_EQUAL(nHeight, nBlocks);
+        BOOST_CHECK(nSkipped > 0);
+    }
+
+    // Without the scripts of a key, no block can be ruled out
+    CBlock blockEmpty;
+    const BlockFilter blockFilterEmpty(BLOCK_FILTER_BASIC, blockEmpty, CBlockUndo());
+    BOOST_CHECK(!filterKeys->MayMatch(blockFilterEmpty));
+    BOOST_CHECK(filter->MayMatch(blockFilterEmpty));
+
+    // An interrupted pipeline stops handing out blocks
+    CRescanPipeline pipeline(vIndex, filter, 2, readBlock);
+    CRescanBlock item;
+    BOOST_CHECK(pipeline.Next(item));
+    pipeline.Interrupt();
+    BOOST_CHECK(!pipeline.Next(item));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include <utility>
 #include <vector>
 
+#include "chainparams.h"
 #include "consensus/validation.h"
 #include "rpc/server.h"
 #include "test/test_bitcoin.h"
@@ -681,4 +682,74 @@ BOOST_FIXTURE_TEST_CASE(ListCoins, ListCoinsTestingSetup)
     BOOST_CHECK_EQUAL(list.begin()->second.size(), 2);
 }
 
+// Compare the wallet's indexed balances and coins with those found by walking
+// every wallet transaction.
+static void CheckBalanceIndex(const CWallet& wallet)
+{
+    CAmount nBalance = 0, nUnconfirmed = 0, nImmature = 0;
+    std::set<COutPoint> setCoins;
+    for (const auto& entry : wallet.mapWallet) {
+        const CWalletTx& wtx = entry.second;
+        const int nDepth = wtx.GetDepthInMainChain();
+        if (wtx.IsTrusted())
+            nBalance += wtx.GetAvailableCredit(false);
+        else if (nDepth == 0 && wtx.InMempool())
+            nUnconfirmed += wtx.GetAvailableCredit(false);
+        nImmature += wtx.GetImmatureCredit(false);
+
+        if (nDepth < 0 || wtx.GetBlocksToMaturity() > 0 || !wtx.IsTrusted() || (nDepth == 0 && !wtx.InMempool()))
+            continue;
+        for (unsigned int i = 0; i < wtx.tx->vout.size(); i++) {
+            if (!wallet.IsSpent(entry.first, i) && wallet.IsMine(wtx.tx->vout[i]) != ISMINE_NO)
+                setCoins.insert(COutPoint(entry.first, i));
+        }
+    }
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), nUnconfirmed);
+    BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), nImmature);
+
+    std::vector<COutput> vCoins;
+    wallet.AvailableCoins(vCoins);
+    std::set<COutPoint> setAvailable;
+    for (const COutput& coin : vCoins) {
+        BOOST_CHECK_EQUAL(coin.nDepth, coin.tx->GetDepthInMainChain());
+        setAvailable.insert(COutPoint(coin.tx->GetHash(), coin.i));
+    }
+    BOOST_CHECK_EQUAL(vCoins.size(), setAvailable.size());
+    BOOST_CHECK(setAvailable == setCoins);
+}
+
+BOOST_FIXTURE_TEST_CASE(balance_index, ListCoinsTestingSetup)
+{
+    LOCK2(cs_main, wallet->cs_wallet);
+    CheckBalanceIndex(*wallet);
+    const CAmount nBalance = wallet->GetBalance();
+    BOOST_CHECK(wallet->GetImmatureBalance() > 0);
+
+    // A spend and its change, and a coinbase maturing with the block
+    const uint256 hashSpend = AddTx(CRecipient{GetScriptForRawPubKey({}), static_cast<CAmount>(0.5 * COIN), false /* subtract fee */}).GetHash();
+    CheckBalanceIndex(*wallet);
+    BOOST_CHECK(wallet->GetBalance() > nBalance);
+
+    // Disconnecting the block, without the wallet being told, takes the
+    // spend back to the mempool and the coinbase back to immature
+    CBlockIndex* pindexSpend = chainActive.Tip();
+    CValidationState state;
+    BOOST_CHECK(InvalidateBlock(state, Params(), pindexSpend));
+    BOOST_CHECK_EQUAL(wallet->mapWallet.at(hashSpend).GetDepthInMainChain(), 0);
+    CheckBalanceIndex(*wallet);
+
+    // And reconnecting it restores the balances
+    ResetBlockFailureFlags(pindexSpend);
+    BOOST_CHECK(ActivateBestChain(state, Params()));
+    BOOST_CHECK(chainActive.Tip() == pindexSpend);
+    CheckBalanceIndex(*wallet);
+
+    // Rebuilding the index from scratch gives the same result
+    const CAmount nBalanceIndexed = wallet->GetBalance();
+    wallet->MarkDirty();
+    BOOST_CHECK_EQUAL(wallet->GetBalance(), nBalanceIndexed);
+    CheckBalanceIndex(*wallet);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,9 +6,11 @@
 #include "wallet/wallet.h"
 
 #include "base58.h"
+#include "blockfilterindex.h"
 #include "checkpoints.h"
 #include "chain.h"
 #include "wallet/coincontrol.h"
+#include "wallet/rescan.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
 #include "fs.h"
@@ -17,6 +19,7 @@
 #include "keystore.h"
 #include "validation.h"
 #include "net.h"
+#include "net_processing.h"
 #include "policy/fees.h"
 #include "policy/policy.h"
 #include "policy/rbf.h"
@@ -888,8 +891,167 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
-        for (std::pair<const uint256, CWalletTx>& item : mapWallet)
+        // Whatever changed may affect any transaction, so rebuild the balance
+        // index from scratch; this also drops transactions no longer in mapWallet.
+        balances = BalanceIndex();
+        for (std::pair<const uint256, CWalletTx>& item : mapWallet) {
+            item.second.nBalanceState = CWalletTx::BALANCE_UNKNOWN;
             item.second.MarkDirty();
+        }
+    }
+}
+
+void CWallet::MarkBalanceDirty(const uint256& hash) const
+{
+    AssertLockHeld(cs_wallet);
+    balances.setDirty.insert(hash);
+}
+
+static void EraseFromMultimap(std::multimap<int, uint256>& map, int nKey, const uint256& hash)
+{
+    std::pair<std::multimap<int, uint256>::iterator, std::multimap<int, uint256>::iterator> range = map.equal_range(nKey);
+    for (std::multimap<int, uint256>::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == hash) {
+            map.erase(it);
+            return;
+        }
+    }
+}
+
+void CWallet::ForgetBalance(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_wallet);
+    const uint256& hash = wtx.GetHash();
+    switch (wtx.nBalanceState) {
+    case CWalletTx::BALANCE_CONFIRMED:
+    case CWalletTx::BALANCE_IMMATURE:
+        if (wtx.nBalanceState == CWalletTx::BALANCE_CONFIRMED) {
+            balances.nConfirmedCredit -= wtx.nBalanceCredit;
+            balances.nConfirmedWatchCredit -= wtx.nBalanceWatchCredit;
+            balances.setAvailable.erase(hash);
+        } else {
+            balances.nImmatureCredit -= wtx.nBalanceCredit;
+            balances.nImmatureWatchCredit -= wtx.nBalanceWatchCredit;
+        }
+        EraseFromMultimap(balances.mapHeight, wtx.nBalanceHeight, hash);
+        if (wtx.IsCoinBase())
+            EraseFromMultimap(balances.mapMaturity, wtx.nBalanceHeight + Params().GetConsensus().GetCoinbaseMaturity(wtx.nBalanceHeight), hash);
+        break;
+    case CWalletTx::BALANCE_UNCONFIRMED:
+        balances.setUnconfirmed.erase(hash);
+        balances.setAvailable.erase(hash);
+        break;
+    case CWalletTx::BALANCE_INACTIVE:
+        balances.setInactive.erase(hash);
+        break;
+    case CWalletTx::BALANCE_UNKNOWN:
+        break;
+    }
+    wtx.nBalanceState = CWalletTx::BALANCE_UNKNOWN;
+    wtx.nBalanceHeight = -1;
+    wtx.nBalanceCredit = 0;
+    wtx.nBalanceWatchCredit = 0;
+    wtx.vBalanceOutputs.clear();
+}
+
+void CWallet::UpdateBalances() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    const int nTipHeight = chainActive.Height();
+    if (balances.pindexTip != pindexTip) {
+        if (balances.pindexTip != nullptr) {
+            const int nPrevHeight = balances.pindexTip->nHeight;
+            const CBlockIndex* pindexFork = chainActive.FindFork(balances.pindexTip);
+            if (pindexFork != balances.pindexTip) {
+                // Blocks were disconnected: transactions confirmed above the
+                // fork may have left the chain, and conflicts may have gone away.
+                const int nForkHeight = pindexFork ? pindexFork->nHeight : -1;
+                for (std::multimap<int, uint256>::const_iterator it = balances.mapHeight.upper_bound(nForkHeight); it != balances.mapHeight.end(); ++it)
+                    balances.setDirty.insert(it->second);
+                balances.setDirty.insert(balances.setInactive.begin(), balances.setInactive.end());
+            }
+            // Coinbases maturing, or no longer mature, at the new height
+            std::multimap<int, uint256>::const_iterator it = balances.mapMaturity.upper_bound(std::min(nPrevHeight, nTipHeight));
+            std::multimap<int, uint256>::const_iterator itEnd = balances.mapMaturity.upper_bound(std::max(nPrevHeight, nTipHeight));
+            for (; it != itEnd; ++it)
+                balances.setDirty.insert(it->second);
+        }
+        // Unconfirmed transactions may have been mined without us being told
+        balances.setDirty.insert(balances.setUnconfirmed.begin(), balances.setUnconfirmed.end());
+        balances.pindexTip = pindexTip;
+    }
+
+    while (!balances.setDirty.empty()) {
+        const uint256 hash = *balances.setDirty.begin();
+        balances.setDirty.erase(balances.setDirty.begin());
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = mi->second;
+
+        const bool fNew = wtx.nBalanceState == CWalletTx::BALANCE_UNKNOWN;
+        const bool fSpendsBefore = wtx.fBalanceSpends;
+        ForgetBalance(wtx);
+
+        const CBlockIndex* pindex = nullptr;
+        const int nDepth = wtx.GetDepthInMainChain(pindex);
+        // Matches the spender test in IsSpent
+        wtx.fBalanceSpends = nDepth > 0 || (nDepth == 0 && !wtx.isAbandoned());
+        if (nDepth < 0 || (nDepth == 0 && wtx.IsCoinBase())) {
+            wtx.nBalanceState = CWalletTx::BALANCE_INACTIVE;
+            balances.setInactive.insert(hash);
+        } else if (nDepth == 0) {
+            wtx.nBalanceState = CWalletTx::BALANCE_UNCONFIRMED;
+            balances.setUnconfirmed.insert(hash);
+            balances.setAvailable.insert(hash);
+        } else {
+            wtx.nBalanceHeight = pindex->nHeight;
+            balances.mapHeight.emplace(wtx.nBalanceHeight, hash);
+            bool fImmature = false;
+            if (wtx.IsCoinBase()) {
+                const int nMaturityHeight = wtx.nBalanceHeight + Params().GetConsensus().GetCoinbaseMaturity(wtx.nBalanceHeight);
+                balances.mapMaturity.emplace(nMaturityHeight, hash);
+                fImmature = nTipHeight < nMaturityHeight;
+            }
+            if (fImmature) {
+                wtx.nBalanceState = CWalletTx::BALANCE_IMMATURE;
+                wtx.nBalanceCredit = GetCredit(*wtx.tx, ISMINE_SPENDABLE);
+                wtx.nBalanceWatchCredit = GetCredit(*wtx.tx, ISMINE_WATCH_ONLY);
+                balances.nImmatureCredit += wtx.nBalanceCredit;
+                balances.nImmatureWatchCredit += wtx.nBalanceWatchCredit;
+            } else {
+                wtx.nBalanceState = CWalletTx::BALANCE_CONFIRMED;
+                for (unsigned int i = 0; i < wtx.tx->vout.size(); i++) {
+                    if (IsSpent(hash, i))
+                        continue;
+                    const CTxOut& txout = wtx.tx->vout[i];
+                    const isminetype mine = IsMine(txout);
+                    if (mine == ISMINE_NO)
+                        continue;
+                    wtx.vBalanceOutputs.emplace_back(i, mine);
+                    wtx.nBalanceCredit += GetCredit(txout, ISMINE_SPENDABLE);
+                    wtx.nBalanceWatchCredit += GetCredit(txout, ISMINE_WATCH_ONLY);
+                    if (!MoneyRange(wtx.nBalanceCredit) || !MoneyRange(wtx.nBalanceWatchCredit))
+                        throw std::runtime_error(std::string(__func__) + " : value out of range");
+                }
+                balances.nConfirmedCredit += wtx.nBalanceCredit;
+                balances.nConfirmedWatchCredit += wtx.nBalanceWatchCredit;
+                if (!wtx.vBalanceOutputs.empty())
+                    balances.setAvailable.insert(hash);
+            }
+        }
+
+        // Whether this counts as spending its inputs changed, so the
+        // outputs available from its parents did too
+        if ((fNew || wtx.fBalanceSpends != fSpendsBefore) && !wtx.IsCoinBase()) {
+            for (const CTxIn& txin : wtx.tx->vin) {
+                if (mapWallet.count(txin.prevout.hash))
+                    balances.setDirty.insert(txin.prevout.hash);
+            }
+        }
     }
 }
 
@@ -937,6 +1099,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
     bool fInsertedNew = ret.second;
     if (fInsertedNew)
     {
+        // A copy of a transaction once in the wallet brings its old balance state
+        wtx.nBalanceState = CWalletTx::BALANCE_UNKNOWN;
         wtx.nTimeReceived = GetAdjustedTime();
         wtx.nOrderPos = IncOrderPosNext(&walletdb);
         wtxOrdered.insert(std::make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
@@ -1010,8 +1174,12 @@ bool CWallet::LoadToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
 
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end())
+        ForgetBalance(mi->second);
     mapWallet[hash] = wtxIn;
     CWalletTx& wtx = mapWallet[hash];
+    wtx.nBalanceState = CWalletTx::BALANCE_UNKNOWN;
     wtx.BindWallet(this);
     wtxOrdered.insert(std::make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
     AddToSpends(hash);
@@ -1241,6 +1409,7 @@ void CWallet::SyncTransaction(const CTransactionRef& ptx, const CBlockIndex *pin
 void CWallet::TransactionAddedToMempool(const CTransactionRef& ptx) {
     LOCK2(cs_main, cs_wallet);
     SyncTransaction(ptx);
+    UpdateBalances();
 }
 
 void CWallet::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex *pindex, const std::vector<CTransactionRef>& vtxConflicted) {
@@ -1259,6 +1428,7 @@ void CWallet::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const
     for (size_t i = 0; i < pblock->vtx.size(); i++) {
         SyncTransaction(pblock->vtx[i], pindex, i);
     }
+    UpdateBalances();
 }
 
 void CWallet::BlockDisconnected(const std::shared_ptr<const CBlock>& pblock) {
@@ -1267,6 +1437,7 @@ void CWallet::BlockDisconnected(const std::shared_ptr<const CBlock>& pblock) {
     for (const CTransactionRef& ptx : pblock->vtx) {
         SyncTransaction(ptx);
     }
+    UpdateBalances();
 }
 
 
@@ -1608,6 +1779,12 @@ int64_t CWallet::RescanFromTime(int64_t startTime, bool update)
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  *
+ * Blocks are read and their outputs matched against a snapshot of the
+ * wallet's keys on -rescanthreads threads; cs_main and cs_wallet are only
+ * taken to apply each block's candidate transactions, in chain order.
+ * With -blockfilterindex, blocks whose filter matches none of the wallet's
+ * scripts are skipped without being read.
+ *
  * Returns null if scan was successful. Otherwise, if a complete rescan was not
  * possible (due to pruning or corruption), returns pointer to the most recent
  * block that could not be scanned.
@@ -1615,47 +1792,150 @@ int64_t CWallet::RescanFromTime(int64_t startTime, bool update)
 CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int64_t nNow = GetTime();
+    const int64_t nTimeStart = GetTimeMicros();
     const CChainParams& chainParams = Params();
+    const int nThreads = GetRescanThreads();
 
     CBlockIndex* pindex = pindexStart;
     CBlockIndex* ret = nullptr;
-    {
-        LOCK2(cs_main, cs_wallet);
-        fAbortRescan = false;
-        fScanningWallet = true;
+    fAbortRescan = false;
+    fScanningWallet = true;
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
-        double dProgressTip = GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
-        while (pindex && !fAbortRescan)
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    double dProgressStart, dProgressTip;
+    {
+        LOCK(cs_main);
+        dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
+        dProgressTip = GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
+    }
+    uint64_t nBlocks = 0, nSkipped = 0, nTransactions = 0, nCandidates = 0;
+    int64_t nBlocksAtLastLog = 0;
+    while (pindex && !fAbortRescan)
+    {
+        // Blocks are read and matched against the wallet's keys on the
+        // pipeline's threads; only applying the candidates takes the locks.
+        // Blocks connected meanwhile are picked up by the next pass.
+        std::vector<CBlockIndex*> vIndex;
+        {
+            LOCK(cs_main);
+            for (CBlockIndex* pindexNext = pindex; pindexNext; pindexNext = chainActive.Next(pindexNext)) {
+                vIndex.push_back(pindexNext);
+            }
+        }
+        if (vIndex.empty())
+            break;
+        pindex = nullptr;
+
+        CRescanPipeline::LookupFilterFn lookupFilter;
+        if (g_blockfilter_index) {
+            lookupFilter = [](BlockFilter& filter, const CBlockIndex* pindexRead) {
+                return g_blockfilter_index->LookupFilter(pindexRead, filter);
+            };
+        }
+        CRescanPipeline pipeline(vIndex, GetScanFilter(), nThreads, [&chainParams](CBlock& block, const CBlockIndex* pindexRead) {
+            return ReadBlockFromDisk(block, pindexRead, chainParams.GetConsensus());
+        }, lookupFilter);
+        CRescanBlock item;
+        while (pipeline.Next(item))
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(chainParams.TxData(), pindex) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            if (fAbortRescan) {
+                pindex = item.pindex;
+                break;
+            }
+            if (item.pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(chainParams.TxData(), item.pindex) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
             if (GetTime() >= nNow + 60) {
+                LogPrintf("Still rescanning. At block %d. Progress=%f, %.1f blocks/s\n", item.pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), item.pindex), (nBlocks - nBlocksAtLastLog) / (double)(GetTime() - nNow));
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
+                nBlocksAtLastLog = nBlocks;
+            }
+            nBlocks++;
+
+            if (!item.fRead) {
+                ret = item.pindex;
+                continue;
             }
+            if (item.fSkipped) {
+                // Nothing in the block pays to or spends from the wallet
+                nSkipped++;
+                continue;
+            }
+            nTransactions += item.block.vtx.size();
 
-            CBlock block;
-            if (ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
-                for (size_t posInBlock = 0; posInBlock < block.vtx.size(); ++posInBlock) {
-                    AddToWalletIfInvolvingMe(block.vtx[posInBlock], pindex, posInBlock, fUpdate);
+            LOCK2(cs_main, cs_wallet);
+            if (!chainActive.Contains(item.pindex)) {
+                // Reorganized away while being read; rescan the new branch.
+                pindex = chainActive.Next(chainActive.FindFork(item.pindex));
+                break;
+            }
+            const int64_t nKeypoolIndex = m_max_keypool_index;
+            std::vector<size_t>::const_iterator itMatch = item.vMatches.begin();
+            for (size_t posInBlock = 0; posInBlock < item.block.vtx.size(); ++posInBlock) {
+                // Besides transactions paying the wallet, its own transactions
+                // and ones spending or conflicting with them are relevant.
+                // Those can only be told apart here, in chain order.
+                bool fCandidate = itMatch != item.vMatches.end() && *itMatch == posInBlock;
+                if (fCandidate) {
+                    ++itMatch;
+                } else {
+                    const CTransaction& tx = *item.block.vtx[posInBlock];
+                    fCandidate = mapWallet.count(tx.GetHash()) != 0;
+                    for (size_t i = 0; !fCandidate && i < tx.vin.size(); i++) {
+                        fCandidate = mapWallet.count(tx.vin[i].prevout.hash) || mapTxSpends.count(tx.vin[i].prevout);
+                    }
+                }
+                if (fCandidate) {
+                    nCandidates++;
+                    AddToWalletIfInvolvingMe(item.block.vtx[posInBlock], item.pindex, posInBlock, fUpdate);
                 }
-            } else {
-                ret = pindex;
             }
-            pindex = chainActive.Next(pindex);
-        }
-        if (pindex && fAbortRescan) {
-            LogPrintf("Rescan aborted at block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
+            // Finding a keypool key in use tops up the keypool; match the
+            // blocks read ahead against the new keys as well.
+            if (m_max_keypool_index != nKeypoolIndex) {
+                pipeline.SetFilter(GetScanFilter());
+            }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
 
-        fScanningWallet = false;
+        if (!pindex && !fAbortRescan) {
+            LOCK(cs_main);
+            pindex = chainActive.Next(chainActive.FindFork(vIndex.back()));
+        }
+    }
+    if (pindex && fAbortRescan) {
+        LogPrintf("Rescan aborted at block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
     }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+    const double dSeconds = (GetTimeMicros() - nTimeStart) * 0.000001;
+    LogPrintf("Rescanned %u blocks (%u skipped by block filter, %u transactions, %u checked against the wallet) with %d threads in %.2fs, %.1f blocks/s\n",
+        nBlocks, nSkipped, nTransactions, nCandidates, nThreads, dSeconds, dSeconds > 0 ? nBlocks / dSeconds : 0.0);
+
+    fScanningWallet = false;
     return ret;
 }
 
+std::shared_ptr<const CWalletScanFilter> CWallet::GetScanFilter() const
+{
+    std::shared_ptr<CWalletScanFilter> filter = std::make_shared<CWalletScanFilter>();
+    LOCK(cs_KeyStore);
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    for (const CKeyID& keyID : setKeys) {
+        CPubKey pubkey;
+        if (GetPubKey(keyID, pubkey))
+            filter->AddKey(pubkey);
+        else
+            filter->AddKey(keyID);
+    }
+    for (const std::pair<const CScriptID, CScript>& script : mapScripts) {
+        filter->AddScript(script.second);
+    }
+    for (const CScript& script : setWatchOnly) {
+        filter->AddWatchOnly(script);
+    }
+    return filter;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     // If transactions aren't being broadcasted, don't let them into local mempool either
@@ -1699,11 +1979,7 @@ bool CWalletTx::RelayWalletTransaction(CConnman* connman)
         if (InMempool() || AcceptToMemoryPool(maxTxFee, state)) {
             LogPrintf("Relaying wtx %s\n", GetHash().ToString());
             if (connman) {
-                CInv inv(MSG_TX, GetHash());
-                connman->ForEachNode([&inv](CNode* pnode)
-                {
-                    pnode->PushInventory(inv);
-                });
+                RelayTransaction(*tx);
                 return true;
             }
         }
@@ -1723,6 +1999,21 @@ std::set<uint256> CWalletTx::GetConflicts() const
     return result;
 }
 
+void CWalletTx::MarkDirty()
+{
+    fCreditCached = false;
+    fAvailableCreditCached = false;
+    fImmatureCreditCached = false;
+    fWatchDebitCached = false;
+    fWatchCreditCached = false;
+    fAvailableWatchCreditCached = false;
+    fImmatureWatchCreditCached = false;
+    fDebitCached = false;
+    fChangeCached = false;
+    if (pwallet != nullptr)
+        pwallet->MarkBalanceDirty(GetHash());
+}
+
 CAmount CWalletTx::GetDebit(const isminefilter& filter) const
 {
     if (tx->vin.empty())
@@ -1993,9 +2284,11 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalances();
+        nTotal = balances.nConfirmedCredit;
+        for (const uint256& hash : balances.setUnconfirmed)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.at(hash);
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -2009,10 +2302,11 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalances();
+        for (const uint256& hash : balances.setUnconfirmed)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
+            const CWalletTx* pcoin = &mapWallet.at(hash);
+            if (!pcoin->IsTrusted() && pcoin->InMempool())
                 nTotal += pcoin->GetAvailableCredit();
         }
     }
@@ -2021,16 +2315,9 @@ CAmount CWallet::GetUnconfirmedBalance() const
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balances.nImmatureCredit;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
@@ -2038,9 +2325,11 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalances();
+        nTotal = balances.nConfirmedWatchCredit;
+        for (const uint256& hash : balances.setUnconfirmed)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.at(hash);
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -2054,10 +2343,11 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalances();
+        for (const uint256& hash : balances.setUnconfirmed)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
+            const CWalletTx* pcoin = &mapWallet.at(hash);
+            if (!pcoin->IsTrusted() && pcoin->InMempool())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
     }
@@ -2066,16 +2356,9 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balances.nImmatureWatchCredit;
 }
 
 // Calculate total balance in a different way from GetBalance. The biggest
@@ -2142,87 +2425,99 @@ void CWallet::AvailableCoins(std::vector<COutput> &vCoins, bool fOnlySafe, const
 
     {
         LOCK2(cs_main, cs_wallet);
+        UpdateBalances();
 
         CAmount nTotal = 0;
 
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // Only transactions that may have available outputs are visited:
+        // confirmed ones come with their unspent outputs of ours from the
+        // balance index, unconfirmed ones are checked here.
+        for (const uint256& wtxid : balances.setAvailable)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.at(wtxid);
+
+            int nDepth;
+            bool safeTx;
+            std::vector<std::pair<unsigned int, isminetype> > vUnconfirmedOutputs;
+            const std::vector<std::pair<unsigned int, isminetype> >* pvOutputs = &pcoin->vBalanceOutputs;
+            if (pcoin->nBalanceState == CWalletTx::BALANCE_CONFIRMED) {
+                // Transactions in the main chain are final, mature and trusted
+                nDepth = balances.pindexTip->nHeight - pcoin->nBalanceHeight + 1;
+                safeTx = true;
+            } else {
+                if (!CheckFinalTx(*pcoin))
+                    continue;
 
-            if (!CheckFinalTx(*pcoin))
-                continue;
+                nDepth = 0;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+                // We should not consider coins which aren't at least in our mempool
+                // It's possible for these to be conflicted via ancestors which we may never be able to detect
+                if (!pcoin->InMempool())
+                    continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
+                safeTx = pcoin->IsTrusted();
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
-                continue;
+                // We should not consider coins from transactions that are replacing
+                // other transactions.
+                //
+                // Example: There is a transaction A which is replaced by bumpfee
+                // transaction B. In this case, we want to prevent creation of
+                // a transaction B' which spends an output of B.
+                //
+                // Reason: If transaction A were initially confirmed, transactions B
+                // and B' would no longer be valid, so the user would have to create
+                // a new transaction C to replace B'. However, in the case of a
+                // one-block reorg, transactions B' and C might BOTH be accepted,
+                // when the user only wanted one of them. Specifically, there could
+                // be a 1-block reorg away from the chain where transactions A and C
+                // were accepted to another chain where B, B', and C were all
+                // accepted.
+                if (pcoin->mapValue.count("replaces_txid")) {
+                    safeTx = false;
+                }
 
-            bool safeTx = pcoin->IsTrusted();
-
-            // We should not consider coins from transactions that are replacing
-            // other transactions.
-            //
-            // Example: There is a transaction A which is replaced by bumpfee
-            // transaction B. In this case, we want to prevent creation of
-            // a transaction B' which spends an output of B.
-            //
-            // Reason: If transaction A were initially confirmed, transactions B
-            // and B' would no longer be valid, so the user would have to create
-            // a new transaction C to replace B'. However, in the case of a
-            // one-block reorg, transactions B' and C might BOTH be accepted,
-            // when the user only wanted one of them. Specifically, there could
-            // be a 1-block reorg away from the chain where transactions A and C
-            // were accepted to another chain where B, B', and C were all
-            // accepted.
-            if (nDepth == 0 && pcoin->mapValue.count("replaces_txid")) {
-                safeTx = false;
-            }
+                // Similarly, we should not consider coins from transactions that
+                // have been replaced. In the example above, we would want to prevent
+                // creation of a transaction A' spending an output of A, because if
+                // transaction B were initially confirmed, conflicting with A and
+                // A', we wouldn't want to the user to create a transaction D
+                // intending to replace A', but potentially resulting in a scenario
+                // where A, A', and D could all be accepted (instead of just B and
+                // D, or just A and A' like the user would want).
+                if (pcoin->mapValue.count("replaced_by_txid")) {
+                    safeTx = false;
+                }
 
-            // Similarly, we should not consider coins from transactions that
-            // have been replaced. In the example above, we would want to prevent
-            // creation of a transaction A' spending an output of A, because if
-            // transaction B were initially confirmed, conflicting with A and
-            // A', we wouldn't want to the user to create a transaction D
-            // intending to replace A', but potentially resulting in a scenario
-            // where A, A', and D could all be accepted (instead of just B and
-            // D, or just A and A' like the user would want).
-            if (nDepth == 0 && pcoin->mapValue.count("replaced_by_txid")) {
-                safeTx = false;
-            }
+                if (fOnlySafe && !safeTx) {
+                    continue;
+                }
 
-            if (fOnlySafe && !safeTx) {
-                continue;
+                for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
+                    if (IsSpent(wtxid, i))
+                        continue;
+
+                    isminetype mine = IsMine(pcoin->tx->vout[i]);
+                    if (mine != ISMINE_NO)
+                        vUnconfirmedOutputs.emplace_back(i, mine);
+                }
+                pvOutputs = &vUnconfirmedOutputs;
             }
 
             if (nDepth < nMinDepth || nDepth > nMaxDepth)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
-                if (pcoin->tx->vout[i].nValue < nMinimumAmount || pcoin->tx->vout[i].nValue > nMaximumAmount)
-                    continue;
+            for (const std::pair<unsigned int, isminetype>& output : *pvOutputs) {
+                const unsigned int i = output.first;
+                const isminetype mine = output.second;
 
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(COutPoint((*it).first, i)))
-                    continue;
-
-                if (IsLockedCoin((*it).first, i))
+                if (pcoin->tx->vout[i].nValue < nMinimumAmount || pcoin->tx->vout[i].nValue > nMaximumAmount)
                     continue;
 
-                if (IsSpent(wtxid, i))
+                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(COutPoint(wtxid, i)))
                     continue;
 
-                isminetype mine = IsMine(pcoin->tx->vout[i]);
-
-                if (mine == ISMINE_NO) {
+                if (IsLockedCoin(wtxid, i))
                     continue;
-                }
 
                 bool fSpendableIn = ((mine & ISMINE_SPENDABLE) != ISMINE_NO) || (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO);
                 bool fSolvableIn = (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO;
@@ -3146,8 +3441,13 @@ DBErrors CWallet::ZapSelectTx(std::vector<uint256>& vHashIn, std::vector<uint256
     AssertLockHeld(cs_wallet); // mapWallet
     vchDefaultKey = CPubKey();
     DBErrors nZapSelectTxRet = CWalletDB(*dbw,"cr+").ZapSelectTx(vHashIn, vHashOut);
-    for (uint256 hash : vHashOut)
-        mapWallet.erase(hash);
+    for (uint256 hash : vHashOut) {
+        std::map<uint256, CWalletTx>::iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end()) {
+            ForgetBalance(it->second);
+            mapWallet.erase(it);
+        }
+    }
 
     if (nZapSelectTxRet == DB_NEED_REWRITE)
     {
@@ -3917,6 +4217,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in %s/kB) to add to transactions you send (default: %s)"),
                                                             CURRENCY_UNIT, FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions on startup"));
+    strUsage += HelpMessageOpt("-rescanthreads=<n>", strprintf(_("Set the number of threads reading and matching blocks during a rescan (up to %d, 0 = one per core, <0 = leave that many cores free, default: %d)"), MAX_RESCAN_THREADS, DEFAULT_RESCAN_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet on startup"));
     strUsage += HelpMessageOpt("-spendzeroconfchange", strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), DEFAULT_SPEND_ZEROCONF_CHANGE));
     strUsage += HelpMessageOpt("-txconfirmtarget=<n>", strprintf(_("If paytxfee is not set, include enough fee so transactions begin confirmation on average within n blocks (default: %u)"), DEFAULT_TX_CONFIRM_TARGET));
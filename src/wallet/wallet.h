@@ -22,6 +22,7 @@
 #include <algorithm>
 #include <atomic>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdexcept>
 #include <stdint.h>
@@ -80,6 +81,7 @@ class CScript;
 class CScheduler;
 class CTxMemPool;
 class CBlockPolicyEstimator;
+class CWalletScanFilter;
 class CWalletTx;
 struct FeeCalculation;
 enum class FeeEstimateMode;
@@ -341,6 +343,22 @@ public:
     mutable CAmount nAvailableWatchCreditCached;
     mutable CAmount nChangeCached;
 
+    //! How this transaction currently counts towards CWallet's balance index
+    enum BalanceState {
+        BALANCE_UNKNOWN,        //!< not evaluated yet, queued in the index's dirty set
+        BALANCE_CONFIRMED,      //!< in the main chain and spendable
+        BALANCE_IMMATURE,       //!< coinbase in the main chain that has not matured
+        BALANCE_UNCONFIRMED,    //!< not in a block, evaluated against the mempool when queried
+        BALANCE_INACTIVE,       //!< conflicted, or an orphaned coinbase
+    };
+    mutable BalanceState nBalanceState;
+    mutable int nBalanceHeight; //!< height of the containing block if confirmed or immature
+    mutable bool fBalanceSpends; //!< whether the outputs this spends count as spent
+    mutable CAmount nBalanceCredit;
+    mutable CAmount nBalanceWatchCredit;
+    //! unspent outputs that are ours, if confirmed
+    mutable std::vector<std::pair<unsigned int, isminetype> > vBalanceOutputs;
+
     CWalletTx()
     {
         Init(nullptr);
@@ -379,6 +397,12 @@ public:
         nAvailableWatchCreditCached = 0;
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
+        nBalanceState = BALANCE_UNKNOWN;
+        nBalanceHeight = -1;
+        fBalanceSpends = false;
+        nBalanceCredit = 0;
+        nBalanceWatchCredit = 0;
+        vBalanceOutputs.clear();
         nOrderPos = -1;
     }
 
@@ -426,18 +450,7 @@ public:
     }
 
     //! make sure balances are recalculated
-    void MarkDirty()
-    {
-        fCreditCached = false;
-        fAvailableCreditCached = false;
-        fImmatureCreditCached = false;
-        fWatchDebitCached = false;
-        fWatchCreditCached = false;
-        fAvailableWatchCreditCached = false;
-        fImmatureWatchCreditCached = false;
-        fDebitCached = false;
-        fChangeCached = false;
-    }
+    void MarkDirty();
 
     void BindWallet(CWallet *pwalletIn)
     {
@@ -693,6 +706,42 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /* Snapshot of the keys and scripts a rescan matches outputs against. */
+    std::shared_ptr<const CWalletScanFilter> GetScanFilter() const;
+
+    /**
+     * Wallet balances and spendable outputs, maintained from the transactions
+     * marked dirty since the last update instead of walking mapWallet on each
+     * query. Confirmed and immature credit is kept as running totals;
+     * unconfirmed transactions depend on the mempool and are still evaluated
+     * when queried, but only those are walked.
+     */
+    struct BalanceIndex
+    {
+        std::set<uint256> setDirty;
+        std::set<uint256> setUnconfirmed;
+        std::set<uint256> setInactive;
+        //! confirmed transactions with unspent outputs of ours, and unconfirmed ones, in mapWallet order
+        std::set<uint256> setAvailable;
+        //! confirmed and immature transactions by height, to find those a reorg moves
+        std::multimap<int, uint256> mapHeight;
+        //! coinbases in the main chain by the height at which they mature
+        std::multimap<int, uint256> mapMaturity;
+        const CBlockIndex* pindexTip;
+        CAmount nConfirmedCredit;
+        CAmount nConfirmedWatchCredit;
+        CAmount nImmatureCredit;
+        CAmount nImmatureWatchCredit;
+
+        BalanceIndex() : pindexTip(nullptr), nConfirmedCredit(0), nConfirmedWatchCredit(0), nImmatureCredit(0), nImmatureWatchCredit(0) {}
+    };
+    mutable BalanceIndex balances;
+
+    /* Take a transaction's contribution out of the balance index. */
+    void ForgetBalance(const CWalletTx& wtx) const;
+    /* Bring the balance index up to date with the chain tip and the dirty transactions. */
+    void UpdateBalances() const;
+
     /* Used by TransactionAddedToMemorypool/BlockConnected/Disconnected.
      * Should be called with pindexBlock and posInBlock if this is for a transaction that is included in a block. */
     void SyncTransaction(const CTransactionRef& tx, const CBlockIndex *pindex = nullptr, int posInBlock = 0);
@@ -915,6 +964,8 @@ public:
     bool GetAccountPubkey(CPubKey &pubKey, std::string strAccount, bool bForceNew = false);
 
     void MarkDirty();
+    //! Queue a transaction for re-evaluation by the balance index
+    void MarkBalanceDirty(const uint256& hash) const;
     bool AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose=true);
     bool LoadToWallet(const CWalletTx& wtxIn);
     void TransactionAddedToMempool(const CTransactionRef& tx) override;
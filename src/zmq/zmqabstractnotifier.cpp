@@ -20,3 +20,8 @@ bool CZMQAbstractNotifier::NotifyTransaction(const CTransaction &/*transaction*/
 {
     return true;
 }
+
+bool CZMQAbstractNotifier::NotifyNetStats(const std::map<std::string, CMsgCmdStats> &/*mapStats*/)
+{
+    return true;
+}
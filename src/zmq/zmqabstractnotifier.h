@@ -7,8 +7,11 @@
 
 #include "zmqconfig.h"
 
+#include <map>
+
 class CBlockIndex;
 class CZMQAbstractNotifier;
+struct CMsgCmdStats;
 
 typedef CZMQAbstractNotifier* (*CZMQNotifierFactory)();
 
@@ -34,6 +37,7 @@ public:
 
     virtual bool NotifyBlock(const CBlockIndex *pindex);
     virtual bool NotifyTransaction(const CTransaction &transaction);
+    virtual bool NotifyNetStats(const std::map<std::string, CMsgCmdStats> &mapStats);
 
 protected:
     void *psocket;
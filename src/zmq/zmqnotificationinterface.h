@@ -12,6 +12,10 @@
 
 class CBlockIndex;
 class CZMQAbstractNotifier;
+struct CMsgCmdStats;
+
+/** Interval (in seconds) at which message statistics are published */
+static const int64_t ZMQ_NETSTATS_INTERVAL = 60;
 
 class CZMQNotificationInterface : public CValidationInterface
 {
@@ -20,6 +24,9 @@ public:
 
     static CZMQNotificationInterface* Create();
 
+    /** Publish per-message-type statistics, summed over all peers */
+    void NotifyNetStats(const std::map<std::string, CMsgCmdStats>& mapStats);
+
 protected:
     bool Initialize();
     void Shutdown();
@@ -4,6 +4,7 @@
 
 #include "chain.h"
 #include "chainparams.h"
+#include "net.h"
 #include "streams.h"
 #include "zmqpublishnotifier.h"
 #include "validation.h"
@@ -16,6 +17,7 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_NETSTATS  = "netstats";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -195,3 +197,11 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishNetStatsNotifier::NotifyNetStats(const std::map<std::string, CMsgCmdStats> &mapStats)
+{
+    LogPrint(BCLog::ZMQ, "zmq: Publish netstats\n");
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << mapStats;
+    return SendMessage(MSG_NETSTATS, &(*ss.begin()), ss.size());
+}
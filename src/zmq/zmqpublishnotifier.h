@@ -52,4 +52,10 @@ public:
     bool NotifyTransaction(const CTransaction &transaction) override;
 };
 
+class CZMQPublishNetStatsNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyNetStats(const std::map<std::string, CMsgCmdStats> &mapStats) override;
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H